@@ -0,0 +1,340 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+/*
+ * Benchmark client for block devices exported via Virtio block.
+ *
+ * Keeps a fixed number of requests in flight on the device and reports
+ * IOPS, bandwidth and the distribution of request latencies.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <string>
+#include <vector>
+
+#include <l4/re/env>
+#include <l4/re/error_helper>
+#include <l4/re/util/cap_alloc>
+#include <l4/sys/factory>
+#include <l4/sys/kip.h>
+#include <l4/l4virtio/virtio_block.h>
+#include <l4/l4virtio/client/virtio-block>
+
+#include <terminate_handler-l4>
+
+static char const *const usage_str =
+"Usage: %s [-c CAP | -d DEVICE [-S CAP]] [-q DEPTH] [-s BYTES] [-n COUNT]\n"
+"          [-t SECONDS] [-w PERCENT] [-r] [-o SECTOR] [-l SECTORS]\n\n"
+"Options:\n"
+" -c CAP      Capability of the virtio block device (default: dev)\n"
+" -d DEVICE   Create a session for the disk serial number or partition UUID\n"
+"             DEVICE at the driver instead of using -c\n"
+" -S CAP      Capability of the driver for -d (default: svr)\n"
+" -q DEPTH    Number of requests kept in flight (default: 1)\n"
+" -s BYTES    Size of a request in bytes (default: 4096)\n"
+" -n COUNT    Stop after COUNT requests (default: 10000)\n"
+" -t SECONDS  Stop after SECONDS seconds, overrides -n\n"
+" -w PERCENT  Share of write requests in percent (default: 0)\n"
+" -r          Random instead of sequential access\n"
+" -o SECTOR   First sector of the test range (default: 0)\n"
+" -l SECTORS  Length of the test range (default: rest of the device)\n";
+
+namespace {
+
+struct Options
+{
+  char const *capname = "dev";
+  char const *svrname = "svr";
+  char const *device = nullptr;
+  unsigned depth = 1;
+  l4_uint32_t size = 4096;
+  l4_uint64_t count = 10000;
+  l4_uint64_t seconds = 0;
+  unsigned write_percent = 0;
+  bool random = false;
+  l4_uint64_t offset = 0;
+  l4_uint64_t length = 0;
+};
+
+/// Small xorshift generator, good enough for choosing sectors.
+class Rng
+{
+public:
+  l4_uint64_t next()
+  {
+    _s ^= _s << 13;
+    _s ^= _s >> 7;
+    _s ^= _s << 17;
+    return _s;
+  }
+
+private:
+  l4_uint64_t _s = 0x9e3779b97f4a7c15ULL;
+};
+
+l4_kernel_clock_t now()
+{ return l4_kip_clock(l4re_kip()); }
+
+class Bench
+{
+  struct Slot
+  {
+    L4virtio::Driver::Block_device::Handle handle;
+    l4_kernel_clock_t start = 0;
+    l4_uint32_t type = 0;
+  };
+
+public:
+  explicit Bench(Options const &opts) : _opts(opts) {}
+
+  void setup();
+  void run();
+  void report() const;
+
+private:
+  L4::Cap<L4virtio::Device> create_session() const;
+  void submit(unsigned idx);
+  void complete(unsigned idx, unsigned char status);
+  bool finished() const;
+
+  Options _opts;
+  L4virtio::Driver::Block_device _dev;
+  void *_mem = nullptr;
+  L4virtio::Ptr<void> _devaddr;
+  l4_uint64_t _sectors_per_req = 0;
+  l4_uint64_t _range_reqs = 0;
+
+  std::vector<Slot> _slots;
+  std::vector<l4_uint32_t> _latencies;
+  Rng _rng;
+  l4_uint64_t _next_seq = 0;
+  l4_uint64_t _submitted = 0;
+  l4_uint64_t _completed = 0;
+  l4_uint64_t _writes = 0;
+  l4_uint64_t _errors = 0;
+  unsigned _in_flight = 0;
+  l4_kernel_clock_t _start = 0;
+  l4_kernel_clock_t _end = 0;
+};
+
+/**
+ * Create a virtio block session at the driver, like a create() call in the
+ * Lua configuration would.
+ */
+L4::Cap<L4virtio::Device>
+Bench::create_session() const
+{
+  auto svr = L4Re::chkcap(L4Re::Env::env()->get_cap<L4::Factory>(_opts.svrname),
+                          "Find driver capability.", -L4_ENOENT);
+  auto cap = L4Re::chkcap(L4Re::Util::cap_alloc.alloc<L4virtio::Device>(),
+                          "Allocate capability for the session.");
+
+  std::string device = std::string("device=") + _opts.device;
+  L4Re::chksys(l4_error(svr->create(cap, 0) << "ds-max=2" << device.c_str()),
+               "Create session at the driver.");
+  return cap;
+}
+
+void
+Bench::setup()
+{
+  L4::Cap<L4virtio::Device> cap;
+  if (_opts.device)
+    cap = create_session();
+  else
+    cap = L4Re::chkcap(L4Re::Env::env()->get_cap<L4virtio::Device>(_opts.capname),
+                       "Find virtio block device capability.", -L4_ENOENT);
+
+  _dev.setup_device(cap, l4_round_page(_opts.depth * _opts.size), &_mem,
+                    _devaddr);
+
+  auto const &cfg = _dev.device_config();
+  l4_uint32_t sector_size = cfg.blk_size ? cfg.blk_size : 512;
+  if (_opts.size == 0 || _opts.size % sector_size)
+    L4Re::chksys(-L4_EINVAL, "Request size must be a multiple of the "
+                             "sector size.");
+
+  // Virtio block always counts in 512-byte sectors.
+  _sectors_per_req = _opts.size / 512;
+  l4_uint64_t capacity = cfg.capacity;
+  if (_opts.offset >= capacity)
+    L4Re::chksys(-L4_EINVAL, "Test range outside of the device.");
+
+  l4_uint64_t length = _opts.length ? _opts.length : capacity - _opts.offset;
+  if (length > capacity - _opts.offset)
+    length = capacity - _opts.offset;
+
+  _range_reqs = length / _sectors_per_req;
+  if (_range_reqs == 0)
+    L4Re::chksys(-L4_EINVAL, "Test range smaller than a request.");
+
+  _slots.resize(_opts.depth);
+  if (!_opts.seconds)
+    _latencies.reserve(_opts.count);
+
+  printf("Device: %llu sectors, block size %u. Test range %llu+%llu, "
+         "%u bytes x %u in flight, %u%% writes, %s.\n",
+         capacity, sector_size, _opts.offset, length, _opts.size,
+         _opts.depth, _opts.write_percent,
+         _opts.random ? "random" : "sequential");
+}
+
+bool
+Bench::finished() const
+{
+  if (_opts.seconds)
+    return now() - _start >= _opts.seconds * 1000000;
+
+  return _submitted >= _opts.count;
+}
+
+void
+Bench::submit(unsigned idx)
+{
+  Slot &s = _slots[idx];
+
+  l4_uint64_t req;
+  if (_opts.random)
+    req = _rng.next() % _range_reqs;
+  else
+    req = _next_seq++ % _range_reqs;
+
+  s.type = (_rng.next() % 100) < _opts.write_percent ? L4VIRTIO_BLOCK_T_OUT
+                                                      : L4VIRTIO_BLOCK_T_IN;
+  s.handle = _dev.start_request(_opts.offset + req * _sectors_per_req, s.type,
+                                [this, idx](unsigned char status)
+                                  { complete(idx, status); });
+  if (!s.handle.valid())
+    L4Re::chksys(-L4_EBUSY, "Start request.");
+
+  L4Re::chksys(_dev.add_block(s.handle,
+                              L4virtio::Ptr<void>(_devaddr.get()
+                                                  + idx * _opts.size),
+                              _opts.size),
+               "Add data block to request.");
+
+  s.start = now();
+  L4Re::chksys(_dev.send_request(s.handle), "Send request.");
+
+  ++_submitted;
+  ++_in_flight;
+}
+
+void
+Bench::complete(unsigned idx, unsigned char status)
+{
+  Slot &s = _slots[idx];
+  l4_kernel_clock_t lat = now() - s.start;
+
+  --_in_flight;
+  ++_completed;
+  if (status != L4VIRTIO_BLOCK_S_OK)
+    ++_errors;
+  if (s.type == L4VIRTIO_BLOCK_T_OUT)
+    ++_writes;
+
+  _latencies.push_back(lat);
+
+  if (!finished())
+    submit(idx);
+}
+
+void
+Bench::run()
+{
+  _start = now();
+  for (unsigned i = 0; i < _opts.depth && !finished(); ++i)
+    submit(i);
+
+  while (_in_flight > 0)
+    {
+      L4Re::chksys(_dev.wait(0), "Wait for completion.");
+      _dev.process_used_queue();
+    }
+
+  _end = now();
+}
+
+void
+Bench::report() const
+{
+  l4_uint64_t us = _end - _start;
+  if (!us || _latencies.empty())
+    {
+      printf("No requests completed.\n");
+      return;
+    }
+
+  l4_uint64_t bytes = _completed * _opts.size;
+  printf("%llu requests (%llu writes, %llu errors) in %llu.%03llu s\n",
+         _completed, _writes, _errors, us / 1000000, (us / 1000) % 1000);
+  printf("IOPS: %llu  bandwidth: %llu KiB/s\n",
+         _completed * 1000000 / us, (bytes >> 10) * 1000000 / us);
+
+  std::vector<l4_uint32_t> lat(_latencies);
+  std::sort(lat.begin(), lat.end());
+
+  l4_uint64_t sum = 0;
+  for (auto l : lat)
+    sum += l;
+
+  auto pct = [&lat](unsigned permille)
+    { return lat[(lat.size() - 1) * permille / 1000]; };
+
+  printf("latency us: min %u avg %llu p50 %u p90 %u p99 %u p99.9 %u max %u\n",
+         lat.front(), sum / lat.size(), pct(500), pct(900), pct(990),
+         pct(999), lat.back());
+}
+
+} // namespace
+
+int
+main(int argc, char *const *argv)
+{
+  Options opts;
+
+  for (;;)
+    {
+      int opt = getopt(argc, argv, "c:d:S:q:s:n:t:w:ro:l:");
+      if (opt == -1)
+        break;
+
+      switch (opt)
+        {
+        case 'c': opts.capname = optarg; break;
+        case 'd': opts.device = optarg; break;
+        case 'S': opts.svrname = optarg; break;
+        case 'q': opts.depth = strtoul(optarg, nullptr, 0); break;
+        case 's': opts.size = strtoul(optarg, nullptr, 0); break;
+        case 'n': opts.count = strtoull(optarg, nullptr, 0); break;
+        case 't': opts.seconds = strtoull(optarg, nullptr, 0); break;
+        case 'w': opts.write_percent = strtoul(optarg, nullptr, 0); break;
+        case 'r': opts.random = true; break;
+        case 'o': opts.offset = strtoull(optarg, nullptr, 0); break;
+        case 'l': opts.length = strtoull(optarg, nullptr, 0); break;
+        default:
+          printf(usage_str, argv[0]);
+          return 1;
+        }
+    }
+
+  if (opts.depth == 0 || opts.write_percent > 100)
+    {
+      printf(usage_str, argv[0]);
+      return 1;
+    }
+
+  Bench bench(opts);
+  bench.setup();
+  bench.run();
+  bench.report();
+
+  return 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/sys/capability>
+#include <l4/sys/cxx/ipc_iface>
+
+/**
+ * Driver-internal copy between two disks or partitions.
+ *
+ * A copy job is created with object type Ahci_copy::Object_type on the
+ * factory capability of the driver:
+ *
+ *     create(2, "from=<UUID | SN>", "to=<UUID | SN>", "count=<sectors>"
+ *               [, "from-lba=<lba>"] [, "to-lba=<lba>"])
+ *
+ * The copy starts immediately and runs in the background. Deleting the
+ * returned capability cancels the copy.
+ */
+namespace Ahci_copy {
+
+enum
+{
+  /// Object type to pass to the `create()` call of the driver.
+  Object_type = 2,
+};
+
+/**
+ * IPC interface of a copy job.
+ */
+struct Copy_job : L4::Kobject_t<Copy_job, L4::Kobject>
+{
+  /**
+   * Return the progress of the copy.
+   *
+   * \param[out] done   Number of sectors copied so far.
+   * \param[out] total  Number of sectors to copy in total.
+   *
+   * \retval L4_EOK     The copy has finished successfully.
+   * \retval -L4_EBUSY  The copy is still in progress.
+   * \retval <0         The copy failed with the given error.
+   */
+  L4_INLINE_RPC(long, progress, (l4_uint64_t *done, l4_uint64_t *total));
+
+  typedef L4::Typeid::Rpcs<progress_t> Rpcs;
+};
+
+} // namespace Ahci_copy
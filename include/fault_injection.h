@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/sys/capability>
+#include <l4/sys/cxx/ipc_iface>
+
+/**
+ * Runtime control of fault injection into a port of the driver.
+ *
+ * Only available if the driver was built with AHCI_FAULT_INJECTION=y.
+ * A control object for one port is created with Ahci_fault::Object_type on
+ * the factory capability of the driver:
+ *
+ *     create(3, "port=<port>" [, "hba=<hba>"])
+ *
+ * Deleting the returned capability disables all faults of the port again.
+ */
+namespace Ahci_fault {
+
+enum
+{
+  /// Object type to pass to the `create()` call of the driver.
+  Object_type = 3,
+};
+
+/**
+ * Kinds of faults that can be injected.
+ */
+enum Fault
+{
+  Task_file_error,    ///< Completion interrupt reports TFES
+  Host_bus_fatal,     ///< Completion interrupt reports HBFS
+  Interface_fatal,    ///< Completion interrupt reports IFS
+  Dropped_completion, ///< Completion interrupt is ignored
+  Phy_ready_loss,     ///< Completion interrupt reports a PhyRdy change
+  Slow_command,       ///< Command is issued to the device with a delay
+  Num_faults
+};
+
+/**
+ * IPC interface for controlling the faults of a port.
+ */
+struct Fault_control : L4::Kobject_t<Fault_control, L4::Kobject>
+{
+  /**
+   * Set how often a fault is injected.
+   *
+   * \param fault     Kind of fault, see Fault.
+   * \param permille  Probability per command in 1/1000, 0 disables the fault.
+   * \param delay_ms  Delay of a Slow_command, ignored for other faults.
+   *
+   * \retval L4_EOK       The rate has been set.
+   * \retval -L4_EINVAL   Invalid fault or rate.
+   */
+  L4_INLINE_RPC(long, set_fault, (unsigned fault, unsigned permille,
+                                  unsigned delay_ms));
+
+  /**
+   * Return the statistics of a fault.
+   *
+   * \param      fault        Kind of fault, see Fault.
+   * \param[out] injected     Number of times the fault was injected.
+   * \param[out] affected     Number of requests in flight when injected.
+   * \param[out] recovered    Number of injections the port recovered from.
+   * \param[out] recovery_us  Total time from injection to recovery.
+   *
+   * \retval L4_EOK       Statistics returned.
+   * \retval -L4_EINVAL   Invalid fault.
+   */
+  L4_INLINE_RPC(long, stats, (unsigned fault, l4_uint64_t *injected,
+                              l4_uint64_t *affected, l4_uint64_t *recovered,
+                              l4_uint64_t *recovery_us));
+
+  typedef L4::Typeid::Rpcs<set_fault_t, stats_t> Rpcs;
+};
+
+} // namespace Ahci_fault
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/sys/capability>
+#include <l4/sys/cxx/ipc_iface>
+#include <l4/sys/irq>
+#include <l4/re/dataspace>
+
+/**
+ * Native shared-memory ring protocol of the AHCI driver.
+ *
+ * A ring session is created with object type Ahci_ring::Object_type on the
+ * factory capability of the driver. The client then sets up a dataspace
+ * containing a Ring_header, followed by a submission queue (SQ) of Sqe
+ * entries and a completion queue (CQ) of Cqe entries, both with the same
+ * power-of-two number of entries.
+ *
+ * Head and tail indices are free-running 32-bit counters. The producer
+ * of a queue writes the entries and then advances the tail, the consumer
+ * advances the head after it has read an entry. The client is the
+ * producer of the SQ and the consumer of the CQ.
+ *
+ * After having added any number of entries to the SQ, the client triggers
+ * the submission IRQ once. Completion entries are signalled via the
+ * completion IRQ, unless Cq_no_notify is set in the CQ flags. Signalling
+ * is coalesced: the IRQ is only triggered when the client had consumed
+ * all previous completions, so a client has to check the CQ once more
+ * after advancing its head before waiting for the IRQ.
+ *
+ * The number of requests that are submitted but whose completion has not
+ * been consumed yet must not exceed the ring size.
+ */
+namespace Ahci_ring {
+
+enum
+{
+  /// Object type to pass to the `create()` call of the driver.
+  Object_type = 1,
+  /// Maximum number of buffer dataspaces per session.
+  Max_buffers = 256,
+};
+
+/// Operation of a submission entry.
+enum Opcode : l4_uint8_t
+{
+  Op_read  = 0, ///< Read from device into buffer
+  Op_write = 1, ///< Write buffer to device
+  Op_flush = 2, ///< Flush volatile caches of the device
+};
+
+/// Flags of a submission entry.
+enum Sqe_flags : l4_uint8_t
+{
+  /// Start only after all earlier requests have completed and delay all
+  /// later requests until this one has completed.
+  Sqe_barrier   = 0x1,
+  /// Do not trigger the completion IRQ for this request.
+  Sqe_no_notify = 0x2,
+};
+
+/// Flags of the completion queue, set by the client.
+enum Cq_flags : l4_uint32_t
+{
+  /// Client polls the completion queue, do not trigger completion IRQs.
+  Cq_no_notify = 0x1,
+};
+
+/**
+ * Submission queue entry.
+ */
+struct Sqe
+{
+  /// Opaque value, returned unchanged in the completion entry.
+  l4_uint64_t user_data;
+  /// First sector of the transfer.
+  l4_uint64_t lba;
+  /// Offset of the data within the buffer dataspace.
+  l4_uint64_t offset;
+  /// Length of the transfer in bytes, a multiple of the sector size.
+  l4_uint32_t length;
+  /// Operation to execute, see Opcode.
+  l4_uint8_t opcode;
+  /// Request flags, see Sqe_flags.
+  l4_uint8_t flags;
+  /// Scheduling priority, requests with lower values are started first.
+  l4_uint8_t priority;
+  /// Index of the buffer dataspace as returned by register_buffer().
+  l4_uint8_t buffer;
+};
+
+static_assert(sizeof(Sqe) == 32, "Sqe structure wrongly packed.");
+
+/**
+ * Completion queue entry.
+ */
+struct Cqe
+{
+  /// User data of the submission entry.
+  l4_uint64_t user_data;
+  /// Number of bytes transferred or a negative error code.
+  l4_int32_t result;
+  l4_uint32_t reserved;
+};
+
+static_assert(sizeof(Cqe) == 16, "Cqe structure wrongly packed.");
+
+/**
+ * Indices of one queue, on a cache line of their own.
+ */
+struct Ring_index
+{
+  l4_uint32_t head;  ///< Next entry to be consumed
+  l4_uint32_t tail;  ///< Next entry to be produced
+  l4_uint32_t flags; ///< Queue flags
+  l4_uint32_t reserved[13];
+};
+
+static_assert(sizeof(Ring_index) == 64, "Ring_index structure wrongly packed.");
+
+/**
+ * Start of the shared ring memory.
+ */
+struct Ring_header
+{
+  Ring_index sq;
+  Ring_index cq;
+
+  /// Return the submission queue entries.
+  Sqe *sqes()
+  { return reinterpret_cast<Sqe *>(this + 1); }
+
+  /// Return the completion queue entries.
+  Cqe *cqes(unsigned entries)
+  { return reinterpret_cast<Cqe *>(sqes() + entries); }
+
+  /// Return the size of the ring memory for the given number of entries.
+  static l4_size_t size(unsigned entries)
+  { return sizeof(Ring_header) + entries * (sizeof(Sqe) + sizeof(Cqe)); }
+};
+
+/**
+ * IPC interface of a ring session.
+ */
+struct Ring_block : L4::Kobject_t<Ring_block, L4::Kobject>
+{
+  /**
+   * Return the geometry of the device.
+   *
+   * \param[out] capacity     Size of the device in bytes.
+   * \param[out] sector_size  Size of a sector in bytes.
+   * \param[out] max_size     Maximum length of a single request in bytes.
+   * \param[out] max_entries  Maximum number of ring entries.
+   */
+  L4_INLINE_RPC(long, info, (l4_uint64_t *capacity, l4_uint32_t *sector_size,
+                             l4_uint32_t *max_size, l4_uint32_t *max_entries));
+
+  /**
+   * Set up the shared ring.
+   *
+   * \param ring     Dataspace with the ring memory, starting at offset 0.
+   * \param entries  Number of entries in each queue, a power of two.
+   * \param cq_irq   IRQ to trigger on new completions.
+   * \param sq_irq   Capability slot receiving the submission IRQ.
+   */
+  L4_INLINE_RPC(long, setup, (L4::Ipc::Cap<L4Re::Dataspace> ring,
+                              l4_uint32_t entries,
+                              L4::Ipc::Cap<L4::Irq> cq_irq,
+                              L4::Ipc::Out<L4::Cap<L4::Irq> > sq_irq));
+
+  /**
+   * Register a dataspace for use as a data buffer.
+   *
+   * \param      ds     Buffer dataspace, must be DMA-able memory.
+   * \param[out] index  Index to use in the `buffer` field of Sqe.
+   */
+  L4_INLINE_RPC(long, register_buffer, (L4::Ipc::Cap<L4Re::Dataspace> ds,
+                                        l4_uint8_t *index));
+
+  typedef L4::Typeid::Rpcs<info_t, setup_t, register_buffer_t> Rpcs;
+};
+
+} // namespace Ahci_ring
@@ -6,11 +6,16 @@
  */
 
 #include <algorithm>
+#include <cstring>
 
 #include "ahci_device.h"
 #include "ahci_types.h"
+#include "block_list.h"
+#include "spinup_queue.h"
 
+#include <l4/libblock-device/errand.h>
 #include <l4/libblock-device/inout_memory.h>
+#include <l4/sys/cache.h>
 
 namespace {
 
@@ -40,6 +45,53 @@ namespace {
     s[0] = 0;
   }
 
+  /**
+   * Models that corrupt data or hang with queued TRIM, following the quirk
+   * list of Linux. Non-queued TRIM works on these.
+   */
+  char const *const queued_trim_quirks[] =
+  {
+    "Micron_M500_*",
+    "Micron_M510_*",
+    "Micron_M550_*",
+    "Crucial_CT*M500*",
+    "Crucial_CT*M550*",
+    "Crucial_CT*MX100*",
+    "FCCT*M500*",
+    "Samsung SSD 840*",
+    "Samsung SSD 850*",
+    "Samsung SSD 860*",
+    "Samsung SSD 870*",
+    "SuperSSpeed S238*",
+  };
+
+  /**
+   * Match a string against a pattern where `*` matches any sequence of
+   * characters.
+   */
+  bool
+  glob_match(char const *pattern, char const *s)
+  {
+    for (; *pattern; ++pattern, ++s)
+      {
+        if (*pattern == '*')
+          {
+            for (;; ++s)
+              {
+                if (glob_match(pattern + 1, s))
+                  return true;
+                if (!*s)
+                  return false;
+              }
+          }
+
+        if (*s != *pattern)
+          return false;
+      }
+
+    return !*s;
+  }
+
 } // name space
 
 namespace Ata { namespace Cmd {
@@ -47,22 +99,52 @@ namespace Ata { namespace Cmd {
 // only contains commands used in this file
 enum Ata_commands
 {
+  Data_set_management = 0x06,
+  Flush_cache       = 0xe7,
+  Flush_cache_ext   = 0xea,
   Id_device         = 0xec,
   Id_packet_device  = 0xa1,
   Read_dma          = 0xc8,
   Read_dma_ext      = 0x25,
+  Read_fpdma_queued = 0x60,
+  Read_log_ext      = 0x2f,
   Read_sector       = 0x20,
   Read_sector_ext   = 0x24,
+  Send_fpdma_queued = 0x64,
+  Set_features      = 0xef,
   Write_dma         = 0xca,
   Write_dma_ext     = 0x35,
+  Write_fpdma_queued = 0x61,
   Write_sector      = 0x30,
   Write_sector_ext  = 0x34,
 };
 
 } } // name space
 
+namespace Ata {
+
+enum
+{
+  /// TRIM bit of DATA SET MANAGEMENT, in the auxiliary field when queued.
+  Dsm_trim               = 0x1,
+  /// DATA SET MANAGEMENT subcommand of SEND FPDMA QUEUED.
+  Ncq_subcmd_dsm         = 0x0,
+  /// Log address of the NCQ send and receive log.
+  Ncq_send_recv_log      = 0x13,
+  /// Byte in the log with the supported subcommands.
+  Ncq_send_recv_subcmds  = 0,
+  /// Byte in the log with the supported DATA SET MANAGEMENT functions.
+  Ncq_send_recv_dsm      = 4,
+  /// SET FEATURES subcommand spinning up a device in Power-Up In Standby.
+  Sf_puis_spinup         = 0x07,
+};
+
+} // name space
+
 namespace Errand = Block_device::Errand;
 
+bool Ahci::Ahci_device::use_ncq = false;
+
 void
 Ahci::Ahci_device::start_device_scan(Errand::Callback const &callback)
 {
@@ -80,6 +162,19 @@ Ahci::Ahci_device::start_device_scan(Errand::Callback const &callback)
               {
                 printf("Infopage read from device.\n");
                 infopage->unmap();
+                l4_uint16_t const *id = infopage->get<l4_uint16_t>(0);
+                if (error == L4_EOK && !_puis_spun_up
+                    && (id[IID_specific_config] == Puis_spinup_incomplete
+                        || id[IID_specific_config] == Puis_spinup_complete))
+                  {
+                    // The identify data may be incomplete before the
+                    // spin-up, so read it again afterwards.
+                    _puis_spun_up = true;
+                    puis_spin_up(id[IID_rotation_rate] != 1,
+                                 [=]() { start_device_scan(callback); });
+                    return;
+                  }
+
                 if (error == L4_EOK)
                   {
                     _devinfo.features.s64a = _port->bus_width() == 64;
@@ -93,6 +188,12 @@ Ahci::Ahci_device::start_device_scan(Errand::Callback const &callback)
                                 _devinfo.features.dma ? "yes": "no");
                     info.printf("Number of sectors: %llu sector size: %zu\n",
                                 _devinfo.num_sectors, _devinfo.sector_size);
+                    info.printf("NCQ: %s  TRIM: %s\n",
+                                _devinfo.features.ncq ? "yes": "no",
+                                _devinfo.features.trim ? "yes": "no");
+                    _heatmap.init(_devinfo.num_sectors);
+                    setup_queuing(callback);
+                    return;
                   }
                 callback();
               };
@@ -124,16 +225,350 @@ Ahci::Ahci_device::start_device_scan(Errand::Callback const &callback)
               );
 }
 
+void
+Ahci::Ahci_device::puis_spin_up(bool rotating,
+                                Errand::Callback const &callback)
+{
+  auto spin_up = [=]()
+    {
+      Dbg::info().printf("Spinning up device from standby.\n");
+
+      auto cb = [=] (int error, l4_size_t)
+                  {
+                    if (rotating)
+                      Spinup_queue::get().release();
+                    if (error != L4_EOK)
+                      Dbg::warn().printf("Spin-up from standby failed.\n");
+                    callback();
+                  };
+
+      Errand::poll(10, 10000,
+                   [=] ()
+                     {
+                       Fis::Taskfile task;
+                       Fis::Datablock data;
+                       data.num_sectors = 0;
+                       task.command = Ata::Cmd::Set_features;
+                       task.features = Ata::Sf_puis_spinup;
+                       task.lba = 0;
+                       task.count = 0;
+                       task.sector_size = 512;
+                       task.flags = 0;
+                       task.icc = 0;
+                       task.control = 0;
+                       task.device = 0;
+                       task.data = &data;
+                       int ret = _port->send_command(task, cb);
+                       if (ret < 0 && ret != -L4_EBUSY)
+                         cb(ret, 0);
+                       return ret != -L4_EBUSY;
+                     },
+                   [=] (bool ret)
+                     {
+                       if (!ret)
+                         cb(-L4_EBUSY, 0);
+                     }
+                  );
+    };
+
+  // Devices without spinning media do not draw much power when they come
+  // up, so they need not wait for a slot.
+  if (rotating)
+    Spinup_queue::get().acquire(spin_up);
+  else
+    spin_up();
+}
+
+void
+Ahci::Ahci_device::setup_queuing(Errand::Callback const &callback)
+{
+  auto const &f = _devinfo.features;
+
+  if (f.trim)
+    {
+      unsigned slots = _port->max_slots();
+      _trim_mem = cxx::make_ref_obj<Driver_memory>(
+        (slots * Dsm_block_bytes + _devinfo.sector_size - 1)
+          / _devinfo.sector_size,
+        this, L4Re::Dma_space::Direction::To_device);
+      _trim_free = slots < 32 ? (1U << slots) - 1 : ~0U;
+    }
+
+  if (Read_coalescer::enabled)
+    {
+      _coalesce_mem = cxx::make_ref_obj<Driver_memory>(
+        Read_coalescer::Buffer_bytes / _devinfo.sector_size, this,
+        L4Re::Dma_space::Direction::From_device);
+      _coalescer.set_buffer(_coalesce_mem->get<char>(0),
+                            _coalesce_mem->inout_block().dma_addr);
+    }
+
+  _ncq = use_ncq && f.ncq && f.lba48 && f.dma && _port->ncq_supported();
+  if (!_ncq)
+    {
+      callback();
+      return;
+    }
+
+  unsigned depth = cxx::min(_devinfo.queue_depth, _port->max_slots());
+  _port->set_queue_depth(depth);
+  Dbg::info().printf("Native command queuing enabled, queue depth %u.\n",
+                     depth);
+
+  if (!f.trim || !f.ncq_send_recv)
+    {
+      callback();
+      return;
+    }
+
+  if (has_queued_trim_quirk(_devinfo.model_number))
+    {
+      Dbg::info().printf("Queued TRIM is broken on this model, "
+                         "using non-queued TRIM.\n");
+      callback();
+      return;
+    }
+
+  // Support for SEND FPDMA QUEUED does not imply that TRIM is available
+  // as queued command, the NCQ send and receive log tells.
+  auto log
+    = cxx::make_ref_obj<Block_device::Inout_memory<Ahci_device>>(
+        1, this, L4Re::Dma_space::Direction::From_device);
+
+  auto cb = [=] (int error, l4_size_t)
+              {
+                log->unmap();
+                l4_uint8_t const *page = log->get<l4_uint8_t>(0);
+                if (error == L4_EOK
+                    && (page[Ata::Ncq_send_recv_subcmds] & 1)
+                    && (page[Ata::Ncq_send_recv_dsm] & Ata::Dsm_trim))
+                  {
+                    _queued_trim = true;
+                    Dbg::info().printf("Queued TRIM enabled.\n");
+                  }
+                callback();
+              };
+
+  Errand::poll(10, 10000,
+               [=] ()
+                 {
+                   Fis::Taskfile task;
+                   Fis::Datablock data = log->inout_block();
+                   task.command = Ata::Cmd::Read_log_ext;
+                   task.lba = Ata::Ncq_send_recv_log;
+                   task.features = 0;
+                   task.count = 1;
+                   task.sector_size = 512;
+                   task.flags = 0;
+                   task.icc = 0;
+                   task.control = 0;
+                   task.device = 0x40;
+                   task.data = &data;
+                   int ret = _port->send_command(task, cb);
+                   if (ret < 0 && ret != -L4_EBUSY)
+                     callback();
+                   return ret != -L4_EBUSY;
+                 },
+               [=] (bool ret)
+                 {
+                   if (!ret)
+                     callback();
+                 }
+              );
+}
+
+bool
+Ahci::Ahci_device::has_queued_trim_quirk(char const *model)
+{
+  // The model number is padded with spaces.
+  std::string m(model);
+  m.erase(m.find_last_not_of(' ') + 1);
+
+  for (char const *pattern : queued_trim_quirks)
+    if (glob_match(pattern, m.c_str()))
+      return true;
+
+  return false;
+}
+
 int
 Ahci::Ahci_device::inout_data(l4_uint64_t sector,
                               Block_device::Inout_block const &blocks,
                               Block_device::Inout_callback const &cb,
                               L4Re::Dma_space::Direction dir)
+{
+  l4_size_t total = block_list_sectors(blocks);
+  Block_device::Inout_callback done = cb;
+  Read_coalescer::Read_ref read;
+  Block_device::Inout_block bounce;
+  if (Read_coalescer::enabled && total)
+    {
+      if (dir == L4Re::Dma_space::Direction::From_device)
+        {
+          if (_coalescer.attach(sector, blocks, cb))
+            return L4_EOK;
+
+          // A shared read goes to the bounce buffer, the data is copied to
+          // issuer and waiters before the issuer is completed.
+          read = _coalescer.start(sector, blocks, _devinfo.sector_size);
+          if (read)
+            {
+              _coalescer.buffer_block(read, &bounce);
+              done = [this, read, cb](int error, l4_size_t size)
+                {
+                  _coalescer.finish(read, error, size);
+                  cb(error, size);
+                };
+            }
+        }
+      else
+        _coalescer.invalidate(sector, total);
+    }
+
+  Block_device::Inout_block const &io = read ? bounce : blocks;
+
+  int ret;
+  if (total == 0 || (!Retry_policy::max_retries && !_retry.limit()))
+    ret = send_io(sector, io, done, dir);
+  else if (!io.next && (!_retry.limit() || total <= _retry.limit()))
+    {
+      // Most requests consist of a single block and succeed, so issue them
+      // directly and only set up a transfer once a retry is needed. The
+      // block is simple enough to keep a copy in the callback.
+      L4Re::Dma_space::Dma_addr dma_addr = io.dma_addr;
+      void *virt_addr = io.virt_addr;
+      ret = send_io(sector, io,
+                    [this, sector, total, dma_addr, virt_addr, done,
+                     dir](int error, l4_size_t size)
+                      {
+                        if (error < 0 && is_retryable(error)
+                            && Retry_policy::max_retries)
+                          {
+                            auto t = std::make_shared<Transfer>();
+                            t->sector = sector;
+                            t->total = total;
+                            t->blocks.dma_addr = dma_addr;
+                            t->blocks.virt_addr = virt_addr;
+                            t->blocks.num_sectors = total;
+                            t->cb = done;
+                            t->dir = dir;
+                            part_done(t, total, error, size);
+                            return;
+                          }
+
+                        if (error >= 0)
+                          _retry.success(max_size() / _devinfo.sector_size);
+                        else
+                          {
+                            _retry.failure(error, total, _devinfo.sector_size);
+                            _retry.gave_up();
+                          }
+                        done(error, size);
+                      }, dir);
+    }
+  else
+    {
+      // The block list is only valid until the command has been set up, so
+      // keep a copy for retries and for the later parts of a split transfer.
+      auto t = std::make_shared<Transfer>();
+      t->sector = sector;
+      t->total = total;
+      slice_blocks(&t->blocks, io, 0, total, _devinfo.sector_size);
+      t->cb = done;
+      t->dir = dir;
+
+      ret = submit_part(t);
+    }
+
+  if (ret < 0 && read)
+    _coalescer.cancel(read);
+
+  return ret;
+}
+
+int
+Ahci::Ahci_device::submit_part(std::shared_ptr<Transfer> const &t)
+{
+  l4_size_t count = t->total - t->done;
+  if (_retry.limit() && count > _retry.limit())
+    count = _retry.limit();
+
+  Block_device::Inout_block part;
+  slice_blocks(&part, t->blocks, t->done, count, _devinfo.sector_size);
+
+  return send_io(t->sector + t->done, part,
+                 [this, t, count](int error, l4_size_t size)
+                   { part_done(t, count, error, size); },
+                 t->dir);
+}
+
+void
+Ahci::Ahci_device::part_done(std::shared_ptr<Transfer> const &t,
+                             l4_size_t count, int error, l4_size_t size)
+{
+  if (error >= 0)
+    {
+      _retry.success(max_size() / _devinfo.sector_size);
+      if (t->retries)
+        {
+          _retry.recovered();
+          t->retries = 0;
+        }
+
+      t->done += count;
+      t->bytes += size;
+      if (t->done == t->total)
+        t->cb(L4_EOK, t->bytes);
+      else
+        continue_transfer(t, 0);
+
+      return;
+    }
+
+  _retry.failure(error, count, _devinfo.sector_size);
+  if (!is_retryable(error) || t->retries >= Retry_policy::max_retries)
+    {
+      _retry.gave_up();
+      t->cb(error, t->bytes);
+      return;
+    }
+
+  ++t->retries;
+  _retry.retried();
+  Dbg::trace().printf("Retrying transfer at sector 0x%llx (attempt %u).\n",
+                      t->sector + t->done, t->retries);
+  continue_transfer(t, Retry_policy::Retry_delay_us);
+}
+
+void
+Ahci::Ahci_device::continue_transfer(std::shared_ptr<Transfer> const &t,
+                                     unsigned delay_us)
+{
+  // Completions may arrive from the interrupt handler, so the next part
+  // is always issued from an errand.
+  Block_device::Errand::schedule([this, t]()
+    {
+      int ret = submit_part(t);
+      if (ret == -L4_EBUSY)
+        continue_transfer(t, Busy_retry_us);
+      else if (ret < 0)
+        t->cb(ret, t->bytes);
+    }, delay_us);
+}
+
+int
+Ahci::Ahci_device::send_io(l4_uint64_t sector,
+                           Block_device::Inout_block const &blocks,
+                           Block_device::Inout_callback const &cb,
+                           L4Re::Dma_space::Direction dir)
 {
   l4_size_t numsec = 0;
   for (auto const *block = &blocks; block; block = block->next.get())
     numsec += block->num_sectors;
 
+  // numsec is adjusted to the ATA encoding below
+  l4_size_t const total_sectors = numsec;
+
   if (_devinfo.features.lba48)
     {
       if (numsec <= 0 || numsec > 65536 || sector > ((l4_uint64_t)1 << 48))
@@ -190,6 +625,17 @@ Ahci::Ahci_device::inout_data(l4_uint64_t sector,
 
   task.lba = sector;
   task.count = numsec;
+  if (_ncq)
+    {
+      // Queued commands take the sector count in the features field, the
+      // count field carries the tag.
+      task.command = dir == L4Re::Dma_space::Direction::To_device
+                     ? Ata::Cmd::Write_fpdma_queued
+                     : Ata::Cmd::Read_fpdma_queued;
+      task.flags |= Fis::Chf_queued;
+      task.features = numsec;
+      task.count = 0;
+    }
   task.device = 0x40;
   task.data = &blocks;
   task.sector_size = _devinfo.sector_size;
@@ -200,14 +646,159 @@ Ahci::Ahci_device::inout_data(l4_uint64_t sector,
   Dbg::trace().printf("IO to disk starting sector 0x%llx via slot %d\n",
                       sector, ret);
 
-  return (ret >= 0) ? L4_EOK : ret;
+  if (ret < 0)
+    return ret;
+
+  _port->note_client_io();
+  _heatmap.record(sector, dir);
+  return L4_EOK;
 }
 
 int
 Ahci::Ahci_device::flush(Block_device::Inout_callback const &cb)
 {
-  // TODO: flush the internal caches before completing the FLUSH
-  cb(0, 0);
+  // FLUSH CACHE transfers no data, the empty block results in an empty
+  // PRD table.
+  Fis::Datablock data;
+  data.dma_addr = 0;
+  data.virt_addr = nullptr;
+  data.num_sectors = 0;
+
+  Fis::Taskfile task;
+  task.command = _devinfo.features.lba48 ? Ata::Cmd::Flush_cache_ext
+                                         : Ata::Cmd::Flush_cache;
+  task.features = 0;
+  task.lba = 0;
+  task.count = 0;
+  task.device = 0x40;
+  task.icc = 0;
+  task.control = 0;
+  task.flags = 0;
+  task.data = &data;
+  task.sector_size = _devinfo.sector_size;
+
+  int ret = _port->send_command(task,
+                                [cb](int error, l4_size_t)
+                                  { cb(error, 0); });
+  Dbg::trace().printf("FLUSH CACHE via slot %d\n", ret);
+  if (ret < 0)
+    return ret;
+
+  _port->note_client_io();
+  return L4_EOK;
+}
+
+Block_device::Device_discard_feature::Discard_info
+Ahci::Ahci_device::discard_info() const
+{
+  Discard_info di;
+  if (_trim_mem)
+    {
+      // Every segment must fit into a single range entry of the payload.
+      di.max_discard_sectors = Dsm_range_max;
+      di.max_discard_seg = Dsm_block_entries;
+      di.discard_sector_alignment = 1;
+    }
+  return di;
+}
+
+int
+Ahci::Ahci_device::discard(l4_uint64_t offset,
+                           Block_device::Inout_block const &blocks,
+                           Block_device::Inout_callback const &cb,
+                           bool discard)
+{
+  // Write zeroes is not advertised.
+  if (!discard || !_trim_mem)
+    return -L4_ENOSYS;
+
+  unsigned entries = 0;
+  for (auto const *b = &blocks; b; b = b->next.get())
+    {
+      if (offset + b->sector > _devinfo.num_sectors
+          || b->num_sectors > _devinfo.num_sectors - offset - b->sector)
+        return -L4_EINVAL;
+
+      entries += (b->num_sectors + Dsm_range_max - 1) / Dsm_range_max;
+    }
+
+  if (entries > Dsm_block_entries)
+    return -L4_EINVAL;
+
+  if (!_trim_free)
+    return -L4_EBUSY;
+
+  if (Read_coalescer::enabled)
+    for (auto const *b = &blocks; b; b = b->next.get())
+      _coalescer.invalidate(offset + b->sector, b->num_sectors);
+
+  unsigned buf = __builtin_ctz(_trim_free);
+  l4_uint64_t *payload = _trim_mem->get<l4_uint64_t>(buf * Dsm_block_bytes);
+
+  // Each entry holds the LBA in bits 47:0 and the sector count above.
+  unsigned i = 0;
+  for (auto const *b = &blocks; b; b = b->next.get())
+    {
+      l4_uint64_t lba = offset + b->sector;
+      for (l4_uint64_t left = b->num_sectors; left;)
+        {
+          l4_uint64_t n = cxx::min<l4_uint64_t>(left, Dsm_range_max);
+          payload[i++] = lba | (n << 48);
+          lba += n;
+          left -= n;
+        }
+    }
+
+  // Entries with a count of zero are ignored by the device.
+  memset(payload + i, 0, (Dsm_block_entries - i) * sizeof(*payload));
+  l4_cache_dma_coherent(reinterpret_cast<unsigned long>(payload),
+                        reinterpret_cast<unsigned long>(payload
+                                                        + Dsm_block_entries));
+
+  Fis::Datablock data;
+  data.dma_addr = _trim_mem->inout_block().dma_addr + buf * Dsm_block_bytes;
+  data.virt_addr = payload;
+  data.num_sectors = 1;
+
+  Fis::Taskfile task;
+  task.lba = 0;
+  task.device = 0x40;
+  task.icc = 0;
+  task.control = 0;
+  task.flags = Fis::Chf_write;
+  task.data = &data;
+  task.sector_size = Dsm_block_bytes;
+
+  if (_queued_trim)
+    {
+      task.command = Ata::Cmd::Send_fpdma_queued;
+      task.flags |= Fis::Chf_queued;
+      task.features = 1; // number of payload blocks
+      task.count = Ata::Ncq_subcmd_dsm << 8;
+      task.aux = Ata::Dsm_trim;
+    }
+  else
+    {
+      task.command = Ata::Cmd::Data_set_management;
+      task.features = Ata::Dsm_trim;
+      task.count = 1; // number of payload blocks
+    }
+
+  _trim_free &= ~(1U << buf);
+  int ret = _port->send_command(task,
+                                [this, buf, cb](int error, l4_size_t)
+                                  {
+                                    _trim_free |= 1U << buf;
+                                    cb(error, 0);
+                                  });
+  Dbg::trace().printf("%s of %u ranges via slot %d\n",
+                      _queued_trim ? "Queued TRIM" : "TRIM", i, ret);
+  if (ret < 0)
+    {
+      _trim_free |= 1U << buf;
+      return ret;
+    }
+
   return L4_EOK;
 }
 
@@ -239,6 +830,21 @@ Ahci::Ahci_device::Device_info::set_device_info(l4_uint16_t const *info)
   // XXX where is the read-only bit hiding again?
   features.ro = 0;
 
+  // Word 76 is only valid for Serial ATA devices.
+  if (info[IID_sata_capabilities] != 0 && info[IID_sata_capabilities] != 0xFFFF)
+    {
+      features.ncq = info[IID_sata_capabilities] >> 8;
+      features.ncq_send_recv = info[IID_sata_capabilities2] >> 6;
+    }
+  else
+    {
+      features.ncq = 0;
+      features.ncq_send_recv = 0;
+    }
+  queue_depth = (info[IID_queue_depth] & 0x1F) + 1;
+  // DATA SET MANAGEMENT is a 48-bit command.
+  features.trim = features.lba48 && (info[IID_dsm_support] & 1);
+
 
   sector_size = 2 * (l4_size_t(info[IID_logsector_size + 1]) << 16
                      | l4_size_t(info[IID_logsector_size]));
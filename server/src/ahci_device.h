@@ -6,11 +6,21 @@
  */
 #pragma once
 
+#include <memory>
 #include <string>
 
+#include <l4/cxx/minmax>
+#include <l4/cxx/ref_ptr>
+
 #include "ahci_port.h"
+#include "block_list.h"
+#include "heatmap.h"
+#include "range_lock.h"
+#include "read_coalescer.h"
+#include "retry_policy.h"
 
 #include <l4/libblock-device/device.h>
+#include <l4/libblock-device/inout_memory.h>
 
 namespace Ahci {
 
@@ -18,9 +28,71 @@ struct Device : Block_device::Device
 {
   /// Return the maximum number of requests the device can handle in parallel.
   virtual unsigned max_in_flight() const = 0;
+
+  /// Return the hardware ID string (serial number or partition UUID).
+  virtual std::string const &hid() const = 0;
+
+  /// Return the first sector of the device on the underlying disk.
+  virtual l4_uint64_t start_sector() const
+  { return 0; }
+
+  /// Return the lock ordering requests of shared-write clients.
+  Range_lock &range_lock()
+  { return _range_lock; }
+
+  /// Return the number of clients connected to the device.
+  unsigned num_clients() const
+  { return _clients; }
+
+  /// Return true if a client needs the device for itself.
+  bool is_reserved() const
+  { return _reservations; }
+
+private:
+  friend class Client_registration;
+
+  Range_lock _range_lock{this};
+  unsigned _clients = 0;
+  unsigned _reservations = 0;
+};
+
+/**
+ * Registration of a client with the device it is connected to.
+ *
+ * The client counts for Device::num_clients() as long as the registration
+ * exists. An exclusive client also reserves the device, no other clients
+ * are to be connected while it exists.
+ */
+class Client_registration
+{
+public:
+  explicit Client_registration(cxx::Ref_ptr<Device> const &dev,
+                               bool exclusive = false)
+  : _dev(dev), _exclusive(exclusive)
+  {
+    ++_dev->_clients;
+    if (_exclusive)
+      ++_dev->_reservations;
+  }
+
+  ~Client_registration()
+  {
+    --_dev->_clients;
+    if (_exclusive)
+      --_dev->_reservations;
+  }
+
+  Client_registration(Client_registration const &) = delete;
+  Client_registration &operator = (Client_registration const &) = delete;
+
+private:
+  cxx::Ref_ptr<Device> _dev;
+  bool _exclusive;
 };
 
-class Ahci_device : public Block_device::Device_with_notification_domain<Device>
+class Ahci_device
+: public Block_device::Device_with_notification_domain<Device>,
+  public Block_device::Device_discard_feature
 {
   /**
    * Layout of device info page returned by the identify device command.
@@ -29,6 +101,7 @@ class Ahci_device : public Block_device::Device_with_notification_domain<Device>
    */
   enum Identify_Device_Data
   {
+    IID_specific_config         = 2,
     IID_serialnum_ofs           = 10,
     IID_serialnum_len           = 20,
     IID_firmwarerev_ofs         = 23,
@@ -37,11 +110,25 @@ class Ahci_device : public Block_device::Device_with_notification_domain<Device>
     IID_modelnum_len            = 40,
     IID_capabilities            = 49,
     IID_addressable_sectors     = 60,
+    IID_queue_depth             = 75,
+    IID_sata_capabilities       = 76,
+    IID_sata_capabilities2      = 77,
     IID_ata_major_rev           = 80,
     IID_ata_minor_rev           = 81,
     IID_enabled_features        = 85,
     IID_lba_addressable_sectors = 100,
     IID_logsector_size          = 117,
+    IID_dsm_support             = 169,
+    IID_rotation_rate           = 217,
+  };
+
+  /// Values of IID_specific_config for a device in Power-Up In Standby.
+  enum Specific_config
+  {
+    /// Spin-up by SET FEATURES required, identify data incomplete.
+    Puis_spinup_incomplete      = 0x37c8,
+    /// Spin-up by SET FEATURES required, identify data complete.
+    Puis_spinup_complete        = 0x738c,
   };
 
   /**
@@ -70,6 +157,8 @@ class Ahci_device : public Block_device::Device_with_notification_domain<Device>
     l4_size_t sector_size;
     /** Number of logical sectors */
     l4_uint64_t num_sectors;
+    /** Number of queued commands the device accepts */
+    unsigned queue_depth;
     /** Feature bitvector */
     struct
     {
@@ -78,6 +167,9 @@ class Ahci_device : public Block_device::Device_with_notification_domain<Device>
       unsigned lba48 : 1;    ///< extended 48-bit addressing enabled
       unsigned s64a : 1;     ///< Bus supports 64bit addressing
       unsigned ro : 1;       ///< device is read=only (XXX not implemented)
+      unsigned ncq : 1;      ///< native command queuing supported
+      unsigned ncq_send_recv : 1; ///< SEND/RECEIVE FPDMA QUEUED supported
+      unsigned trim : 1;     ///< DATA SET MANAGEMENT TRIM supported
     } features;
 
     /**
@@ -90,7 +182,16 @@ class Ahci_device : public Block_device::Device_with_notification_domain<Device>
 
 
 public:
-  Ahci_device(Ahci_port *port) : _port(port) {}
+  /**
+   * Use native command queuing for reads, writes and discards on devices
+   * and HBAs that support it.
+   */
+  static bool use_ncq;
+
+  Ahci_device(Ahci_port *port)
+  : _port(port), _heatmap(_devinfo.hid), _retry(_devinfo.hid),
+    _coalescer(_devinfo.hid)
+  {}
 
   bool is_read_only() const override
   { return _devinfo.features.ro; }
@@ -105,14 +206,25 @@ public:
   { return _devinfo.sector_size; }
 
   l4_size_t max_size() const override
-  { return 0x400000; }
+  {
+    // Limited by the sector count of a single ATA command. Additionally,
+    // half of the PRD table is kept back for segments that need to be
+    // split because they are larger than a single PRD entry.
+    l4_size_t count_max = (_devinfo.features.lba48 ? 65536 : 256)
+                          * _devinfo.sector_size;
+    return cxx::min<l4_size_t>(count_max, (Command_table::Max_entries / 2)
+                                          * Command_table::Prd_max_bytes);
+  }
 
   unsigned max_segments() const override
-  { return Command_table::Max_entries; }
+  { return Command_table::Max_entries - max_size() / Command_table::Prd_max_bytes; }
 
   unsigned max_in_flight() const override
   { return _port->max_slots(); }
 
+  std::string const &hid() const override
+  { return _devinfo.hid; }
+
   void reset() override
   {} // TODO
 
@@ -139,12 +251,82 @@ public:
 
   void start_device_scan(Block_device::Errand::Callback const &callback) override;
 
+  Discard_info discard_info() const override;
+
+  int discard(l4_uint64_t offset, Block_device::Inout_block const &blocks,
+              Block_device::Inout_callback const &cb, bool discard) override;
+
   static bool is_compatible_device(Ahci_port *port)
   { return port->device_type() == Ahci_port::Ahcidev_ata; }
 
 private:
+  /// Transfer that is retried or split according to the retry policy.
+  struct Transfer
+  {
+    l4_uint64_t sector;
+    l4_size_t total;
+    /// Sectors transferred successfully so far.
+    l4_size_t done = 0;
+    l4_size_t bytes = 0;
+    unsigned retries = 0;
+    /// Copy of the block list of the client.
+    Block_device::Inout_block blocks;
+    Block_device::Inout_callback cb;
+    L4Re::Dma_space::Direction dir;
+  };
+
+  enum
+  {
+    /// Time to back off when a later part of a transfer finds no free slot.
+    Busy_retry_us = 1000,
+    /// Size of a DATA SET MANAGEMENT payload block in bytes.
+    Dsm_block_bytes = 512,
+    /// Number of LBA ranges in a payload block.
+    Dsm_block_entries = Dsm_block_bytes / 8,
+    /// Maximum number of sectors in a single LBA range entry.
+    Dsm_range_max = 0xFFFF,
+  };
+
+  using Driver_memory = Block_device::Inout_memory<Ahci_device>;
+
+  int send_io(l4_uint64_t sector, Block_device::Inout_block const &blocks,
+              Block_device::Inout_callback const &cb,
+              L4Re::Dma_space::Direction dir);
+  /**
+   * Return whether a failed transfer may succeed when issued again.
+   *
+   * Only interface errors and timeouts are transient. Errors reported by
+   * the device itself, like an uncorrectable sector, persist.
+   */
+  static bool is_retryable(int error)
+  { return error == Ahci_port::Interface_error || error == -L4_ETIMEDOUT; }
+
+  int submit_part(std::shared_ptr<Transfer> const &t);
+  void part_done(std::shared_ptr<Transfer> const &t, l4_size_t count,
+                 int error, l4_size_t size);
+  void continue_transfer(std::shared_ptr<Transfer> const &t,
+                         unsigned delay_us);
+  void setup_queuing(Block_device::Errand::Callback const &callback);
+  void puis_spin_up(bool rotating,
+                    Block_device::Errand::Callback const &callback);
+  static bool has_queued_trim_quirk(char const *model);
+
   Device_info _devinfo;
   Ahci_port *_port;
+  Lba_heatmap _heatmap;
+  Retry_policy _retry;
+  Read_coalescer _coalescer;
+  /// The device has been spun up from Power-Up In Standby.
+  bool _puis_spun_up = false;
+  /// Reads and writes are issued as queued commands.
+  bool _ncq = false;
+  /// Discards are issued as queued commands.
+  bool _queued_trim = false;
+  /// Payload blocks of discards, one per command slot.
+  cxx::Ref_ptr<Driver_memory> _trim_mem;
+  l4_uint32_t _trim_free = 0;
+  /// Bounce buffer of the read coalescer.
+  cxx::Ref_ptr<Driver_memory> _coalesce_mem;
 };
 
 
@@ -20,12 +20,19 @@ public:
   Partitioned_device(cxx::Ref_ptr<Device> const &dev, unsigned partition_id,
                      Block_device::Partition_info const &pi)
   : Block_device::Partitioned_device<Ahci::Device>(dev, partition_id, pi),
+    _hid(pi.guid), _start(pi.first),
     _current_in_flight(0), _max_in_flight(parent()->max_in_flight())
   {}
 
+  l4_uint64_t start_sector() const override
+  { return parent()->start_sector() + _start; }
+
   unsigned max_in_flight() const override
   { return _max_in_flight; }
 
+  std::string const &hid() const override
+  { return _hid; }
+
   int inout_data(l4_uint64_t sector, Block_device::Inout_block const &blocks,
                  Block_device::Inout_callback const &cb,
                  L4Re::Dma_space::Direction dir) override
@@ -84,6 +91,8 @@ public:
   }
 
 private:
+  std::string _hid;
+  l4_uint64_t _start;
   unsigned _current_in_flight;
   unsigned _max_in_flight;
 };
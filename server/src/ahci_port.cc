@@ -5,6 +5,7 @@
  * License: see LICENSE.spdx (in this directory or the directories above)
  */
 
+#include <l4/cxx/minmax>
 #include <l4/re/env>
 #include <l4/re/error_helper>
 
@@ -15,6 +16,7 @@
 
 #include "ahci_port.h"
 #include "debug.h"
+#include "spinup_queue.h"
 
 #if (__BYTE_ORDER == __BIG_ENDIAN)
 # error "Big endian byte order not implemented."
@@ -52,6 +54,10 @@ Command_slot::setup_command(Fis::Taskfile const &task, Fis::Callback const &cb,
   fis[13] = (task.count >> 8) & 0xFF;
   fis[14] = task.icc;
   fis[15] = task.control;
+  fis[16] = task.aux & 0xFF;
+  fis[17] = (task.aux >> 8) & 0xFF;
+  fis[18] = (task.aux >> 16) & 0xFF;
+  fis[19] = (task.aux >> 24) & 0xFF;
 
   // now add the slot information
   _cmd_header->flags = 0;
@@ -80,17 +86,30 @@ Command_slot::setup_data(Fis::Datablock const &data, l4_uint32_t sector_size)
 #endif
 
   unsigned i = 0;
-  for (Fis::Datablock const *block = &data;
-       block && i < Command_table::Max_entries;
-       ++i, block = block->next.get())
+  for (Fis::Datablock const *block = &data; block; block = block->next.get())
     {
-      _cmd_table->prd[i].dba = block->dma_addr;
-      if (sizeof(l4_addr_t) == 8)
-        _cmd_table->prd[i].dbau = (l4_uint64_t) block->dma_addr >> 32;
-      else
-        _cmd_table->prd[i].dbau = 0;
-      _cmd_table->prd[i].dbc = (block->num_sectors * sector_size) - 1;
-      // TODO: cache: make sure client data is flushed
+      L4Re::Dma_space::Dma_addr addr = block->dma_addr;
+      l4_uint64_t len = l4_uint64_t(block->num_sectors) * sector_size;
+
+      while (len > 0)
+        {
+          if (i >= Command_table::Max_entries)
+            return -L4_EINVAL;
+
+          l4_uint32_t chunk = cxx::min<l4_uint64_t>(len,
+                                                    Command_table::Prd_max_bytes);
+          _cmd_table->prd[i].dba = addr;
+          if (sizeof(l4_addr_t) == 8)
+            _cmd_table->prd[i].dbau = (l4_uint64_t) addr >> 32;
+          else
+            _cmd_table->prd[i].dbau = 0;
+          _cmd_table->prd[i].dbc = chunk - 1;
+          // TODO: cache: make sure client data is flushed
+
+          addr += chunk;
+          len -= chunk;
+          ++i;
+        }
     }
 
   _cmd_header->prdtl() = i;
@@ -104,19 +123,31 @@ Command_slot::setup_data(Fis::Datablock const &data, l4_uint32_t sector_size)
 
 
 int
-Ahci_port::attach(l4_addr_t base_addr, unsigned buswidth,
+Ahci_port::attach(unsigned portno, l4_addr_t base_addr, unsigned buswidth,
                   L4Re::Util::Shared_cap<L4Re::Dma_space> const &dma_space)
 {
   if (_state != S_undefined)
     return -L4_EEXIST;
 
+  _portno = portno;
   trace.printf("Attaching port to address 0x%lx\n", base_addr);
 
   _regs = new L4drivers::Mmio_register_block<32>(base_addr);
   _buswidth = buswidth;
+  _attached_at = now();
 
   _state = S_present;
 
+  // Without the spin-up bit there is no link yet, so it is not known
+  // whether a device is attached.
+  if (_sss && !(_regs[Regs::Port::Cmd] & Regs::Port::Cmd_sud))
+    {
+      _devtype = Ahcidev_unknown;
+      _dma_space = dma_space;
+      _spinup_pending = true;
+      return L4_EOK;
+    }
+
   if (!device_present())
     {
       trace.printf("Device not present @0x%lx. Device state 0x%x\n", base_addr,
@@ -168,17 +199,7 @@ Ahci_port::initialize_memory(unsigned maxslots)
 
   Dbg::trace().printf("Initializing port @%p.\n", _cmd_data.get());
 
-  // setup command list
-  l4_addr_t addr = _cmddata_paddr + offsetof(Command_data, headers);
-  _regs[Regs::Port::Clb] = addr;
-  _regs[Regs::Port::Clbu] = (sizeof(l4_addr_t) == 8)
-                            ? ((l4_uint64_t) addr >> 32) : 0;
-
-  // setup FIS receive region
-  addr = _cmddata_paddr + offsetof(Command_data, fis);
-  _regs[Regs::Port::Fb] = addr;
-  _regs[Regs::Port::Fbu] = (sizeof(l4_addr_t) == 8)
-                           ? ((l4_uint64_t) addr >> 32) : 0;
+  setup_memory_regs();
 
   // enable FIS buffer
   _regs[Regs::Port::Cmd].set(Regs::Port::Cmd_fre);
@@ -231,6 +252,165 @@ Ahci_port::initialize_memory(unsigned maxslots)
 
 
 
+void
+Ahci_port::setup_memory_regs()
+{
+  // setup command list
+  l4_addr_t addr = _cmddata_paddr + offsetof(Command_data, headers);
+  _regs[Regs::Port::Clb] = addr;
+  _regs[Regs::Port::Clbu] = (sizeof(l4_addr_t) == 8)
+                            ? ((l4_uint64_t) addr >> 32) : 0;
+
+  // setup FIS receive region
+  addr = _cmddata_paddr + offsetof(Command_data, fis);
+  _regs[Regs::Port::Fb] = addr;
+  _regs[Regs::Port::Fbu] = (sizeof(l4_addr_t) == 8)
+                           ? ((l4_uint64_t) addr >> 32) : 0;
+}
+
+
+void
+Ahci_port::set_fatal()
+{
+  _state = S_fatal;
+
+  // The other ports of the HBA may still be coming up, a HBA reset must
+  // not hit them because this port failed to start.
+  if (!_ready_at)
+    {
+      Err().printf("Port %u failed during initialization.\n", _portno);
+      return;
+    }
+
+  if (_recovering && ++_failed_recoveries >= Max_failed_recoveries)
+    {
+      Err().printf("Port %u still failing after %u recoveries, giving up.\n",
+                   _portno, _failed_recoveries);
+      return;
+    }
+
+  _recovering = true;
+  if (_fatal_handler)
+    Errand::schedule(_fatal_handler, 0);
+}
+
+
+void
+Ahci_port::suspend_for_hba_reset()
+{
+  // Ports without command memory have never been in use.
+  if (!_cmd_data.get())
+    return;
+
+  _regs[Regs::Port::Ie] = 0;
+
+  // Commands the hardware has completed need not be repeated.
+  if (_state == S_ready)
+    check_pending_commands();
+
+#ifdef AHCI_FAULT_INJECTION
+  // Delayed commands never reached the device, fail them instead of
+  // issuing them for the first time after the reset.
+  for (unsigned i = 0; i < _slots.size(); ++i)
+    if (_delayed_slots & (1U << i))
+      _slots[i].abort();
+  _delayed_slots = 0;
+#endif
+
+  _reissue_slots = 0;
+  for (unsigned i = 0; i < _slots.size(); ++i)
+    if (_slots[i].is_busy())
+      _reissue_slots |= 1U << i;
+
+  _state = S_hba_reset;
+}
+
+
+void
+Ahci_port::resume_after_hba_reset(Errand::Callback const &callback)
+{
+  if (_state != S_hba_reset)
+    {
+      callback();
+      return;
+    }
+
+  // The HBA reset cleared all port registers. The disks keep spinning,
+  // so the links can come back all at once.
+  setup_memory_regs();
+  if (_sss)
+    _regs[Regs::Port::Cmd].set(Regs::Port::Cmd_sud);
+  _regs[Regs::Port::Cmd].set(Regs::Port::Cmd_fre);
+  _regs[Regs::Port::Serr] = 0xFFFFFFFF;
+  _regs[Regs::Port::Is] = 0xFFFFFFFF;
+
+  auto comreset = [=]()
+    {
+      reset([=]()
+        {
+          if (device_present())
+            finish_hba_reset(callback);
+          else
+            {
+              Err().printf("Device lost after HBA reset.\n");
+              for (auto &s : _slots)
+                s.abort();
+              _reissue_slots = 0;
+              _state = S_fatal;
+              callback();
+            }
+        });
+    };
+
+  // The HBA reset also cleared the speed limit in SControl, which only
+  // takes effect with the next COMRESET.
+  if (_speed_limit)
+    {
+      comreset();
+      return;
+    }
+
+  Errand::poll(10, 50000,
+               std::bind(&Ahci_port::device_present, this),
+               [=](bool ret)
+                 {
+                   if (ret)
+                     wait_tfd([=]() { finish_hba_reset(callback); });
+                   else
+                     // Link did not come back by itself, try a COMRESET.
+                     comreset();
+                 });
+}
+
+
+void
+Ahci_port::finish_hba_reset(Errand::Callback const &callback)
+{
+  _state = S_disabled;
+  enable(
+    [=]()
+      {
+        if (is_ready())
+          {
+            if (_reissue_slots)
+              {
+                // Queued commands must be marked active before they are
+                // issued.
+                if (_reissue_slots & _queued_slots)
+                  _regs[Regs::Port::Sact] = _reissue_slots & _queued_slots;
+                _regs[Regs::Port::Ci] = _reissue_slots;
+              }
+          }
+        else
+          for (auto &s : _slots)
+            s.abort();
+
+        _reissue_slots = 0;
+        callback();
+      });
+}
+
+
 void
 Ahci_port::enable(Errand::Callback const &callback)
 {
@@ -259,7 +439,7 @@ Ahci_port::enable(Errand::Callback const &callback)
                          dma_enable(callback);
                        else
                          {
-                           _state = S_fatal;
+                           set_fatal();
                            callback();
                          }
                      });
@@ -276,8 +456,19 @@ Ahci_port::dma_enable(Errand::Callback const &callback)
 
   if (_state == S_enabling)
     {
+      apply_lpm();
       enable_ints();
       _state = S_ready;
+      if (!_ready_at)
+        {
+          _ready_at = now();
+          trace.printf("Port %u ready after %llu ms.\n", _portno,
+                       (_ready_at - _attached_at) / 1000);
+        }
+      check_link_speed();
+#ifdef AHCI_FAULT_INJECTION
+      _faults.port_ready();
+#endif
     }
   else
     {
@@ -288,12 +479,344 @@ Ahci_port::dma_enable(Errand::Callback const &callback)
 }
 
 
+char const *
+Ahci_port::link_speed_name(unsigned gen)
+{
+  switch (gen)
+    {
+    case 0: return "none";
+    case 1: return "1.5 Gbps";
+    case 2: return "3 Gbps";
+    case 3: return "6 Gbps";
+    default: return "unknown";
+    }
+}
+
+
+void
+Ahci_port::check_link_speed()
+{
+  unsigned gen = link_speed();
+
+  if (!_max_speed)
+    {
+      Dbg::info().printf("Port %u: link up at %s%s\n", _portno,
+                         link_speed_name(gen),
+                         _speed_limit ? " (limited)" : "");
+      _max_speed = gen;
+    }
+  else if (gen < _max_speed)
+    {
+      ++_speed_downgrades;
+      Dbg::warn().printf("Port %u: link speed dropped from %s to %s\n",
+                         _portno, link_speed_name(_max_speed),
+                         link_speed_name(gen));
+    }
+}
+
+
+bool
+Ahci_port::parse_lpm_policy(char const *name, Lpm_policy *policy)
+{
+  static char const *const names[] =
+    { "firmware", "max_performance", "medium", "min_power", "devsleep" };
+
+  for (unsigned i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+    if (!strcmp(name, names[i]))
+      {
+        *policy = Lpm_policy(i);
+        return true;
+      }
+
+  return false;
+}
+
+
+char const *
+Ahci_port::lpm_policy_name(Lpm_policy policy)
+{
+  switch (policy)
+    {
+    case Lpm_firmware: return "firmware";
+    case Lpm_max_performance: return "max_performance";
+    case Lpm_medium: return "medium";
+    case Lpm_min_power: return "min_power";
+    case Lpm_devsleep: return "devsleep";
+    }
+
+  return "unknown";
+}
+
+
+static char const *
+icc_name(unsigned icc)
+{
+  switch (icc)
+    {
+    case Regs::Port::Icc_partial: return "partial";
+    case Regs::Port::Icc_slumber: return "slumber";
+    case Regs::Port::Icc_devsleep: return "devsleep";
+    default: return "active";
+    }
+}
+
+
+void
+Ahci_port::set_lpm_policy(Lpm_policy policy, unsigned idle_ms,
+                          Hba_features feats, Hba_features2 feats2)
+{
+  _lpm_policy = policy;
+  _lpm_idle_us = idle_ms * 1000;
+  _lpm_icc = Regs::Port::Icc_idle;
+  _lpm_deso = feats2.deso();
+
+  switch (policy)
+    {
+    case Lpm_devsleep:
+      if (feats2.sds() && (_regs[Regs::Port::Devslp] & Regs::Port::Devslp_dsp))
+        {
+          _lpm_icc = Regs::Port::Icc_devsleep;
+          break;
+        }
+      Dbg::info().printf("Port %u: DevSleep not supported, using slumber.\n",
+                         _portno);
+      // fall through
+    case Lpm_min_power:
+      if (feats.ssc())
+        {
+          _lpm_icc = Regs::Port::Icc_slumber;
+          break;
+        }
+      Dbg::info().printf("Port %u: Slumber not supported, using partial.\n",
+                         _portno);
+      // fall through
+    case Lpm_medium:
+      if (feats.psc())
+        {
+          _lpm_icc = Regs::Port::Icc_partial;
+          break;
+        }
+      Dbg::info().printf("Port %u: Partial not supported, link stays active.\n",
+                         _portno);
+      break;
+    case Lpm_max_performance:
+    case Lpm_firmware:
+      break;
+    }
+}
+
+
+void
+Ahci_port::apply_lpm()
+{
+  if (_lpm_state != Regs::Port::Icc_active)
+    _lpm_low_us += now() - _lpm_since;
+  _lpm_state = Regs::Port::Icc_active;
+  _wake_start = 0;
+
+  if (_lpm_policy == Lpm_firmware)
+    return;
+
+  l4_uint32_t ipm = Regs::Port::Sctl_ipm_partial | Regs::Port::Sctl_ipm_slumber
+                    | Regs::Port::Sctl_ipm_devsleep;
+  switch (_lpm_icc)
+    {
+    case Regs::Port::Icc_partial:
+      ipm = Regs::Port::Sctl_ipm_slumber | Regs::Port::Sctl_ipm_devsleep;
+      break;
+    case Regs::Port::Icc_slumber:
+      ipm = Regs::Port::Sctl_ipm_devsleep;
+      break;
+    case Regs::Port::Icc_devsleep:
+      ipm = 0;
+      break;
+    }
+
+  l4_uint32_t sctl = _regs[Regs::Port::Sctl];
+  _regs[Regs::Port::Sctl] = (sctl & ~(0xFU << Regs::Port::Sctl_ipm_shift))
+                            | (ipm << Regs::Port::Sctl_ipm_shift);
+
+  // Transitions are only requested by the idle timer of the driver, so
+  // that the idle time is under its control.
+  _regs[Regs::Port::Cmd].clear(Regs::Port::Cmd_alpe | Regs::Port::Cmd_asp
+                               | Regs::Port::Cmd_apste);
+  if (_lpm_icc == Regs::Port::Icc_devsleep)
+    _regs[Regs::Port::Devslp].clear(Regs::Port::Devslp_adse);
+}
+
+
+void
+Ahci_port::lpm_activity()
+{
+  l4_kernel_clock_t t = now();
+  _last_command = t;
+
+  if (_lpm_state != Regs::Port::Icc_active)
+    {
+      // The HBA wakes the link by itself when the command is issued.
+      // Request it explicitly, so that the wake is accounted for.
+      if (icc() == Regs::Port::Icc_idle)
+        set_icc(Regs::Port::Icc_active);
+      _lpm_low_us += t - _lpm_since;
+      _lpm_state = Regs::Port::Icc_active;
+      _wake_start = t;
+    }
+
+  if (!_lpm_check_pending)
+    lpm_schedule_check(_lpm_idle_us);
+}
+
+
+void
+Ahci_port::lpm_schedule_check(unsigned us)
+{
+  _lpm_check_pending = true;
+  Errand::schedule([this]() { lpm_check_idle(); }, us);
+}
+
+
+void
+Ahci_port::lpm_check_idle()
+{
+  _lpm_check_pending = false;
+
+  if (!is_ready() || _lpm_state == _lpm_icc)
+    return;
+
+  if (_regs[Regs::Port::Ci] || _regs[Regs::Port::Sact])
+    {
+      lpm_schedule_check(_lpm_idle_us);
+      return;
+    }
+
+  l4_kernel_clock_t t = now();
+  l4_kernel_clock_t idle = t - _last_command;
+  if (idle < _lpm_idle_us)
+    {
+      lpm_schedule_check(_lpm_idle_us - idle);
+      return;
+    }
+
+  // The previous request has not been processed by the HBA yet.
+  if (icc() != Regs::Port::Icc_idle)
+    {
+      lpm_schedule_check(_lpm_idle_us);
+      return;
+    }
+
+  unsigned next = _lpm_icc;
+  if (next == Regs::Port::Icc_devsleep && _lpm_deso
+      && _lpm_state != Regs::Port::Icc_slumber)
+    next = Regs::Port::Icc_slumber;
+
+  set_icc(next);
+  if (_lpm_state == Regs::Port::Icc_active)
+    {
+      ++_lpm_entries;
+      _lpm_since = t;
+    }
+  _lpm_state = next;
+
+  trace.printf("Port %u: link enters %s.\n", _portno, icc_name(next));
+
+  // DevSleep can only be entered from slumber, go on after another period.
+  if (next != _lpm_icc)
+    lpm_schedule_check(_lpm_idle_us);
+}
+
+
+void
+Ahci_port::dump_lpm_stats(Dbg const &log) const
+{
+  if (_lpm_policy == Lpm_firmware)
+    return;
+
+  l4_uint64_t low_us = _lpm_low_us;
+  if (_lpm_state != Regs::Port::Icc_active)
+    low_us += now() - _lpm_since;
+
+  log.printf("  port %u: lpm %s (%s), %llu low power entries, %llu ms in "
+             "low power, wake latency",
+             _portno, lpm_policy_name(_lpm_policy), icc_name(_lpm_icc),
+             _lpm_entries, low_us / 1000);
+  _wake_latency.dump(log);
+}
+
+
+void
+Ahci_port::spin_up(std::function<void(bool)> const &callback)
+{
+  Spinup_queue::get().acquire([=]()
+    {
+      _spinup_pending = false;
+      trace.printf("Port %u: spinning up device.\n", _portno);
+      if (_regs[Regs::Port::Cmd] & Regs::Port::Cmd_cpd)
+        _regs[Regs::Port::Cmd].set(Regs::Port::Cmd_pod);
+      _regs[Regs::Port::Cmd].set(Regs::Port::Cmd_sud);
+
+      Errand::poll(10, Link_wait_us,
+                   std::bind(&Ahci_port::device_present, this),
+                   [=](bool present)
+                     {
+                       if (!present)
+                         {
+                           trace.printf("Port %u: no device.\n", _portno);
+                           _devtype = Ahcidev_none;
+                           Spinup_queue::get().release();
+                           callback(false);
+                           return;
+                         }
+
+                       // A disk reports busy until it has spun up.
+                       Errand::poll(Spinup_wait_us / Link_wait_us,
+                                    Link_wait_us,
+                                    std::bind(&Ahci_port::is_port_idle, this),
+                                    [=](bool ready)
+                                      {
+                                        Spinup_queue::get().release();
+                                        if (!ready)
+                                          Dbg::warn().printf(
+                                            "Port %u: device did not spin "
+                                            "up.\n", _portno);
+                                        callback(true);
+                                      });
+                     });
+    });
+}
+
+
+void
+Ahci_port::first_client_io()
+{
+  _first_io_at = now();
+  Dbg::info().printf("Port %u: first I/O %llu ms after attach.\n", _portno,
+                     (_first_io_at - _attached_at) / 1000);
+}
+
+
+void
+Ahci_port::dump_boot_stats(Dbg const &log) const
+{
+  if (!_ready_at)
+    return;
+
+  log.printf("  port %u: ready after %llu ms%s", _portno,
+             (_ready_at - _attached_at) / 1000,
+             _fast_init ? " (fast init)" : "");
+  if (_first_io_at)
+    log.cprintf(", first I/O after %llu ms\n",
+                (_first_io_at - _attached_at) / 1000);
+  else
+    log.cprintf(", no I/O yet\n");
+}
+
+
 void
 Ahci_port::disable(Errand::Callback const &callback)
 {
   if (_state == S_disabled || _state == S_error)
     {
-      _state = S_fatal;
+      set_fatal();
       Err().printf("Port disable called in unexpected state.\n");
     }
 
@@ -328,7 +851,7 @@ Ahci_port::disable(Errand::Callback const &callback)
                      _state = S_disabled;
                    else
                      {
-                       _state = S_fatal;
+                       set_fatal();
                        Err().printf("Could not disable port.");
                      }
                    callback();
@@ -385,7 +908,7 @@ Ahci_port::initialize(Errand::Callback const &callback)
   else
     {
       Err().printf("'Initialize' called out of order.\n");
-      _state = S_fatal;
+      set_fatal();
       return;
     }
 
@@ -396,8 +919,19 @@ Ahci_port::initialize(Errand::Callback const &callback)
       return;
     }
 
+  // A port the firmware left idle stops right away.
+  bool idle = _state == S_present_init && is_port_idle()
+              && !_regs[Regs::Port::Ci];
+
   _regs[Regs::Port::Cmd].clear(Regs::Port::Cmd_st);
 
+  if (idle && wait_briefly(&Ahci_port::is_command_list_disabled))
+    {
+      _fast_init = true;
+      disable_fis_receive(callback);
+      return;
+    }
+
   Errand::poll(10, 50000,
                std::bind(&Ahci_port::is_command_list_disabled, this),
                [=](bool ret)
@@ -416,7 +950,7 @@ Ahci_port::initialize(Errand::Callback const &callback)
                      {
                        Err().printf("Init: ST disable failed.\n");
                        dump_registers(trace);
-                       _state = S_fatal;
+                       set_fatal();
                        callback();
                      }
                  });
@@ -434,6 +968,14 @@ Ahci_port::disable_fis_receive(Errand::Callback const &callback)
 
   _regs[Regs::Port::Cmd].clear(Regs::Port::Cmd_fre);
 
+  if (_state == S_present_init
+      && wait_briefly(&Ahci_port::is_fis_receive_disabled))
+    {
+      _state = S_attached;
+      callback();
+      return;
+    }
+
   Errand::poll(10, 50000,
                std::bind(&Ahci_port::is_fis_receive_disabled, this),
                [=](bool ret)
@@ -450,7 +992,7 @@ Ahci_port::disable_fis_receive(Errand::Callback const &callback)
                    else
                      {
                        Err().printf(" Reset: fis receive reset failed.\n");
-                       _state = S_fatal;
+                       set_fatal();
                      }
                    callback();
                  }
@@ -463,12 +1005,14 @@ Ahci_port::reset(Errand::Callback const &callback)
 {
   Dbg::info().printf("Doing full port reset.\n");
 
-  _regs[Regs::Port::Sctl] = 1;
+  // SPD (bits 7:4) caps the speed negotiated after the COMRESET.
+  l4_uint32_t spd = (_speed_limit & 0xF) << 4;
+  _regs[Regs::Port::Sctl] = spd | 1;
 
   // wait for 5ms, according to spec
   Errand::schedule([=]()
     {
-      _regs[Regs::Port::Sctl] = 0;
+      _regs[Regs::Port::Sctl] = spd;
 
       Errand::poll(10, 50000,
                    std::bind(&Ahci_port::device_present, this),
@@ -505,15 +1049,87 @@ int
 Ahci_port::send_command(Fis::Taskfile const &task, Fis::Callback const &cb,
                         l4_uint8_t port)
 {
+  // Let clients retry once the HBA is back.
+  if (L4_UNLIKELY(_state == S_hba_reset))
+    return -L4_EBUSY;
+
   if (L4_UNLIKELY(!device_ready()))
     return -L4_ENODEV;
 
+  AHCI_CYCLE_SCOPE(_cycles.submit);
+
+#ifdef AHCI_CYCLE_STATS
+  Fis::Callback const &slot_cb = [this, cb](int error, l4_size_t sz)
+    {
+      AHCI_CYCLE_SCOPE(_cycles.complete);
+      cb(error, sz);
+    };
+#else
+  Fis::Callback const &slot_cb = cb;
+#endif
+
+  // The device cannot process queued and non-queued commands at the same
+  // time, so do not mix them in the command list. Once a non-queued command
+  // waits for the queue to drain, new queued commands are deferred as well,
+  // so that a steady stream of them cannot starve it.
+  bool queued = task.flags & Fis::Chf_queued;
+  l4_uint32_t busy = busy_slots_mask();
+  if (queued)
+    {
+      if (_defer_queued)
+        {
+          if (busy & _queued_slots)
+            {
+              _defer_queued = now();
+              return -L4_EBUSY;
+            }
+
+          if (now() - _defer_queued < Max_queue_defer_us)
+            return -L4_EBUSY;
+
+          _defer_queued = 0;
+        }
+
+      if (busy & ~_queued_slots)
+        return -L4_EBUSY;
+    }
+  else
+    {
+      if (busy & _queued_slots)
+        {
+          _defer_queued = now();
+          return -L4_EBUSY;
+        }
+
+      _defer_queued = 0;
+    }
+
   unsigned slot = 0;
   for (auto &s : _slots)
     {
+      if (queued && slot >= _queue_depth)
+        break;
+
       if (s.reserve())
         {
-          s.setup_command(task, cb, port);
+#ifdef AHCI_FAULT_INJECTION
+          // A delayed command formerly in this slot has been aborted.
+          _delayed_slots &= ~(1U << slot);
+#endif
+          if (queued)
+            {
+              // The slot number doubles as the tag of the queued command.
+              Fis::Taskfile qtask = task;
+              qtask.count = (task.count & ~0xF8) | (slot << 3);
+              s.setup_command(qtask, slot_cb, port);
+              _queued_slots |= 1U << slot;
+            }
+          else
+            {
+              s.setup_command(task, slot_cb, port);
+              _queued_slots &= ~(1U << slot);
+            }
+
           if (s.setup_data(*task.data, task.sector_size) < 0)
             {
               Err().printf("Bad data blocks\n");
@@ -524,7 +1140,41 @@ Ahci_port::send_command(Fis::Taskfile const &task, Fis::Callback const &cb,
           if (is_ready())
             {
               trace.printf("Sending off slot %d.\n", slot);
+              if (_lpm_icc != Regs::Port::Icc_idle)
+                lpm_activity();
               _cmd_data.get()->dma_flush(slot);
+#ifdef AHCI_FAULT_INJECTION
+              if (unsigned delay_us = _faults.on_submit())
+                {
+                  _delayed_slots |= 1U << slot;
+                  Errand::schedule([this, slot]()
+                    {
+                      _faults.slow_command_issued();
+                      // The slot may have been aborted or reused in the
+                      // meantime.
+                      if (!(_delayed_slots & (1U << slot))
+                          || !_slots[slot].is_busy())
+                        return;
+
+                      _delayed_slots &= ~(1U << slot);
+                      if (is_ready())
+                        {
+                          if (_queued_slots & (1U << slot))
+                            _regs[Regs::Port::Sact] = 1 << slot;
+                          _regs[Regs::Port::Ci] = 1 << slot;
+                        }
+                      else
+                        {
+                          trace.printf("Port not ready for delayed slot %d.\n",
+                                       slot);
+                          _slots[slot].abort();
+                        }
+                    }, delay_us);
+                  return slot;
+                }
+#endif
+              if (queued)
+                _regs[Regs::Port::Sact] = 1 << slot;
               _regs[Regs::Port::Ci] = 1 << slot;
             }
           else
@@ -552,8 +1202,22 @@ Ahci_port::process_interrupts()
       return -L4_ENODEV;
     }
 
+  AHCI_CYCLE_SCOPE(_cycles.irq);
+
   l4_uint32_t istate = _regs[Regs::Port::Is];
 
+  // PhyRdy changes with each transition to and from partial or slumber.
+  if (_lpm_icc != Regs::Port::Icc_idle && (istate & Regs::Port::Is_prcs))
+    {
+      _regs[Regs::Port::Serr] = Regs::Port::Serr_diag_n;
+      _regs[Regs::Port::Is] = Regs::Port::Is_prcs;
+      istate &= ~Regs::Port::Is_prcs;
+    }
+
+#ifdef AHCI_FAULT_INJECTION
+  istate |= _faults.interrupt_fault(busy_slots());
+#endif
+
   if (istate & Regs::Port::Is_mask_status)
     {
       Dbg::warn().printf("Device state changed.\n");
@@ -570,12 +1234,22 @@ Ahci_port::process_interrupts()
       // error: clear interrupts
       _regs[Regs::Port::Is]
         = istate & (Regs::Port::Is_mask_fatal | Regs::Port::Is_mask_error);
-      handle_error();
+      handle_error(istate);
     }
   else
     {
       // data: clear interrupts
       _regs[Regs::Port::Is] = Regs::Port::Is_mask_data;
+#ifdef AHCI_FAULT_INJECTION
+      if (_faults.drop_completion(finished_slots()))
+        return L4_EOK;
+      _faults.completions_processed();
+#endif
+      if (_wake_start)
+        {
+          _wake_latency.record(now() - _wake_start);
+          _wake_start = 0;
+        }
       check_pending_commands();
     }
 
@@ -583,16 +1257,33 @@ Ahci_port::process_interrupts()
 }
 
 void
-Ahci_port::handle_error()
+Ahci_port::handle_error(l4_uint32_t istate)
 {
   // find the commands that are still pending
   l4_uint32_t slotstate = _regs[Regs::Port::Ci];
 
-  if (is_started())
+  // Transfers hit by a non-fatal interface error are worth retrying,
+  // so tell the owner.
+  bool iface = (istate & Regs::Port::Is_mask_error)
+               && !(istate & Regs::Port::Is_mask_fatal);
+
+  if (busy_slots_mask() & _queued_slots)
+    {
+      // After an error the device aborts all queued commands, and the
+      // failing one is not known without reading the NCQ error log. Let
+      // the owners retry them.
+      check_pending_commands();
+      for (unsigned i = 0; i < _slots.size(); ++i)
+        if (_queued_slots & (1U << i))
+          _slots[i].abort(iface ? Interface_error : -L4_EIO);
+      slotstate = 0;
+    }
+  else if (is_started())
     {
       // If the port is still active, abort the failing task
       // and try to safe the rest.
-      _slots[current_command_slot()].abort();
+      _slots[current_command_slot()].abort(iface ? Interface_error
+                                                 : -L4_EIO);
 
       check_pending_commands();
     }
@@ -15,11 +15,15 @@
 #include <l4/re/util/shared_cap>
 #include <l4/re/util/unique_cap>
 #include <l4/sys/cache.h>
+#include <l4/sys/kip.h>
 #include <cassert>
 #include <vector>
 
 #include "ahci_types.h"
+#include "cycle_stats.h"
 #include "debug.h"
+#include "fault_injection.h"
+#include "stats.h"
 
 #include <l4/libblock-device/errand.h>
 
@@ -73,7 +77,9 @@ struct Command_table
   enum
   {
     /** Maximum number of blocks in the command table */
-    Max_entries = 24,
+    Max_entries = 56,
+    /** Maximum number of bytes a single block can transfer */
+    Prd_max_bytes = 0x400000,
   };
 
   /** Command FIS structure */
@@ -92,7 +98,7 @@ struct Command_table
   } prd[Max_entries];
 };
 
-static_assert(0x200 == sizeof(struct Command_table),
+static_assert(0x400 == sizeof(struct Command_table),
               "Command table wrongly packed.");
 
 
@@ -176,6 +182,12 @@ public:
    *
    * \param data         Chained list of data block descriptors.
    * \param sector_size  Size of a logical sector in bytes.
+   *
+   * Blocks larger than Command_table::Prd_max_bytes are split over
+   * multiple entries of the table.
+   *
+   * \retval >=0          Number of table entries used.
+   * \retval -L4_EINVAL   The data does not fit into the command table.
    */
   int setup_data(Fis::Datablock const &data, l4_uint32_t sector_size);
 
@@ -194,9 +206,11 @@ public:
   /**
    * Abort an on-going data transfer.
    *
+   * \param error  Error reported to the callback of the transfer.
+   *
    * Null operation if no data transfer was pending.
    */
-  void abort()
+  void abort(int error = -L4_EIO)
   {
     if (is_busy())
       {
@@ -204,7 +218,7 @@ public:
 
         // XXX check if the transfer is maybe done already?
         if (_callback)
-          _callback(-L4_EIO, out);
+          _callback(error, out);
 
         release();
       }
@@ -267,6 +281,42 @@ public:
     S_error,        ///< IO error occurred, reset required
     S_error_init,   ///< Reinitilizing after failure
     S_fatal,        ///< Fatal IO error occurred, not-recoverable
+    S_hba_reset,    ///< The HBA is being reset
+  };
+
+  enum
+  {
+    /// Time to busy-wait for the engines of an idle port to stop.
+    Idle_wait_us = 1000,
+    /// Polling period while waiting for the link after spin-up.
+    Link_wait_us = 20000,
+    /// Time a disk may take to spin up.
+    Spinup_wait_us = 30000000,
+    /**
+     * Recoveries by a HBA reset after which the port still fails, before
+     * the port is given up.
+     */
+    Max_failed_recoveries = 3,
+    /**
+     * Time queued commands are held back after the queue has drained for a
+     * waiting non-queued command, in case it is never retried.
+     */
+    Max_queue_defer_us = 10000,
+    /**
+     * Error passed to the callback of a command aborted because of a
+     * non-fatal interface error. Such commands may succeed when retried.
+     */
+    Interface_error = -L4_EAGAIN,
+  };
+
+  /// Link power management policy of a port.
+  enum Lpm_policy
+  {
+    Lpm_firmware,        ///< Keep the settings of the firmware
+    Lpm_max_performance, ///< Keep the link active
+    Lpm_medium,          ///< Enter partial when idle
+    Lpm_min_power,       ///< Enter slumber when idle
+    Lpm_devsleep,        ///< Enter DevSleep when idle
   };
 
   /// Create a new unattached port.
@@ -275,11 +325,12 @@ public:
   /**
    * Attach the port to a HBA.
    *
+   * \param portno        Number of the port on the HBA.
    * \param base_addr     (Virtual) base address of the port registers.
    * \param buswidth      Width of address bus.
    * \param dma_space     Dma space to use for this device.
    */
-  int attach(l4_addr_t base_addr, unsigned buswidth,
+  int attach(unsigned portno, l4_addr_t base_addr, unsigned buswidth,
              L4Re::Util::Shared_cap<L4Re::Dma_space> const &dma_space);
 
   /**
@@ -320,6 +371,37 @@ public:
    */
   void reset(Block_device::Errand::Callback const &callback);
 
+  /**
+   * Set the function to call when the port enters the fatal state.
+   *
+   * \param handler  Errand scheduled when the port cannot be recovered
+   *                 by resetting the port alone. Only ports that have been
+   *                 ready for commands before call it.
+   */
+  void set_fatal_handler(Block_device::Errand::Callback const &handler)
+  { _fatal_handler = handler; }
+
+  /**
+   * Prepare the port for a reset of the whole HBA.
+   *
+   * Commands already completed by the hardware are finished. All other
+   * commands are kept and reissued by resume_after_hba_reset(). New
+   * commands are rejected with -L4_EBUSY until then.
+   */
+  void suspend_for_hba_reset();
+
+  /**
+   * Restore the port after a reset of the whole HBA.
+   *
+   * \param callback Errand to execute after the port is operational again
+   *                 or has been found unusable.
+   *
+   * Reprograms the command list and FIS receive area, waits for the device
+   * and enables the port. Commands pending from before the reset are
+   * reissued if that succeeds and aborted otherwise.
+   */
+  void resume_after_hba_reset(Block_device::Errand::Callback const &callback);
+
   /**
    * Return true if device is present and communication established.
    */
@@ -392,6 +474,139 @@ public:
   unsigned max_slots() const
   { return _slots.size(); }
 
+  /**
+   * Note whether the HBA uses staggered spin-up.
+   *
+   * Must be called before attach(). Ports of such an HBA only establish
+   * the link, and thereby spin up the disk, when the driver asks for it,
+   * see spin_up().
+   */
+  void set_staggered_spinup(bool sss)
+  { _sss = sss; }
+
+  /// Return true if the disk of the port still has to be spun up.
+  bool spinup_pending() const
+  { return _spinup_pending; }
+
+  /**
+   * Spin up the disk of a port with staggered spin-up.
+   *
+   * \param callback  Called with true once the device is ready, with false
+   *                  if no device is attached.
+   *
+   * Takes a slot of the Spinup_queue, so that only a limited number of
+   * disks spin up at the same time. The slot is returned as soon as the
+   * device reports to be ready.
+   */
+  void spin_up(std::function<void(bool)> const &callback);
+
+  /// Note whether the HBA supports native command queuing.
+  void set_ncq_supported(bool supported)
+  { _ncq_supported = supported; }
+
+  /// Return true if the HBA supports native command queuing.
+  bool ncq_supported() const
+  { return _ncq_supported; }
+
+  /**
+   * Set the number of queued commands the device accepts.
+   *
+   * Commands flagged Fis::Chf_queued use their slot number as tag, so they
+   * are only placed in slots below the queue depth.
+   */
+  void set_queue_depth(unsigned depth)
+  { _queue_depth = depth; }
+
+  /**
+   * Return the negotiated interface speed generation.
+   *
+   * 1 is 1.5 Gbps, 2 is 3 Gbps and 3 is 6 Gbps. 0 if no link is
+   * established.
+   */
+  unsigned link_speed() const
+  { return (_regs[Regs::Port::Ssts] >> 4) & 0xF; }
+
+  /// Return a printable name for an interface speed generation.
+  static char const *link_speed_name(unsigned gen);
+
+  /**
+   * Limit the interface speed negotiated with the device.
+   *
+   * \param gen  Highest allowed speed generation, 0 for no limit.
+   *
+   * The limit is applied on the next port reset.
+   */
+  void set_speed_limit(unsigned gen)
+  { _speed_limit = gen; }
+
+  unsigned speed_limit() const
+  { return _speed_limit; }
+
+  /// Return how often the link came up slower than it did initially.
+  unsigned speed_downgrades() const
+  { return _speed_downgrades; }
+
+  /**
+   * Configure link power management.
+   *
+   * \param policy   Requested policy.
+   * \param idle_ms  Time without commands after which the driver moves the
+   *                 link into the low power state of the policy.
+   * \param feats    Capabilities of the HBA.
+   * \param feats2   Extended capabilities of the HBA.
+   *
+   * Falls back to a shallower state if the HBA or the device does not
+   * support the requested one. Takes effect when the port is enabled.
+   */
+  void set_lpm_policy(Lpm_policy policy, unsigned idle_ms,
+                      Hba_features feats, Hba_features2 feats2);
+
+  Lpm_policy lpm_policy() const
+  { return _lpm_policy; }
+
+  /**
+   * Parse the name of a link power management policy.
+   *
+   * \retval true   `name` is valid and `policy` has been set.
+   * \retval false  `name` is not a known policy.
+   */
+  static bool parse_lpm_policy(char const *name, Lpm_policy *policy);
+
+  static char const *lpm_policy_name(Lpm_policy policy);
+
+  /**
+   * Write residency in low power states and wake latencies to the log.
+   */
+  void dump_lpm_stats(Dbg const &log) const;
+
+  /// Note a request of a client, for measuring the time to the first one.
+  void note_client_io()
+  {
+    if (L4_UNLIKELY(!_first_io_at))
+      first_client_io();
+  }
+
+  /**
+   * Write the time the port took to become ready and to see the first
+   * client request to the log.
+   */
+  void dump_boot_stats(Dbg const &log) const;
+
+#ifdef AHCI_CYCLE_STATS
+  /// Return the CPU cycles spent on behalf of this port.
+  Port_cycles const &cycles() const
+  { return _cycles; }
+#endif
+
+#ifdef AHCI_FAULT_INJECTION
+  /// Return the fault injector of this port.
+  Fault_injector &faults()
+  { return _faults; }
+
+  Fault_injector const &faults() const
+  { return _faults; }
+#endif
+
 private:
   /** Check if the HBA is processing IO tasks. */
   bool is_started() const
@@ -425,12 +640,92 @@ private:
              & (Regs::Port::Cmd_fr | Regs::Port::Cmd_fre));
   }
 
+  /** Return the slots with a command in flight. */
+  l4_uint32_t busy_slots_mask() const
+  {
+    l4_uint32_t mask = 0;
+    for (unsigned i = 0; i < _slots.size(); ++i)
+      if (_slots[i].is_busy())
+        mask |= 1U << i;
+    return mask;
+  }
+
+  /**
+   * Return the slots whose command the hardware has not finished yet.
+   *
+   * Queued commands stay active until the device has sent their status.
+   */
+  l4_uint32_t active_slots_mask() const
+  {
+    l4_uint32_t mask = _regs[Regs::Port::Ci] | _regs[Regs::Port::Sact];
+#ifdef AHCI_FAULT_INJECTION
+    // Commands held back by the fault injector have not been issued yet.
+    mask |= _delayed_slots;
+#endif
+    return mask;
+  }
+
+  /**
+   * Busy-wait shortly for a condition of the port.
+   *
+   * Engines of an idle port stop within microseconds, so waiting for them
+   * need not delay the start-up by a polling period. Only used during the
+   * initial bring-up of the port; recovery runs while other ports serve
+   * requests, so it must not block the server loop and polls instead.
+   *
+   * \retval true   The condition became true.
+   * \retval false  The condition is still false after Idle_wait_us.
+   */
+  bool wait_briefly(bool (Ahci_port::*cond)() const) const
+  {
+    l4_kernel_clock_t end = now() + Idle_wait_us;
+    while (!(this->*cond)())
+      if (now() >= end)
+        return false;
+
+    return true;
+  }
+
+  /** Record and report the first client request. */
+  void first_client_io();
+
   /** Return the command slot currently being processed. */
   unsigned current_command_slot() const
   {
     return (_regs[Regs::Port::Cmd] >> 8) & 0x1F;
   }
 
+  /**
+   * Log the link speed and note when it dropped below the speed the link
+   * came up with first.
+   */
+  void check_link_speed();
+
+  static l4_kernel_clock_t now()
+  { return l4_kip_clock(l4re_kip()); }
+
+  /** Return the pending Interface Communication Control request. */
+  unsigned icc() const
+  { return (_regs[Regs::Port::Cmd] >> 28) & 0xF; }
+
+  /** Request a transition of the interface power state. */
+  void set_icc(unsigned icc)
+  {
+    l4_uint32_t cmd = _regs[Regs::Port::Cmd];
+    _regs[Regs::Port::Cmd] = (cmd & 0x0FFFFFFF) | (icc << 28);
+  }
+
+  /** Program the registers for the link power management policy. */
+  void apply_lpm();
+
+  /** Note a new command and wake the link if it is in a low power state. */
+  void lpm_activity();
+
+  /** Enter the low power state once the port has been idle long enough. */
+  void lpm_check_idle();
+
+  void lpm_schedule_check(unsigned us);
+
   /** Return the state of the device as reported by the hardware. */
   unsigned device_state() const { return _regs[Regs::Port::Ssts] & 0xF; }
 
@@ -439,17 +734,61 @@ private:
    */
   void check_pending_commands()
   {
-    l4_uint32_t slotstate = _regs[Regs::Port::Ci];
+    l4_uint32_t slotstate = active_slots_mask();
 
     for (auto &s : _slots)
       {
         if (s.is_busy() && ((slotstate & 1) == 0))
-          s.command_finish();
+          {
+            s.command_finish();
+            // The device works again after a recovery.
+            _recovering = false;
+            _failed_recoveries = 0;
+          }
+        slotstate >>= 1;
+      }
+  }
+
+#ifdef AHCI_FAULT_INJECTION
+  /** Return the number of commands in flight. */
+  unsigned busy_slots() const
+  {
+    unsigned n = 0;
+    for (auto const &s : _slots)
+      if (s.is_busy())
+        ++n;
+    return n;
+  }
+
+  /** Return the number of commands finished but not yet completed. */
+  unsigned finished_slots() const
+  {
+    l4_uint32_t slotstate = active_slots_mask();
+    unsigned n = 0;
+    for (auto const &s : _slots)
+      {
+        if (s.is_busy() && !(slotstate & 1))
+          ++n;
         slotstate >>= 1;
       }
+    return n;
   }
+#endif
 
-  void handle_error();
+  void handle_error(l4_uint32_t istate);
+
+  /**
+   * Enter the fatal state and notify the fatal handler, unless the port
+   * has never been ready or failed again after the last
+   * Max_failed_recoveries recoveries.
+   */
+  void set_fatal();
+
+  /** Program the addresses of command list and FIS receive area. */
+  void setup_memory_regs();
+
+  /** Enable the port after a HBA reset and reissue pending commands. */
+  void finish_hba_reset(Block_device::Errand::Callback const &callback);
 
   void disable_fis_receive(Block_device::Errand::Callback const &callback);
 
@@ -462,8 +801,12 @@ private:
    */
   void enable_ints()
   {
+    // PhyRdy drops whenever the link enters partial or slumber.
     if (_devtype != Ahcidev_none)
-      _regs[Regs::Port::Ie] = Regs::Port::Is_mask_nonfatal;
+      _regs[Regs::Port::Ie] = _lpm_icc == Regs::Port::Icc_idle
+                              ? Regs::Port::Is_mask_nonfatal
+                              : Regs::Port::Is_mask_nonfatal
+                                & ~Regs::Port::Is_prcs;
   }
 
   /**
@@ -497,6 +840,56 @@ private:
   L4Re::Dma_space::Dma_addr _cmddata_paddr;
   L4Re::Util::Shared_cap<L4Re::Dma_space> _dma_space;
   unsigned char _buswidth;
+  Block_device::Errand::Callback _fatal_handler;
+  l4_uint32_t _reissue_slots = 0;
+  /// The fatal handler was called and no command has completed since.
+  bool _recovering = false;
+  unsigned _failed_recoveries = 0;
+  l4_kernel_clock_t _attached_at = 0;
+  l4_kernel_clock_t _ready_at = 0;
+  l4_kernel_clock_t _first_io_at = 0;
+  /// The firmware left the port idle, so it was taken over without polling.
+  bool _fast_init = false;
+  /// Slots whose last command was a queued one.
+  l4_uint32_t _queued_slots = 0;
+  /**
+   * Last time a waiting non-queued command found queued commands in flight,
+   * 0 if no non-queued command is waiting.
+   */
+  l4_kernel_clock_t _defer_queued = 0;
+  bool _ncq_supported = false;
+  bool _sss = false;
+  bool _spinup_pending = false;
+  unsigned _queue_depth = 0;
+  unsigned _portno = 0;
+  unsigned _speed_limit = 0;
+  unsigned _max_speed = 0;
+  unsigned _speed_downgrades = 0;
+  Lpm_policy _lpm_policy = Lpm_firmware;
+  /// Low power state entered when idle, Icc_idle if none.
+  unsigned _lpm_icc = Regs::Port::Icc_idle;
+  /// Power state last requested by the driver.
+  unsigned _lpm_state = Regs::Port::Icc_active;
+  bool _lpm_deso = false;
+  bool _lpm_check_pending = false;
+  unsigned _lpm_idle_us = 0;
+  l4_kernel_clock_t _last_command = 0;
+  l4_kernel_clock_t _lpm_since = 0;
+  l4_kernel_clock_t _wake_start = 0;
+  l4_uint64_t _lpm_entries = 0;
+  l4_uint64_t _lpm_low_us = 0;
+  Latency_histogram _wake_latency;
+#ifdef AHCI_CYCLE_STATS
+  Port_cycles _cycles;
+#endif
+#ifdef AHCI_FAULT_INJECTION
+  Fault_injector _faults;
+  /**
+   * Slots whose command is held back by the fault injector. A slot leaves
+   * the mask when its command is issued or aborted, or when it is reused.
+   */
+  l4_uint32_t _delayed_slots = 0;
+#endif
 };
 
 }
@@ -41,6 +41,21 @@ struct Hba_features
   explicit Hba_features(l4_uint32_t v) : raw(v) {}
 };
 
+/** Extended feature register of a AHCI HBA
+ */
+struct Hba_features2
+{
+  l4_uint32_t raw;
+  CXX_BITFIELD_MEMBER_RO( 5,  5, deso, raw); ///< DevSleep Entrance from Slumber Only
+  CXX_BITFIELD_MEMBER_RO( 4,  4, sadm, raw); ///< Supports Aggressive Device Sleep Management
+  CXX_BITFIELD_MEMBER_RO( 3,  3, sds, raw);  ///< Supports Device Sleep
+  CXX_BITFIELD_MEMBER_RO( 2,  2, apst, raw); ///< Automatic Partial to Slumber Transitions
+  CXX_BITFIELD_MEMBER_RO( 1,  1, nvmp, raw); ///< NVMHCI Present
+  CXX_BITFIELD_MEMBER_RO( 0,  0, boh, raw);  ///< BIOS/OS Handoff
+
+  explicit Hba_features2(l4_uint32_t v) : raw(v) {}
+};
+
 namespace Regs {
 
 namespace Hba {
@@ -69,6 +84,15 @@ enum Ghc_reg
   Ghc_hr   = (1 << 0)    ///< HBA Reset
 };
 
+enum Bohc_reg
+{
+  Bohc_bb   = (1 << 4),  ///< BIOS Busy
+  Bohc_ooc  = (1 << 3),  ///< OS Ownership Change
+  Bohc_sooe = (1 << 2),  ///< SMI on OS Ownership Change Enable
+  Bohc_oos  = (1 << 1),  ///< OS Owned Semaphore
+  Bohc_bos  = (1 << 0),  ///< BIOS Owned Semaphore
+};
+
 } // namespace Hba
 
 namespace Port {
@@ -121,6 +145,35 @@ enum Cmd_reg
   Cmd_st    = (1 << 0),  ///< Start
 };
 
+/** Values of the Interface Communication Control field (Cmd bits 31:28) */
+enum Cmd_icc_value
+{
+  Icc_idle     = 0x0, ///< No transition pending
+  Icc_active   = 0x1, ///< Transition to active
+  Icc_partial  = 0x2, ///< Transition to partial
+  Icc_slumber  = 0x6, ///< Transition to slumber
+  Icc_devsleep = 0x8, ///< Transition to DevSleep
+};
+
+enum Sctl_reg
+{
+  Sctl_ipm_shift    = 8,      ///< Interface Power Management Transitions Allowed
+  Sctl_ipm_partial  = 1 << 0, ///< IPM: transitions to partial disabled
+  Sctl_ipm_slumber  = 1 << 1, ///< IPM: transitions to slumber disabled
+  Sctl_ipm_devsleep = 1 << 2, ///< IPM: transitions to DevSleep disabled
+};
+
+enum Serr_reg
+{
+  Serr_diag_n = (1 << 16), ///< PhyRdy change
+};
+
+enum Devslp_reg
+{
+  Devslp_dsp  = (1 << 1),  ///< Device Sleep Present
+  Devslp_adse = (1 << 0),  ///< Aggressive Device Sleep Enable
+};
+
 enum Tfd_reg
 {
     Tfd_sts_err = (1 << 0),  ///< Transfer error
@@ -173,6 +226,8 @@ enum Command_header_flags
   Chf_atapi         = 0x4,
   Chf_reset         = (1 << 3),
   Chf_clr_busy      = (1 << 4),
+  /// Native command queuing command, not a command header bit.
+  Chf_queued        = (1 << 5),
 };
 
 /**
@@ -188,6 +243,7 @@ struct Taskfile
   l4_uint8_t command;
   l4_uint8_t icc; // time limit
   l4_uint8_t control;
+  l4_uint32_t aux = 0; // auxiliary field, used by queued commands
 
   unsigned flags;
 
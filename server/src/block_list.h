@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/cxx/minmax>
+#include <l4/cxx/unique_ptr>
+
+#include <l4/libblock-device/types.h>
+
+namespace Ahci {
+
+/// Return the number of sectors of a block list.
+inline l4_uint64_t
+block_list_sectors(Block_device::Inout_block const &blocks)
+{
+  l4_uint64_t count = 0;
+  for (auto const *b = &blocks; b; b = b->next.get())
+    count += b->num_sectors;
+
+  return count;
+}
+
+/**
+ * Fill `out` with the part of a block list that starts `skip` sectors into
+ * the list and is `count` sectors long.
+ *
+ * The list must contain at least `skip + count` sectors.
+ */
+inline void
+slice_blocks(Block_device::Inout_block *out,
+             Block_device::Inout_block const &blocks, l4_uint64_t skip,
+             l4_uint64_t count, l4_size_t sector_size)
+{
+  Block_device::Inout_block const *in = &blocks;
+  while (skip >= in->num_sectors)
+    {
+      skip -= in->num_sectors;
+      in = in->next.get();
+    }
+
+  for (;;)
+    {
+      l4_uint64_t n = cxx::min<l4_uint64_t>(count, in->num_sectors - skip);
+      out->dma_addr = in->dma_addr + skip * sector_size;
+      out->virt_addr = in->virt_addr
+                       ? static_cast<char *>(in->virt_addr) + skip * sector_size
+                       : nullptr;
+      out->num_sectors = n;
+
+      count -= n;
+      if (!count)
+        break;
+
+      skip = 0;
+      in = in->next.get();
+      out->next = cxx::make_unique<Block_device::Inout_block>();
+      out = out->next.get();
+    }
+}
+
+} // namespace Ahci
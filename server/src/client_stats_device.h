@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <string>
+
+#include "ahci_device.h"
+#include "block_list.h"
+#include "request_histogram.h"
+
+namespace Ahci {
+
+/**
+ * View of a device that records the request pattern of a single client.
+ *
+ * Requests are counted in the sector numbers the client uses, before they
+ * are translated or split by the views and devices below, so every request
+ * of the client is counted exactly once.
+ */
+class Client_stats_device
+: public Device,
+  public Block_device::Device_discard_feature
+{
+public:
+  /**
+   * Create a view recording the requests of a client.
+   *
+   * \param dev   Device the client works on.
+   * \param name  Name of the client used in the report.
+   */
+  Client_stats_device(cxx::Ref_ptr<Device> const &dev,
+                      std::string const &name)
+  : _dev(dev), _histogram(name)
+  {}
+
+  Block_device::Notification_domain const *notification_domain() const override
+  { return _dev->notification_domain(); }
+
+  bool is_read_only() const override
+  { return _dev->is_read_only(); }
+
+  bool match_hid(cxx::String const &hid) const override
+  { return _dev->match_hid(hid); }
+
+  l4_uint64_t capacity() const override
+  { return _dev->capacity(); }
+
+  l4_size_t sector_size() const override
+  { return _dev->sector_size(); }
+
+  l4_size_t max_size() const override
+  { return _dev->max_size(); }
+
+  unsigned max_segments() const override
+  { return _dev->max_segments(); }
+
+  unsigned max_in_flight() const override
+  { return _dev->max_in_flight(); }
+
+  std::string const &hid() const override
+  { return _dev->hid(); }
+
+  l4_uint64_t start_sector() const override
+  { return _dev->start_sector(); }
+
+  void reset() override
+  { _dev->reset(); }
+
+  int dma_map(Block_device::Mem_region *region, l4_addr_t offset,
+              l4_size_t num_sectors, L4Re::Dma_space::Direction dir,
+              L4Re::Dma_space::Dma_addr *phys) override
+  { return _dev->dma_map(region, offset, num_sectors, dir, phys); }
+
+  int dma_unmap(L4Re::Dma_space::Dma_addr phys, l4_size_t num_sectors,
+                L4Re::Dma_space::Direction dir) override
+  { return _dev->dma_unmap(phys, num_sectors, dir); }
+
+  int inout_data(l4_uint64_t sector, Block_device::Inout_block const &blocks,
+                 Block_device::Inout_callback const &cb,
+                 L4Re::Dma_space::Direction dir) override
+  {
+    int ret = _dev->inout_data(sector, blocks, cb, dir);
+    // A request refused as busy is submitted again later.
+    if (ret >= 0)
+      _histogram.record(sector, block_list_sectors(blocks),
+                        _dev->sector_size(), dir);
+    return ret;
+  }
+
+  int flush(Block_device::Inout_callback const &cb) override
+  { return _dev->flush(cb); }
+
+  void start_device_scan(Block_device::Errand::Callback const &callback) override
+  { callback(); }
+
+  Discard_info discard_info() const override
+  {
+    auto const *dd = discard_dev();
+    return dd ? dd->discard_info() : Discard_info();
+  }
+
+  int discard(l4_uint64_t offset, Block_device::Inout_block const &blocks,
+              Block_device::Inout_callback const &cb, bool discard) override
+  {
+    auto *dd = discard_dev();
+    if (!dd)
+      return -L4_ENOSYS;
+
+    return dd->discard(offset, blocks, cb, discard);
+  }
+
+private:
+  Block_device::Device_discard_feature *discard_dev() const
+  { return dynamic_cast<Block_device::Device_discard_feature *>(_dev.get()); }
+
+  cxx::Ref_ptr<Device> _dev;
+  Request_histogram _histogram;
+};
+
+} // namespace Ahci
@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include <l4/cxx/minmax>
+#include <l4/re/env>
+#include <l4/re/error_helper>
+#include <l4/re/util/unique_cap>
+
+#include <l4/libblock-device/errand.h>
+
+#include "composite_io.h"
+
+namespace Ahci {
+
+void
+submit_io(cxx::Ref_ptr<Device> const &dev, l4_uint64_t sector,
+          L4Re::Dma_space::Dma_addr phys, char *virt, l4_uint64_t count,
+          L4Re::Dma_space::Direction dir, Io_done const &done)
+{
+  if (!count)
+    {
+      done(L4_EOK);
+      return;
+    }
+
+  l4_uint64_t n = cxx::min<l4_uint64_t>(count,
+                                        dev->max_size() / dev->sector_size());
+  Block_device::Inout_block block;
+  block.dma_addr = phys;
+  block.virt_addr = virt;
+  block.num_sectors = n;
+
+  l4_size_t bytes = n * dev->sector_size();
+  int ret = dev->inout_data(sector, block,
+                            [=](int error, l4_size_t)
+                              {
+                                if (error < 0 || n == count)
+                                  done(error);
+                                else
+                                  submit_io(dev, sector + n, phys + bytes,
+                                            virt ? virt + bytes : nullptr,
+                                            count - n, dir, done);
+                              }, dir);
+  if (ret == -L4_EBUSY)
+    // All slots are taken by client requests, try again a bit later.
+    Block_device::Errand::schedule([=]()
+                                     {
+                                       submit_io(dev, sector, phys, virt,
+                                                 count, dir, done);
+                                     }, Io_retry_us);
+  else if (ret < 0)
+    done(ret);
+}
+
+void
+flush_io(cxx::Ref_ptr<Device> const &dev, Io_done const &done)
+{
+  int ret = dev->flush([done](int error, l4_size_t) { done(error); });
+  if (ret == -L4_EBUSY)
+    Block_device::Errand::schedule([dev, done]() { flush_io(dev, done); },
+                                   Io_retry_us);
+  else if (ret < 0)
+    done(ret);
+}
+
+long
+alloc_io_buffer(l4_size_t size,
+                cxx::unique_ptr<Block_device::Mem_region> *region,
+                char **virt)
+{
+  auto ds = L4Re::Util::make_unique_cap<L4Re::Dataspace>();
+  if (!ds.is_valid())
+    return -L4_ENOMEM;
+
+  long ret = L4Re::Env::env()->mem_alloc()->alloc(size, ds.get(),
+                                                  L4Re::Mem_alloc::Continuous
+                                                  | L4Re::Mem_alloc::Pinned);
+  if (ret < 0)
+    return ret;
+
+  try
+    {
+      *region = cxx::make_unique<Block_device::Mem_region>(0, size, 0,
+                                                           cxx::move(ds));
+    }
+  catch (L4::Runtime_error const &e)
+    {
+      return e.err_no();
+    }
+
+  *virt = static_cast<char *>((*region)->local(L4virtio::Ptr<void>(0)));
+  return L4_EOK;
+}
+
+int
+Composite_dma::map(Block_device::Mem_region *region, l4_addr_t offset,
+                   l4_size_t num_sectors, L4Re::Dma_space::Direction dir,
+                   L4Re::Dma_space::Dma_addr *phys)
+{
+  Mapping m;
+  m.bytes = num_sectors * _devs[0]->sector_size();
+
+  for (unsigned i = 0; i < _devs.size(); ++i)
+    {
+      L4Re::Dma_space::Dma_addr p;
+      int ret = _devs[i]->dma_map(region, offset, num_sectors, dir, &p);
+      if (ret < 0)
+        {
+          while (i-- > 0)
+            _devs[i]->dma_unmap(m.phys[i], num_sectors, dir);
+          return ret;
+        }
+
+      m.phys.push_back(p);
+    }
+
+  // Leave a gap between the ranges, so that an address past the end of a
+  // mapping never hits the next one.
+  *phys = _next_addr;
+  _next_addr += l4_round_page(m.bytes) + L4_PAGESIZE;
+  _mappings.emplace(*phys, cxx::move(m));
+
+  return L4_EOK;
+}
+
+int
+Composite_dma::unmap(L4Re::Dma_space::Dma_addr phys, l4_size_t num_sectors,
+                     L4Re::Dma_space::Direction dir)
+{
+  auto it = _mappings.find(phys);
+  if (it == _mappings.end())
+    return -L4_EINVAL;
+
+  int ret = L4_EOK;
+  for (unsigned i = 0; i < _devs.size(); ++i)
+    {
+      int r = _devs[i]->dma_unmap(it->second.phys[i], num_sectors, dir);
+      if (r < 0)
+        ret = r;
+    }
+
+  _mappings.erase(it);
+  return ret;
+}
+
+bool
+Composite_dma::translate(Block_device::Inout_block *blocks,
+                         unsigned dev) const
+{
+  l4_size_t sector_size = _devs[dev]->sector_size();
+  for (auto *b = blocks; b; b = b->next.get())
+    {
+      auto it = _mappings.upper_bound(b->dma_addr);
+      if (it == _mappings.begin())
+        return false;
+
+      --it;
+      l4_uint64_t offset = b->dma_addr - it->first;
+      if (offset + b->num_sectors * sector_size > it->second.bytes)
+        return false;
+
+      b->dma_addr = it->second.phys[dev] + offset;
+    }
+
+  return true;
+}
+
+} // namespace Ahci
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <functional>
+#include <map>
+#include <vector>
+
+#include <l4/cxx/ref_ptr>
+#include <l4/cxx/unique_ptr>
+#include <l4/sys/consts.h>
+
+#include "ahci_device.h"
+
+#include <l4/libblock-device/types.h>
+
+/*
+ * Helpers for devices that are built on top of other disks or partitions,
+ * like Linear_device, Thin_pool and Cow_device.
+ */
+
+namespace Ahci {
+
+/**
+ * Completion state of a client request split into pieces.
+ *
+ * The request holds one reference of its own while the pieces are being
+ * started, which is dropped by a final `piece_done(L4_EOK, 0)`. If a piece
+ * cannot be started, the request is abandoned: the client sees the error
+ * returned by inout_data() and the pieces already in flight finish without
+ * calling the callback.
+ */
+struct Split_request
+{
+  Block_device::Inout_callback cb;
+  unsigned pending = 1;
+  int error = L4_EOK;
+  l4_size_t bytes = 0;
+  bool abandoned = false;
+
+  /// Account a finished piece and complete the request after the last one.
+  void piece_done(int err, l4_size_t size)
+  {
+    if (err < 0 && error >= 0)
+      error = err;
+    bytes += size;
+
+    if (--pending == 0 && !abandoned)
+      cb(error, bytes);
+  }
+};
+
+/// Function called with the result of driver-internal I/O.
+using Io_done = std::function<void(int)>;
+
+enum
+{
+  /// Time to back off when driver-internal I/O finds the device busy.
+  Io_retry_us = 1000,
+};
+
+/**
+ * Transfer a physically contiguous buffer from or to a device.
+ *
+ * The transfer is split into requests of the maximum size of the device.
+ * Driver-internal I/O cannot be handed back to a client, so a request that
+ * finds all slots taken is tried again after Io_retry_us.
+ *
+ * \param dev     Device to transfer from or to.
+ * \param sector  First sector on the device.
+ * \param phys    DMA address of the buffer for `dev`.
+ * \param virt    Local address of the buffer, may be nullptr.
+ * \param count   Number of sectors to transfer.
+ * \param dir     Direction of the transfer.
+ * \param done    Called with the result once the transfer has finished.
+ */
+void submit_io(cxx::Ref_ptr<Device> const &dev, l4_uint64_t sector,
+               L4Re::Dma_space::Dma_addr phys, char *virt, l4_uint64_t count,
+               L4Re::Dma_space::Direction dir, Io_done const &done);
+
+/// Flush a device, trying again after Io_retry_us while it is busy.
+void flush_io(cxx::Ref_ptr<Device> const &dev, Io_done const &done);
+
+/**
+ * Allocate a pinned, physically contiguous buffer for driver-internal I/O.
+ *
+ * \param size    Size of the buffer in bytes.
+ * \param region  Returns the memory region, ready to be mapped for DMA.
+ * \param virt    Returns the local address of the buffer.
+ */
+long alloc_io_buffer(l4_size_t size,
+                     cxx::unique_ptr<Block_device::Mem_region> *region,
+                     char **virt);
+
+/**
+ * DMA address space of a device built on several devices.
+ *
+ * The devices may be attached to different controllers with separate DMA
+ * spaces, so memory registered by a client is mapped for every device. The
+ * client gets an address from a range private to the composite device,
+ * which is translated to the address for one of the devices when a request
+ * is issued.
+ */
+class Composite_dma
+{
+  struct Mapping
+  {
+    l4_size_t bytes;
+    std::vector<L4Re::Dma_space::Dma_addr> phys;
+  };
+
+public:
+  /**
+   * Add a device to map client memory for.
+   *
+   * All devices must have the same sector size and be added before memory
+   * is mapped.
+   *
+   * \return The index of the device for translate().
+   */
+  unsigned add_device(cxx::Ref_ptr<Device> const &dev)
+  {
+    _devs.push_back(dev);
+    return _devs.size() - 1;
+  }
+
+  int map(Block_device::Mem_region *region, l4_addr_t offset,
+          l4_size_t num_sectors, L4Re::Dma_space::Direction dir,
+          L4Re::Dma_space::Dma_addr *phys);
+
+  int unmap(L4Re::Dma_space::Dma_addr phys, l4_size_t num_sectors,
+            L4Re::Dma_space::Direction dir);
+
+  /**
+   * Translate the addresses of a block list for one of the devices.
+   *
+   * \retval false  A block is not within memory mapped before.
+   */
+  bool translate(Block_device::Inout_block *blocks, unsigned dev) const;
+
+private:
+  std::vector<cxx::Ref_ptr<Device>> _devs;
+  /// DMA mappings by the address handed out to the client.
+  std::map<L4Re::Dma_space::Dma_addr, Mapping> _mappings;
+  L4Re::Dma_space::Dma_addr _next_addr = L4_PAGESIZE;
+};
+
+} // namespace Ahci
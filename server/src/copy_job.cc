@@ -0,0 +1,297 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include <l4/cxx/minmax>
+#include <l4/re/env>
+#include <l4/re/error_helper>
+#include <l4/re/util/unique_cap>
+
+#include "copy_job.h"
+
+static Dbg trace(Dbg::Trace, "copy");
+
+namespace Ahci {
+
+Copy_job::Copy_job(cxx::Ref_ptr<Device> const &src, l4_uint64_t src_lba,
+                   cxx::Ref_ptr<Device> const &dst, l4_uint64_t dst_lba,
+                   l4_uint64_t count, L4Re::Util::Object_registry *registry)
+: _src(src), _dst(dst), _src_lba(src_lba), _dst_lba(dst_lba), _total(count),
+  _registry(registry), _retry(this)
+{
+  l4_size_t chunk = cxx::min<l4_size_t>(Chunk_bytes,
+                                        cxx::min(src->max_size(),
+                                                 dst->max_size()));
+  _chunk_sectors = chunk / src->sector_size();
+}
+
+Copy_job::~Copy_job()
+{
+  for (auto const &b : _buffers)
+    {
+      if (b.src_phys)
+        _src->dma_unmap(b.src_phys, _chunk_sectors,
+                        L4Re::Dma_space::Direction::Bidirectional);
+      if (b.dst_phys)
+        _dst->dma_unmap(b.dst_phys, _chunk_sectors,
+                        L4Re::Dma_space::Direction::Bidirectional);
+    }
+}
+
+long
+Copy_job::setup_buffers()
+{
+  auto *env = L4Re::Env::env();
+  l4_size_t size = _chunk_sectors * _src->sector_size();
+
+  _buffers.resize(Num_buffers);
+  for (auto &b : _buffers)
+    {
+      auto ds = L4Re::Util::make_unique_cap<L4Re::Dataspace>();
+      if (!ds.is_valid())
+        return -L4_ENOMEM;
+
+      long ret = env->mem_alloc()->alloc(size, ds.get(),
+                                         L4Re::Mem_alloc::Continuous
+                                         | L4Re::Mem_alloc::Pinned);
+      if (ret < 0)
+        return ret;
+
+      try
+        {
+          b.region = cxx::make_unique<Block_device::Mem_region>(0, size, 0,
+                                                                cxx::move(ds));
+        }
+      catch (L4::Runtime_error const &e)
+        {
+          return e.err_no();
+        }
+
+      ret = _src->dma_map(b.region.get(), 0, _chunk_sectors,
+                          L4Re::Dma_space::Direction::Bidirectional,
+                          &b.src_phys);
+      if (ret < 0)
+        return ret;
+
+      ret = _dst->dma_map(b.region.get(), 0, _chunk_sectors,
+                          L4Re::Dma_space::Direction::Bidirectional,
+                          &b.dst_phys);
+      if (ret < 0)
+        return ret;
+
+      b.block.virt_addr = b.region->local(L4virtio::Ptr<void>(0));
+    }
+
+  return L4_EOK;
+}
+
+void
+Copy_job::start()
+{
+  Dbg::info().printf("Copy of %llu sectors from %s:%llu to %s:%llu started.\n",
+                     _total, _src->hid().c_str(), _src_lba,
+                     _dst->hid().c_str(), _dst_lba);
+
+  _dst_registration = cxx::make_unique<Client_registration>(_dst, true);
+  _start_time = now();
+  pump();
+}
+
+void
+Copy_job::shutdown()
+{
+  if (_status == -L4_EBUSY)
+    Dbg::info().printf("Copy to %s cancelled after %llu of %llu sectors.\n",
+                       _dst->hid().c_str(), _done, _total);
+
+  if (_retry_pending)
+    server_iface()->remove_timeout(&_retry);
+  _retry_pending = false;
+  _shutdown = true;
+  release_destination();
+
+  _registry->unregister_obj(this);
+}
+
+long
+Copy_job::op_progress(Ahci_copy::Copy_job::Rights, l4_uint64_t &done,
+                      l4_uint64_t &total)
+{
+  done = _done;
+  total = _total;
+
+  return _status;
+}
+
+void
+Copy_job::pump()
+{
+  if (_shutdown || _status != -L4_EBUSY)
+    return;
+
+  for (unsigned i = 0; i < _buffers.size(); ++i)
+    {
+      if (_buffers[i].state == B_read_done && !start_write(i))
+        break;
+
+      if (_buffers[i].state == B_idle && _next < _total && !start_read(i))
+        break;
+    }
+
+  if (_status == -L4_EBUSY && _done == _total)
+    {
+      _status = L4_EOK;
+      _end_time = now();
+      Dbg::info().printf("Copy to %s finished in %llu ms.\n",
+                         _dst->hid().c_str(),
+                         (_end_time - _start_time) / 1000);
+    }
+}
+
+bool
+Copy_job::check_submit(int ret)
+{
+  if (ret >= 0)
+    return true;
+
+  if (ret == -L4_EBUSY)
+    {
+      // Client requests have precedence, try again later.
+      if (!_retry_pending)
+        {
+          _retry_pending = true;
+          server_iface()->add_timeout(&_retry, now() + Retry_us);
+        }
+    }
+  else
+    fail(ret);
+
+  return false;
+}
+
+void
+Copy_job::fail(int error)
+{
+  if (_status != -L4_EBUSY)
+    return;
+
+  Err().printf("Copy to %s failed after %llu sectors: %d\n",
+               _dst->hid().c_str(), _done, error);
+  _status = error;
+  _end_time = now();
+  release_destination();
+}
+
+void
+Copy_job::release_destination()
+{
+  if (_status == -L4_EBUSY && !_shutdown)
+    return;
+
+  for (auto const &b : _buffers)
+    if (b.state == B_writing)
+      return;
+
+  _dst_registration.reset();
+}
+
+bool
+Copy_job::start_read(unsigned idx)
+{
+  Buffer &b = _buffers[idx];
+
+  b.offset = _next;
+  b.sectors = cxx::min<l4_uint64_t>(_chunk_sectors, _total - _next);
+  b.block.dma_addr = b.src_phys;
+  b.block.num_sectors = b.sectors;
+
+  cxx::Ref_ptr<Copy_job> self(this);
+  b.state = B_reading;
+  int ret = _src->inout_data(_src_lba + b.offset, b.block,
+                             [self, idx](int error, l4_size_t)
+                               { self->finish_read(idx, error); },
+                             L4Re::Dma_space::Direction::From_device);
+  if (!check_submit(ret))
+    {
+      b.state = B_idle;
+      return false;
+    }
+
+  trace.printf("Reading chunk at %llu into buffer %u.\n", b.offset, idx);
+  _next += b.sectors;
+  return true;
+}
+
+bool
+Copy_job::start_write(unsigned idx)
+{
+  Buffer &b = _buffers[idx];
+
+  b.block.dma_addr = b.dst_phys;
+  b.block.num_sectors = b.sectors;
+
+  cxx::Ref_ptr<Copy_job> self(this);
+  b.state = B_writing;
+  int ret = _dst->inout_data(_dst_lba + b.offset, b.block,
+                             [self, idx](int error, l4_size_t)
+                               { self->finish_write(idx, error); },
+                             L4Re::Dma_space::Direction::To_device);
+  if (!check_submit(ret))
+    {
+      b.state = B_read_done;
+      return false;
+    }
+
+  trace.printf("Writing chunk at %llu from buffer %u.\n", b.offset, idx);
+  return true;
+}
+
+void
+Copy_job::finish_read(unsigned idx, int error)
+{
+  Buffer &b = _buffers[idx];
+
+  if (error < 0)
+    {
+      b.state = B_idle;
+      fail(error);
+      return;
+    }
+
+  b.state = B_read_done;
+  pump();
+}
+
+void
+Copy_job::finish_write(unsigned idx, int error)
+{
+  Buffer &b = _buffers[idx];
+
+  b.state = B_idle;
+  if (error < 0)
+    fail(error);
+  else
+    {
+      _done += b.sectors;
+      pump();
+    }
+
+  release_destination();
+}
+
+void
+Copy_job::dump_stats(Dbg const &log) const
+{
+  l4_kernel_clock_t end = _end_time ? _end_time : now();
+  l4_uint64_t us = end - _start_time;
+  l4_uint64_t kib = (_done * _src->sector_size()) >> 10;
+
+  log.printf("copy %s -> %s: %llu/%llu sectors (%u%%) %llu KiB/s status %ld\n",
+             _src->hid().c_str(), _dst->hid().c_str(), _done, _total,
+             stats_percent(_done, _total),
+             us ? (kib * 1000000) / us : 0ULL, _status);
+}
+
+} // namespace Ahci
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/cxx/ipc_timeout_queue>
+#include <l4/cxx/ref_ptr>
+#include <l4/cxx/unique_ptr>
+#include <l4/re/util/object_registry>
+#include <l4/sys/kip.h>
+#include <l4/ahci-driver/copy_job.h>
+
+#include <vector>
+
+#include "ahci_device.h"
+#include "stats.h"
+
+#include <l4/libblock-device/types.h>
+
+namespace Ahci {
+
+/**
+ * Copy of a sector range between two devices inside the driver.
+ *
+ * The data is moved through a small set of driver-owned DMA buffers.
+ * Each buffer cycles through reading a chunk from the source and writing
+ * it to the destination, so that reads and writes of different chunks
+ * overlap. The job only uses as many command slots as it has buffers.
+ * When a device has no free slot, the job waits Retry_us before it tries
+ * again; it is not otherwise ranked below client requests.
+ *
+ * The destination is written without regard to clients, so the job must
+ * only be created for a destination that is not in use. From start() until
+ * the copy has finished or is shut down and its last write has completed,
+ * the job holds an exclusive registration with the destination.
+ */
+class Copy_job
+: public L4::Epiface_t<Copy_job, Ahci_copy::Copy_job>,
+  public Stats_provider,
+  public cxx::Ref_obj
+{
+  enum Buffer_state
+  {
+    B_idle,      ///< Free for the next chunk
+    B_reading,   ///< Chunk is being read from the source
+    B_read_done, ///< Chunk is waiting to be written
+    B_writing,   ///< Chunk is being written to the destination
+  };
+
+  struct Buffer
+  {
+    cxx::unique_ptr<Block_device::Mem_region> region;
+    L4Re::Dma_space::Dma_addr src_phys = 0;
+    L4Re::Dma_space::Dma_addr dst_phys = 0;
+    Block_device::Inout_block block;
+    l4_uint64_t offset = 0;
+    l4_uint32_t sectors = 0;
+    Buffer_state state = B_idle;
+  };
+
+  class Retry_timeout : public L4::Ipc_svr::Timeout_queue::Timeout
+  {
+  public:
+    explicit Retry_timeout(Copy_job *job) : _job(job) {}
+
+    void expired() override
+    {
+      _job->_retry_pending = false;
+      _job->pump();
+    }
+
+  private:
+    Copy_job *_job;
+  };
+
+public:
+  enum
+  {
+    /// Number of buffers, i.e. maximum number of commands in flight.
+    Num_buffers = 4,
+    /// Maximum size of a single chunk in bytes.
+    Chunk_bytes = 0x100000,
+    /// Time to back off when a device is busy.
+    Retry_us = 1000,
+  };
+
+  /**
+   * Set up a new copy job.
+   *
+   * \param src      Device to read from.
+   * \param src_lba  First sector to read.
+   * \param dst      Device to write to.
+   * \param dst_lba  First sector to write.
+   * \param count    Number of sectors to copy.
+   * \param registry Registry the job is registered with.
+   */
+  Copy_job(cxx::Ref_ptr<Device> const &src, l4_uint64_t src_lba,
+           cxx::Ref_ptr<Device> const &dst, l4_uint64_t dst_lba,
+           l4_uint64_t count, L4Re::Util::Object_registry *registry);
+
+  ~Copy_job();
+
+  /**
+   * Allocate the copy buffers and map them for both devices.
+   *
+   * \retval L4_EOK  Buffers are ready.
+   * \retval <0      Allocation or DMA mapping failed.
+   */
+  long setup_buffers();
+
+  /// Start copying. Must be called after the job has been registered.
+  void start();
+
+  /// Cancel the copy and detach the job from the server loop.
+  void shutdown();
+
+  long op_progress(Ahci_copy::Copy_job::Rights, l4_uint64_t &done,
+                   l4_uint64_t &total);
+
+  void dump_stats(Dbg const &log) const override;
+
+private:
+  static l4_kernel_clock_t now()
+  { return l4_kip_clock(l4re_kip()); }
+
+  /// Start reads and writes on all buffers that are ready for it.
+  void pump();
+
+  bool start_read(unsigned idx);
+  bool start_write(unsigned idx);
+  void finish_read(unsigned idx, int error);
+  void finish_write(unsigned idx, int error);
+
+  /// Handle the return value of a submission, return true on success.
+  bool check_submit(int ret);
+
+  /// Stop the copy with the given error.
+  void fail(int error);
+
+  /// Give up the destination once the job is over and no write is pending.
+  void release_destination();
+
+  cxx::Ref_ptr<Device> _src;
+  cxx::Ref_ptr<Device> _dst;
+  l4_uint64_t _src_lba;
+  l4_uint64_t _dst_lba;
+  l4_uint64_t _total;
+  l4_uint32_t _chunk_sectors;
+  L4Re::Util::Object_registry *_registry;
+  cxx::unique_ptr<Client_registration> _dst_registration;
+
+  std::vector<Buffer> _buffers;
+  l4_uint64_t _next = 0;
+  l4_uint64_t _done = 0;
+  long _status = -L4_EBUSY;
+  bool _shutdown = false;
+
+  Retry_timeout _retry;
+  bool _retry_pending = false;
+  l4_kernel_clock_t _start_time = 0;
+  l4_kernel_clock_t _end_time = 0;
+};
+
+} // namespace Ahci
@@ -0,0 +1,559 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include <l4/cxx/minmax>
+
+#include <l4/libblock-device/errand.h>
+
+#include "block_list.h"
+#include "cow_device.h"
+
+static Dbg trace(Dbg::Trace, "cow");
+
+namespace Ahci {
+
+static char const Clone_magic[8] = { 'A', 'H', 'C', 'I', 'C', 'O', 'W', '1' };
+
+Cow_device::~Cow_device()
+{
+  if (_meta_phys)
+    _overlay->dma_unmap(_meta_phys, _data_sector,
+                        L4Re::Dma_space::Direction::Bidirectional);
+  if (_copy_base_phys)
+    _base->dma_unmap(_copy_base_phys, Copy_slots * _chunk_sectors,
+                     L4Re::Dma_space::Direction::Bidirectional);
+  if (_copy_overlay_phys)
+    _overlay->dma_unmap(_copy_overlay_phys, Copy_slots * _chunk_sectors,
+                        L4Re::Dma_space::Direction::Bidirectional);
+}
+
+l4_size_t
+Cow_device::max_size() const
+{ return cxx::min(_base->max_size(), _overlay->max_size()); }
+
+unsigned
+Cow_device::max_segments() const
+{ return cxx::min(_base->max_segments(), _overlay->max_segments()); }
+
+long
+Cow_device::compute_layout()
+{
+  _sector_size = _overlay->sector_size();
+  if (_base->sector_size() != _sector_size)
+    return -L4_EINVAL;
+  if (Chunk_bytes % _sector_size || Header_bytes % _sector_size)
+    return -L4_EINVAL;
+
+  _chunk_sectors = Chunk_bytes / _sector_size;
+  _map_sector = Header_bytes / _sector_size;
+  _base_sectors = _base->capacity() / _sector_size;
+  _num_chunks = (_base_sectors + _chunk_sectors - 1) / _chunk_sectors;
+  if (!_num_chunks)
+    return -L4_EINVAL;
+
+  l4_uint64_t map_sectors = (_num_chunks * sizeof(l4_uint32_t)
+                             + _sector_size - 1) / _sector_size;
+  _data_sector = (_map_sector + map_sectors + _chunk_sectors - 1)
+                 / _chunk_sectors * _chunk_sectors;
+
+  l4_uint64_t total = _overlay->capacity() / _sector_size;
+  if (_data_sector >= total)
+    return -L4_ENOSPC;
+
+  // Overlay chunks are numbered from 1 in the table.
+  _data_chunks = cxx::min<l4_uint64_t>((total - _data_sector) / _chunk_sectors,
+                                       ~0U - 1);
+  return _data_chunks ? L4_EOK : -L4_ENOSPC;
+}
+
+long
+Cow_device::alloc_buffers()
+{
+  // The metadata buffer holds header and table and is only used with the
+  // overlay. Chunks are copied from the base to the overlay through the
+  // copy buffer, so it is mapped for both.
+  long ret = alloc_io_buffer(_data_sector * _sector_size, &_meta,
+                             &_meta_virt);
+  if (ret < 0)
+    return ret;
+
+  ret = _overlay->dma_map(_meta.get(), 0, _data_sector,
+                          L4Re::Dma_space::Direction::Bidirectional,
+                          &_meta_phys);
+  if (ret < 0)
+    {
+      _meta_phys = 0;
+      return ret;
+    }
+
+  ret = alloc_io_buffer(Copy_slots * Chunk_bytes, &_copy, &_copy_virt);
+  if (ret < 0)
+    return ret;
+
+  ret = _base->dma_map(_copy.get(), 0, Copy_slots * _chunk_sectors,
+                       L4Re::Dma_space::Direction::Bidirectional,
+                       &_copy_base_phys);
+  if (ret < 0)
+    {
+      _copy_base_phys = 0;
+      return ret;
+    }
+
+  ret = _overlay->dma_map(_copy.get(), 0, Copy_slots * _chunk_sectors,
+                          L4Re::Dma_space::Direction::Bidirectional,
+                          &_copy_overlay_phys);
+  if (ret < 0)
+    _copy_overlay_phys = 0;
+
+  return ret;
+}
+
+void
+Cow_device::load(Block_device::Errand::Callback const &callback)
+{
+  _load_cb = callback;
+
+  long ret = compute_layout();
+  if (ret >= 0)
+    ret = alloc_buffers();
+
+  if (ret < 0)
+    {
+      load_done(ret);
+      return;
+    }
+
+  submit_io(_overlay, 0, _meta_phys, _meta_virt, _map_sector,
+            L4Re::Dma_space::Direction::From_device,
+            [this](int error)
+    {
+      if (error < 0)
+        {
+          load_done(error);
+          return;
+        }
+
+      Header const *h = header();
+      if (memcmp(h->magic, Clone_magic, sizeof(Clone_magic)) != 0)
+        {
+          if (!_create)
+            {
+              Err().printf("No clone found on %s.\n", _overlay->hid().c_str());
+              load_done(-L4_EINVAL);
+            }
+          else
+            format();
+          return;
+        }
+
+      if (h->version != 1 || h->chunk_sectors != _chunk_sectors
+          || h->num_chunks != _num_chunks || h->map_sector != _map_sector
+          || h->data_sector != _data_sector || h->data_chunks != _data_chunks
+          || h->base_sectors != _base_sectors)
+        {
+          Err().printf("Clone on %s does not match the device layout.\n",
+                       _overlay->hid().c_str());
+          load_done(-L4_EINVAL);
+          return;
+        }
+
+      // The overlay only makes sense on top of the base it was created for.
+      if (strncmp(h->base, _base->hid().c_str(), sizeof(h->base)) != 0)
+        {
+          Err().printf("Clone on %s belongs to base %.*s, not %s.\n",
+                       _overlay->hid().c_str(),
+                       int(strnlen(h->base, sizeof(h->base))), h->base,
+                       _base->hid().c_str());
+          load_done(-L4_EINVAL);
+          return;
+        }
+
+      submit_io(_overlay, _map_sector,
+                _meta_phys + _map_sector * _sector_size,
+                _meta_virt + _map_sector * _sector_size,
+                _data_sector - _map_sector,
+                L4Re::Dma_space::Direction::From_device,
+                [this](int error)
+                  {
+                    if (error < 0)
+                      load_done(error);
+                    else
+                      finish_load();
+                  });
+    });
+}
+
+void
+Cow_device::format()
+{
+  if (_base->hid().length() >= sizeof(Header::base))
+    {
+      Err().printf("Name of clone base %s too long.\n", _base->hid().c_str());
+      load_done(-L4_EINVAL);
+      return;
+    }
+
+  Dbg::info().printf("Creating clone %s of %s on %s.\n", _name.c_str(),
+                     _base->hid().c_str(), _overlay->hid().c_str());
+
+  // The table part of the buffer has not been read and is still zero.
+  memset(_meta_virt, 0, Header_bytes);
+  Header *h = header();
+  memcpy(h->magic, Clone_magic, sizeof(Clone_magic));
+  h->version = 1;
+  h->chunk_sectors = _chunk_sectors;
+  h->num_chunks = _num_chunks;
+  h->map_sector = _map_sector;
+  h->data_sector = _data_sector;
+  h->data_chunks = _data_chunks;
+  h->base_sectors = _base_sectors;
+  memcpy(h->base, _base->hid().c_str(), _base->hid().length());
+
+  // The empty table must be on the disk before the header declares the
+  // clone.
+  submit_io(_overlay, _map_sector, _meta_phys + _map_sector * _sector_size,
+            _meta_virt + _map_sector * _sector_size,
+            _data_sector - _map_sector, L4Re::Dma_space::Direction::To_device,
+            [this](int error)
+              {
+                if (error < 0)
+                  {
+                    load_done(error);
+                    return;
+                  }
+
+                submit_io(_overlay, 0, _meta_phys, _meta_virt, _map_sector,
+                          L4Re::Dma_space::Direction::To_device,
+                          [this](int error)
+                            {
+                              if (error < 0)
+                                load_done(error);
+                              else
+                                finish_load();
+                            });
+              });
+}
+
+void
+Cow_device::finish_load()
+{
+  // Overlay chunks are handed out in order, but a remapping that failed
+  // leaves a gap, so continue after the highest chunk in use.
+  l4_uint32_t const *m = map();
+  for (l4_uint64_t chunk = 0; chunk < _num_chunks; ++chunk)
+    {
+      if (!m[chunk])
+        continue;
+
+      if (m[chunk] > _data_chunks)
+        {
+          Err().printf("Clone %s: chunk %llu has an invalid table entry.\n",
+                       _name.c_str(), chunk);
+          load_done(-L4_EINVAL);
+          return;
+        }
+
+      ++_remapped;
+      _next_chunk = cxx::max<l4_uint64_t>(_next_chunk, m[chunk]);
+    }
+
+  load_done(L4_EOK);
+}
+
+void
+Cow_device::load_done(int error)
+{
+  if (error < 0)
+    Err().printf("Clone %s on %s not available: %d\n", _name.c_str(),
+                 _overlay->hid().c_str(), error);
+  else
+    {
+      Dbg::info().printf("Clone %s of %s on %s: %llu of %llu chunks "
+                         "modified.\n", _name.c_str(), _base->hid().c_str(),
+                         _overlay->hid().c_str(), _remapped, _num_chunks);
+      _ready = true;
+    }
+
+  _load_cb();
+}
+
+void
+Cow_device::write_map_entry(l4_uint64_t chunk, Io_done const &done)
+{
+  l4_uint64_t sector = _map_sector
+                       + chunk * sizeof(l4_uint32_t) / _sector_size;
+  submit_io(_overlay, sector, _meta_phys + sector * _sector_size,
+            _meta_virt + sector * _sector_size, 1,
+            L4Re::Dma_space::Direction::To_device, done);
+}
+
+bool
+Cow_device::is_remapping(l4_uint64_t chunk) const
+{
+  return std::find(_remapping.begin(), _remapping.end(), chunk)
+         != _remapping.end();
+}
+
+int
+Cow_device::inout_data(l4_uint64_t sector,
+                       Block_device::Inout_block const &blocks,
+                       Block_device::Inout_callback const &cb,
+                       L4Re::Dma_space::Direction dir)
+{
+  l4_uint64_t count = block_list_sectors(blocks);
+  if (!count || sector >= _base_sectors || count > _base_sectors - sector)
+    return -L4_EINVAL;
+
+  bool write = dir == L4Re::Dma_space::Direction::To_device;
+  auto req = std::make_shared<Split_request>();
+  req->cb = cb;
+
+  // Split the request where it changes between base and overlay. The
+  // request holds one reference of its own until all pieces have been
+  // started.
+  l4_uint32_t const *m = map();
+  for (l4_uint64_t skip = 0; skip < count;)
+    {
+      l4_uint64_t pos = sector + skip;
+      l4_uint64_t chunk = pos / _chunk_sectors;
+      l4_uint64_t offset = pos % _chunk_sectors;
+      l4_uint64_t n = cxx::min(count - skip, _chunk_sectors - offset);
+      l4_uint32_t entry = m[chunk];
+
+      int ret;
+      if (!entry && write)
+        // Concurrent first writes to a chunk would remap it twice.
+        ret = is_remapping(chunk) ? -L4_EBUSY
+                                  : remap(req, chunk, offset, n, blocks, skip);
+      else
+        {
+          // Following chunks in the same place go into the same piece.
+          for (l4_uint64_t c = chunk + 1; skip + n < count; ++c)
+            {
+              l4_uint32_t next = entry ? entry + (c - chunk) : 0;
+              if (m[c] != next)
+                break;
+
+              n += cxx::min(count - skip - n, _chunk_sectors);
+            }
+
+          if (entry)
+            ret = start_piece(req, true, data_sector(entry - 1) + offset, n,
+                              blocks, skip, dir);
+          else
+            {
+              ret = start_piece(req, false, pos, n, blocks, skip, dir);
+              if (ret >= 0)
+                ++_base_reads;
+            }
+        }
+
+      if (ret < 0)
+        {
+          // Pieces already in flight finish without completing the request,
+          // the client sees the error instead.
+          req->abandoned = true;
+          return ret;
+        }
+
+      skip += n;
+    }
+
+  req->piece_done(L4_EOK, 0);
+  return L4_EOK;
+}
+
+int
+Cow_device::start_piece(std::shared_ptr<Split_request> const &req, bool overlay,
+                        l4_uint64_t dev_sector, l4_uint64_t count,
+                        Block_device::Inout_block const &blocks,
+                        l4_uint64_t skip, L4Re::Dma_space::Direction dir)
+{
+  Block_device::Inout_block piece;
+  slice_blocks(&piece, blocks, skip, count, _sector_size);
+  if (!_dma.translate(&piece, overlay ? Overlay_dma : Base_dma))
+    return -L4_EINVAL;
+
+  ++req->pending;
+  auto const &dev = overlay ? _overlay : _base;
+  int ret = dev->inout_data(dev_sector, piece,
+                            [req](int error, l4_size_t size)
+                              { req->piece_done(error, size); }, dir);
+  if (ret < 0)
+    --req->pending;
+  else if (overlay)
+    ++_overlay_requests;
+
+  return ret;
+}
+
+int
+Cow_device::remap(std::shared_ptr<Split_request> const &req, l4_uint64_t chunk,
+                  l4_uint64_t offset, l4_uint64_t count,
+                  Block_device::Inout_block const &blocks, l4_uint64_t skip)
+{
+  if (_next_chunk >= _data_chunks)
+    {
+      Dbg::warn().printf("Overlay of clone %s is full.\n", _name.c_str());
+      return -L4_ENOSPC;
+    }
+
+  // A write covering the last chunk up to the end of the clone covers it
+  // completely, the rest of the chunk is never read.
+  l4_uint64_t chunk_end = cxx::min(_chunk_sectors,
+                                   _base_sectors - chunk * _chunk_sectors);
+  int slot = -1;
+  if (offset != 0 || count != chunk_end)
+    {
+      if (!_copy_free)
+        return -L4_EBUSY;
+
+      slot = __builtin_ctz(_copy_free);
+      _copy_free &= ~(1U << slot);
+    }
+
+  auto op = std::make_shared<Remap_op>();
+  op->req = req;
+  op->chunk = chunk;
+  op->ochunk = _next_chunk++;
+  op->offset = offset;
+  op->slot = slot;
+  // The data is written after the copy, so keep a copy of the block list.
+  slice_blocks(&op->blocks, blocks, skip, count, _sector_size);
+  if (!_dma.translate(&op->blocks, Overlay_dma))
+    {
+      --_next_chunk;
+      if (slot >= 0)
+        _copy_free |= 1U << slot;
+      return -L4_EINVAL;
+    }
+
+  _remapping.push_back(chunk);
+  ++req->pending;
+
+  trace.printf("Clone %s: remapping chunk %llu to overlay chunk %llu%s.\n",
+               _name.c_str(), chunk, op->ochunk,
+               slot >= 0 ? " with copy" : "");
+
+  if (slot >= 0)
+    copy_up(op);
+  else
+    write_remap_data(op);
+
+  return L4_EOK;
+}
+
+void
+Cow_device::copy_up(std::shared_ptr<Remap_op> const &op)
+{
+  l4_uint64_t n = cxx::min(_chunk_sectors,
+                           _base_sectors - op->chunk * _chunk_sectors);
+  l4_size_t ofs = op->slot * Chunk_bytes;
+
+  submit_io(_base, op->chunk * _chunk_sectors, _copy_base_phys + ofs,
+            _copy_virt + ofs, n, L4Re::Dma_space::Direction::From_device,
+            [this, op, n, ofs](int error)
+    {
+      if (error < 0)
+        {
+          finish_remap(op, error, 0);
+          return;
+        }
+
+      submit_io(_overlay, data_sector(op->ochunk), _copy_overlay_phys + ofs,
+                _copy_virt + ofs, n, L4Re::Dma_space::Direction::To_device,
+                [this, op](int error)
+                  {
+                    _copy_free |= 1U << op->slot;
+                    op->slot = -1;
+                    ++_copy_ups;
+                    if (error < 0)
+                      finish_remap(op, error, 0);
+                    else
+                      write_remap_data(op);
+                  });
+    });
+}
+
+void
+Cow_device::write_remap_data(std::shared_ptr<Remap_op> const &op)
+{
+  int ret = _overlay->inout_data(data_sector(op->ochunk) + op->offset,
+                                 op->blocks,
+                                 [this, op](int error, l4_size_t size)
+                                   {
+                                     if (error < 0)
+                                       finish_remap(op, error, 0);
+                                     else
+                                       commit_remap(op, size);
+                                   },
+                                 L4Re::Dma_space::Direction::To_device);
+  if (ret == -L4_EBUSY)
+    Block_device::Errand::schedule([this, op]() { write_remap_data(op); },
+                                   Io_retry_us);
+  else if (ret < 0)
+    finish_remap(op, ret, 0);
+}
+
+void
+Cow_device::commit_remap(std::shared_ptr<Remap_op> const &op,
+                         l4_size_t bytes)
+{
+  // The chunk is complete on the overlay, so reads may use it while the
+  // entry is being written.
+  map()[op->chunk] = op->ochunk + 1;
+  op->committing = true;
+
+  write_map_entry(op->chunk, [this, op, bytes](int error)
+    {
+      if (error < 0)
+        {
+          map()[op->chunk] = 0;
+          finish_remap(op, error, 0);
+          return;
+        }
+
+      ++_remapped;
+      finish_remap(op, L4_EOK, bytes);
+    });
+}
+
+void
+Cow_device::finish_remap(std::shared_ptr<Remap_op> const &op, int error,
+                         l4_size_t bytes)
+{
+  if (op->slot >= 0)
+    _copy_free |= 1U << op->slot;
+
+  // Chunks are handed out in order, so only the last one can be returned.
+  // Once the table entry is being written, the chunk may be referenced by
+  // reads in flight or by the entry on the disk, and is given up.
+  if (error < 0 && !op->committing && op->ochunk + 1 == _next_chunk)
+    --_next_chunk;
+
+  _remapping.erase(std::find(_remapping.begin(), _remapping.end(),
+                             op->chunk));
+  op->req->piece_done(error, bytes);
+}
+
+void
+Cow_device::dump_stats(Dbg const &log) const
+{
+  if (!_ready)
+    return;
+
+  log.printf("clone %s: %llu/%llu chunks modified (%u%%), overlay %llu/%llu "
+             "chunks used, %llu copy-ups, %llu base reads, "
+             "%llu overlay requests\n",
+             _name.c_str(), _remapped, _num_chunks,
+             stats_percent(_remapped, _num_chunks), _next_chunk,
+             _data_chunks, _copy_ups, _base_reads, _overlay_requests);
+}
+
+} // namespace Ahci
@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <l4/cxx/ref_ptr>
+#include <l4/cxx/unique_ptr>
+
+#include "ahci_device.h"
+#include "composite_io.h"
+#include "stats.h"
+
+#include <l4/libblock-device/types.h>
+
+namespace Ahci {
+
+/**
+ * Copy-on-write clone of a disk or partition.
+ *
+ * The clone reads from a base device that is never written and keeps all
+ * changes in an overlay device. The overlay starts with a header and the
+ * remap table, followed by the data chunks. The table has one entry per
+ * chunk of the clone, which names the overlay chunk holding its data, or
+ * is 0 if the chunk is still unmodified and read from the base. Header and
+ * table are kept in memory; table changes are written through to the disk
+ * sector by sector.
+ *
+ * Creating a clone only writes an empty table. The first write to a chunk
+ * copies the chunk from the base to a new overlay chunk unless the write
+ * covers it completely, then the data is written and only afterwards the
+ * table entry, so that the clone never sees a partially copied chunk.
+ *
+ * Base and overlay may be attached to different controllers, so memory
+ * registered by a client is mapped for both, see Composite_dma.
+ */
+class Cow_device
+: public Block_device::Device_with_notification_domain<Device>,
+  public Stats_provider
+{
+  struct Header
+  {
+    char magic[8];
+    l4_uint32_t version;
+    l4_uint32_t chunk_sectors;
+    l4_uint64_t num_chunks;
+    l4_uint64_t map_sector;
+    l4_uint64_t data_sector;
+    l4_uint64_t data_chunks;
+    l4_uint64_t base_sectors;
+    /// Name of the base device, to detect a clone of another device.
+    char base[64];
+  };
+
+  /// Remapping of a chunk for the first write to it.
+  struct Remap_op
+  {
+    std::shared_ptr<Split_request> req;
+    l4_uint64_t chunk;
+    l4_uint64_t ochunk;
+    l4_uint64_t offset;
+    /// Copy buffer slot, -1 if the write covers the whole chunk.
+    int slot;
+    /// The table entry is being written, so the chunk may be in use.
+    bool committing = false;
+    /// Part of the client request that goes into the chunk, translated for
+    /// the overlay.
+    Block_device::Inout_block blocks;
+  };
+
+  /// Index of base and overlay in the DMA address space.
+  enum { Base_dma, Overlay_dma };
+
+public:
+  enum
+  {
+    /// Remapping unit of the clone in bytes.
+    Chunk_bytes = 0x10000,
+    /// Space reserved for the header in bytes.
+    Header_bytes = 0x1000,
+    /// Number of chunks that may be copied from the base at the same time.
+    Copy_slots = 4,
+  };
+
+  static_assert(sizeof(Header) <= Header_bytes, "Clone header too large.");
+
+  /**
+   * Create a clone.
+   *
+   * \param name     Name of the clone, used by clients to select it.
+   * \param base     Device the clone starts out as a copy of.
+   * \param overlay  Device holding the changes of the clone.
+   * \param create   Initialize the overlay as an unmodified clone if it does
+   *                 not contain one yet.
+   */
+  Cow_device(std::string const &name, cxx::Ref_ptr<Device> const &base,
+             cxx::Ref_ptr<Device> const &overlay, bool create)
+  : _name(name), _base(base), _overlay(overlay), _create(create)
+  {
+    _dma.add_device(base);
+    _dma.add_device(overlay);
+  }
+
+  ~Cow_device();
+
+  /**
+   * Read the clone metadata from the overlay.
+   *
+   * \param callback  Called when the clone is ready or could not be loaded.
+   */
+  void load(Block_device::Errand::Callback const &callback);
+
+  /// Return whether load() has finished successfully.
+  bool ready() const
+  { return _ready; }
+
+  bool is_read_only() const override
+  { return _overlay->is_read_only(); }
+
+  bool match_hid(cxx::String const &hid) const override
+  { return hid == cxx::String(_name.c_str(), _name.length()); }
+
+  l4_uint64_t capacity() const override
+  { return _base_sectors * _sector_size; }
+
+  l4_size_t sector_size() const override
+  { return _sector_size; }
+
+  l4_size_t max_size() const override;
+
+  unsigned max_segments() const override;
+
+  unsigned max_in_flight() const override
+  { return _overlay->max_in_flight(); }
+
+  std::string const &hid() const override
+  { return _name; }
+
+  void reset() override
+  {}
+
+  int dma_map(Block_device::Mem_region *region, l4_addr_t offset,
+              l4_size_t num_sectors, L4Re::Dma_space::Direction dir,
+              L4Re::Dma_space::Dma_addr *phys) override
+  { return _dma.map(region, offset, num_sectors, dir, phys); }
+
+  int dma_unmap(L4Re::Dma_space::Dma_addr phys, l4_size_t num_sectors,
+                L4Re::Dma_space::Direction dir) override
+  { return _dma.unmap(phys, num_sectors, dir); }
+
+  int inout_data(l4_uint64_t sector, Block_device::Inout_block const &blocks,
+                 Block_device::Inout_callback const &cb,
+                 L4Re::Dma_space::Direction dir) override;
+
+  int flush(Block_device::Inout_callback const &cb) override
+  { return _overlay->flush(cb); }
+
+  void start_device_scan(Block_device::Errand::Callback const &callback) override
+  { callback(); }
+
+  void dump_stats(Dbg const &log) const override;
+
+private:
+  Header *header() const
+  { return reinterpret_cast<Header *>(_meta_virt); }
+
+  l4_uint32_t *map() const
+  {
+    return reinterpret_cast<l4_uint32_t *>(_meta_virt
+                                           + _map_sector * _sector_size);
+  }
+
+  l4_uint64_t data_sector(l4_uint64_t ochunk) const
+  { return _data_sector + ochunk * _chunk_sectors; }
+
+  long compute_layout();
+  long alloc_buffers();
+  void format();
+  void finish_load();
+  void load_done(int error);
+
+  void write_map_entry(l4_uint64_t chunk, Io_done const &done);
+
+  bool is_remapping(l4_uint64_t chunk) const;
+
+  int start_piece(std::shared_ptr<Split_request> const &req, bool overlay,
+                  l4_uint64_t dev_sector, l4_uint64_t count,
+                  Block_device::Inout_block const &blocks, l4_uint64_t skip,
+                  L4Re::Dma_space::Direction dir);
+  int remap(std::shared_ptr<Split_request> const &req, l4_uint64_t chunk,
+            l4_uint64_t offset, l4_uint64_t count,
+            Block_device::Inout_block const &blocks, l4_uint64_t skip);
+  void copy_up(std::shared_ptr<Remap_op> const &op);
+  void write_remap_data(std::shared_ptr<Remap_op> const &op);
+  void commit_remap(std::shared_ptr<Remap_op> const &op, l4_size_t bytes);
+  void finish_remap(std::shared_ptr<Remap_op> const &op, int error,
+                    l4_size_t bytes);
+
+  std::string _name;
+  cxx::Ref_ptr<Device> _base;
+  cxx::Ref_ptr<Device> _overlay;
+  bool _create;
+  bool _ready = false;
+
+  l4_size_t _sector_size = 0;
+  l4_uint64_t _chunk_sectors = 0;
+  l4_uint64_t _base_sectors = 0;
+  l4_uint64_t _num_chunks = 0;
+  l4_uint64_t _map_sector = 0;
+  l4_uint64_t _data_sector = 0;
+  l4_uint64_t _data_chunks = 0;
+  /**
+   * Next free overlay chunk. Chunks are only released by a remapping that
+   * failed before its table entry was written and got the last chunk.
+   */
+  l4_uint64_t _next_chunk = 0;
+
+  cxx::unique_ptr<Block_device::Mem_region> _meta;
+  L4Re::Dma_space::Dma_addr _meta_phys = 0;
+  char *_meta_virt = nullptr;
+
+  /// Buffer for copying chunks, one slot of Chunk_bytes per copy.
+  cxx::unique_ptr<Block_device::Mem_region> _copy;
+  L4Re::Dma_space::Dma_addr _copy_base_phys = 0;
+  L4Re::Dma_space::Dma_addr _copy_overlay_phys = 0;
+  char *_copy_virt = nullptr;
+  unsigned _copy_free = (1U << Copy_slots) - 1;
+
+  /// Clone chunks with a remapping in progress.
+  std::vector<l4_uint64_t> _remapping;
+  Block_device::Errand::Callback _load_cb;
+
+  /// Client memory mapped for base and overlay.
+  Composite_dma _dma;
+
+  l4_uint64_t _remapped = 0;
+  l4_uint64_t _copy_ups = 0;
+  l4_uint64_t _base_reads = 0;
+  l4_uint64_t _overlay_requests = 0;
+};
+
+} // namespace Ahci
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include "cycle_stats.h"
+
+#ifdef AHCI_CYCLE_STATS
+
+#include <l4/re/env>
+#include <l4/sys/thread>
+
+namespace Ahci {
+
+void
+Thread_cpu_stats::dump_stats(Dbg const &log) const
+{
+  l4_kernel_clock_t us = 0;
+  if (l4_error(L4Re::Env::env()->main_thread()->stats_time(&us)) < 0)
+    return;
+
+  l4_kernel_clock_t clock = l4_kip_clock(l4re_kip());
+  l4_kernel_clock_t busy = us - _last_time;
+  l4_kernel_clock_t elapsed = clock - _last_clock;
+
+  log.printf("thread: %llu us cpu total, %llu us (%u%%) since last report\n",
+             us, busy, stats_percent(busy, elapsed));
+
+  _last_time = us;
+  _last_clock = clock;
+}
+
+} // namespace Ahci
+
+#endif
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+/**
+ * \file
+ * Accounting of CPU cycles spent in the driver.
+ *
+ * Only available when the driver is built with AHCI_CYCLE_STATS=y. In all
+ * other builds AHCI_CYCLE_SCOPE() expands to nothing.
+ */
+
+#ifdef AHCI_CYCLE_STATS
+
+#include <l4/sys/kip.h>
+#include <l4/sys/types.h>
+
+#include "stats.h"
+
+namespace Ahci {
+
+/**
+ * Return a cycle count from a free-running counter.
+ *
+ * Uses the TSC on x86 and the generic timer on arm64. Other architectures
+ * fall back to the KIP clock in microseconds.
+ */
+inline l4_uint64_t
+read_cycles()
+{
+#if defined(__i386__) || defined(__x86_64__)
+  return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+  l4_uint64_t v;
+  asm volatile ("isb; mrs %0, CNTVCT_EL0" : "=r"(v));
+  return v;
+#else
+  return l4_kip_clock(l4re_kip());
+#endif
+}
+
+/**
+ * Accumulated cycles of a code path.
+ */
+struct Cycle_counter
+{
+  l4_uint64_t cycles = 0;
+  l4_uint64_t calls = 0;
+
+  void add(l4_uint64_t c)
+  {
+    cycles += c;
+    ++calls;
+  }
+
+  l4_uint64_t per_call() const
+  { return calls ? cycles / calls : 0; }
+};
+
+/**
+ * Add the cycles spent in a scope to a counter.
+ */
+class Cycle_scope
+{
+public:
+  explicit Cycle_scope(Cycle_counter &c) : _c(c), _start(read_cycles()) {}
+  ~Cycle_scope() { _c.add(read_cycles() - _start); }
+
+private:
+  Cycle_counter &_c;
+  l4_uint64_t _start;
+};
+
+/**
+ * Cycles spent on behalf of one port.
+ */
+struct Port_cycles
+{
+  Cycle_counter irq;      ///< Interrupt processing
+  Cycle_counter submit;   ///< Command submission
+  Cycle_counter complete; ///< Completion callbacks
+
+  /// Return the cycles spent per completed I/O.
+  l4_uint64_t per_io() const
+  {
+    return complete.calls
+           ? (irq.cycles + submit.cycles + complete.cycles) / complete.calls
+           : 0;
+  }
+};
+
+/**
+ * Reports the CPU time consumed by the thread running the server loop.
+ */
+class Thread_cpu_stats : public Stats_provider
+{
+public:
+  void dump_stats(Dbg const &log) const override;
+
+private:
+  mutable l4_kernel_clock_t _last_time = 0;
+  mutable l4_kernel_clock_t _last_clock = 0;
+};
+
+} // namespace Ahci
+
+#define AHCI_CYCLE_CONCAT_(a, b) a##b
+#define AHCI_CYCLE_CONCAT(a, b) AHCI_CYCLE_CONCAT_(a, b)
+
+/// Account the cycles spent from here to the end of the scope to `counter`.
+#define AHCI_CYCLE_SCOPE(counter) \
+  Ahci::Cycle_scope AHCI_CYCLE_CONCAT(_cycle_scope_, __LINE__)(counter)
+
+#else
+
+#define AHCI_CYCLE_SCOPE(counter) do {} while (0)
+
+#endif
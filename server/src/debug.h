@@ -21,7 +21,8 @@ public:
     Warn  = 1,
     Info  = 2,
     Trace = 4,
-    Steptrace = 8
+    Steptrace = 8,
+    Stats = 16
   };
 
   Dbg(unsigned long l = Info, char const *subsys = "")
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include "fault_injection.h"
+
+#ifdef AHCI_FAULT_INJECTION
+
+#include "ahci_types.h"
+
+namespace Ahci {
+
+static char const *const fault_names[Ahci_fault::Num_faults] =
+{
+  "task file error",
+  "host bus fatal",
+  "interface fatal",
+  "dropped completion",
+  "phyrdy loss",
+  "slow command",
+};
+
+long
+Fault_injector::set_fault(unsigned fault, unsigned permille, unsigned delay_ms)
+{
+  if (fault >= Ahci_fault::Num_faults || permille > 1000)
+    return -L4_EINVAL;
+
+  _faults[fault].permille = permille;
+  if (fault == Ahci_fault::Slow_command)
+    _delay_us = delay_ms * 1000;
+
+  if (permille == 0 && _armed == fault)
+    _armed = Ahci_fault::Num_faults;
+
+  Dbg::info().printf("Fault injection: %s at %u/1000.\n", fault_names[fault],
+                     permille);
+  return L4_EOK;
+}
+
+void
+Fault_injector::clear()
+{
+  for (auto &f : _faults)
+    f.permille = 0;
+
+  _armed = Ahci_fault::Num_faults;
+}
+
+long
+Fault_injector::stats(unsigned fault, l4_uint64_t &injected,
+                      l4_uint64_t &affected, l4_uint64_t &recovered,
+                      l4_uint64_t &recovery_us) const
+{
+  if (fault >= Ahci_fault::Num_faults)
+    return -L4_EINVAL;
+
+  Fault_stats const &f = _faults[fault];
+  injected = f.injected;
+  affected = f.affected;
+  recovered = f.recovery.total();
+  recovery_us = f.recovery.sum_us();
+
+  return L4_EOK;
+}
+
+bool
+Fault_injector::roll(unsigned fault)
+{
+  if (!_faults[fault].permille)
+    return false;
+
+  _rng ^= _rng << 13;
+  _rng ^= _rng >> 7;
+  _rng ^= _rng << 17;
+
+  return _rng % 1000 < _faults[fault].permille;
+}
+
+void
+Fault_injector::start(unsigned fault, unsigned affected)
+{
+  Fault_stats &f = _faults[fault];
+  ++f.injected;
+  f.affected += affected;
+  if (!f.pending_since)
+    f.pending_since = now();
+}
+
+void
+Fault_injector::finish(unsigned fault)
+{
+  Fault_stats &f = _faults[fault];
+  if (f.pending_since)
+    {
+      f.recovery.record(now() - f.pending_since);
+      f.pending_since = 0;
+    }
+}
+
+unsigned
+Fault_injector::on_submit()
+{
+  if (_armed == Ahci_fault::Num_faults)
+    for (unsigned f = 0; f < Ahci_fault::Slow_command; ++f)
+      if (roll(f))
+        {
+          _armed = f;
+          break;
+        }
+
+  if (!roll(Ahci_fault::Slow_command))
+    return 0;
+
+  start(Ahci_fault::Slow_command, 1);
+  return _delay_us;
+}
+
+l4_uint32_t
+Fault_injector::interrupt_fault(unsigned in_flight)
+{
+  l4_uint32_t status;
+  switch (_armed)
+    {
+    case Ahci_fault::Task_file_error:
+      status = Regs::Port::Is_tfes;
+      break;
+    case Ahci_fault::Host_bus_fatal:
+      status = Regs::Port::Is_hbfs;
+      break;
+    case Ahci_fault::Interface_fatal:
+      status = Regs::Port::Is_ifs;
+      break;
+    case Ahci_fault::Phy_ready_loss:
+      status = Regs::Port::Is_prcs;
+      break;
+    default:
+      return 0;
+    }
+
+  start(_armed, in_flight);
+  _armed = Ahci_fault::Num_faults;
+  return status;
+}
+
+bool
+Fault_injector::drop_completion(unsigned completed)
+{
+  if (_armed != Ahci_fault::Dropped_completion || completed == 0)
+    return false;
+
+  start(_armed, completed);
+  _armed = Ahci_fault::Num_faults;
+  return true;
+}
+
+void
+Fault_injector::port_ready()
+{
+  finish(Ahci_fault::Task_file_error);
+  finish(Ahci_fault::Host_bus_fatal);
+  finish(Ahci_fault::Interface_fatal);
+  finish(Ahci_fault::Phy_ready_loss);
+}
+
+void
+Fault_injector::dump_stats(Dbg const &log, unsigned portno) const
+{
+  for (unsigned i = 0; i < Ahci_fault::Num_faults; ++i)
+    {
+      Fault_stats const &f = _faults[i];
+      if (!f.permille && !f.injected)
+        continue;
+
+      log.printf("  port %u fault %s: %u/1000, %llu injected, "
+                 "%llu requests affected%s, recovery",
+                 portno, fault_names[i], f.permille, f.injected, f.affected,
+                 f.pending_since ? ", recovery pending" : "");
+      f.recovery.dump(log);
+    }
+}
+
+} // namespace Ahci
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+/**
+ * \file
+ * Injection of faults into the command processing of a port.
+ *
+ * Only available when the driver is built with AHCI_FAULT_INJECTION=y.
+ */
+
+#ifdef AHCI_FAULT_INJECTION
+
+#include <l4/cxx/ref_ptr>
+#include <l4/sys/cxx/ipc_epiface>
+#include <l4/sys/kip.h>
+#include <l4/ahci-driver/fault_injection.h>
+
+#include "stats.h"
+
+namespace Ahci {
+
+/**
+ * Decides which commands of a port run into a fault and records how long
+ * the port takes to recover from it.
+ *
+ * Error interrupts, lost completions and PhyRdy loss are armed when a
+ * command is submitted and take effect with the next interrupt of the
+ * port. The recovery time ends when the port is ready again or, for a
+ * lost completion, when the next interrupt finishes the held back commands.
+ */
+class Fault_injector
+{
+  struct Fault_stats
+  {
+    unsigned permille = 0;
+    l4_uint64_t injected = 0;
+    l4_uint64_t affected = 0;
+    l4_kernel_clock_t pending_since = 0;
+    Latency_histogram recovery;
+  };
+
+public:
+  /// Configure a fault, see Ahci_fault::Fault_control::set_fault().
+  long set_fault(unsigned fault, unsigned permille, unsigned delay_ms);
+
+  /// Disable all faults.
+  void clear();
+
+  /// Return statistics of a fault, see Ahci_fault::Fault_control::stats().
+  long stats(unsigned fault, l4_uint64_t &injected, l4_uint64_t &affected,
+             l4_uint64_t &recovered, l4_uint64_t &recovery_us) const;
+
+  /**
+   * Decide whether a newly submitted command is delayed.
+   *
+   * \return Delay in microseconds or 0 if the command is issued normally.
+   *
+   * Also arms the interrupt faults for the next interrupt of the port.
+   */
+  unsigned on_submit();
+
+  /// The delayed command has been issued to the device.
+  void slow_command_issued()
+  { finish(Ahci_fault::Slow_command); }
+
+  /**
+   * Return the interrupt status bits to report with the current interrupt.
+   *
+   * \param in_flight  Number of commands in flight.
+   */
+  l4_uint32_t interrupt_fault(unsigned in_flight);
+
+  /**
+   * Return true if the completions of the current interrupt are to be lost.
+   *
+   * \param completed  Number of commands finished by the hardware.
+   */
+  bool drop_completion(unsigned completed);
+
+  /// Completions of the port have been processed.
+  void completions_processed()
+  { finish(Ahci_fault::Dropped_completion); }
+
+  /// The port is ready for commands again.
+  void port_ready();
+
+  /// Write the statistics of all faults used so far to the log.
+  void dump_stats(Dbg const &log, unsigned portno) const;
+
+private:
+  static l4_kernel_clock_t now()
+  { return l4_kip_clock(l4re_kip()); }
+
+  bool roll(unsigned fault);
+  void start(unsigned fault, unsigned affected);
+  void finish(unsigned fault);
+
+  unsigned _delay_us = 0;
+  /// Interrupt fault armed for the next interrupt, Num_faults if none.
+  unsigned _armed = Ahci_fault::Num_faults;
+  l4_uint64_t _rng = 0x9e3779b97f4a7c15ULL;
+  Fault_stats _faults[Ahci_fault::Num_faults];
+};
+
+/**
+ * IPC server object controlling the fault injector of a port.
+ */
+class Fault_control
+: public L4::Epiface_t<Fault_control, Ahci_fault::Fault_control>,
+  public cxx::Ref_obj
+{
+public:
+  explicit Fault_control(Fault_injector *injector) : _injector(injector) {}
+
+  /// Disable all faults of the port, called when the client went away.
+  void shutdown()
+  { _injector->clear(); }
+
+  long op_set_fault(Ahci_fault::Fault_control::Rights, unsigned fault,
+                    unsigned permille, unsigned delay_ms)
+  { return _injector->set_fault(fault, permille, delay_ms); }
+
+  long op_stats(Ahci_fault::Fault_control::Rights, unsigned fault,
+                l4_uint64_t &injected, l4_uint64_t &affected,
+                l4_uint64_t &recovered, l4_uint64_t &recovery_us)
+  {
+    return _injector->stats(fault, injected, affected, recovered,
+                            recovery_us);
+  }
+
+private:
+  Fault_injector *_injector;
+};
+
+} // namespace Ahci
+
+#endif
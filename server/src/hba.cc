@@ -9,12 +9,15 @@
 #include <l4/re/dataspace>
 #include <l4/re/error_helper>
 #include <l4/re/util/cap_alloc>
+#include <l4/sys/ipc.h>
+#include <l4/sys/kip.h>
 
 #include <l4/vbus/vbus>
 #include <l4/vbus/vbus_pci>
 #include <l4/vbus/vbus_interfaces.h>
 #include <cstring>
 #include <endian.h>
+#include <memory>
 
 #include "hba.h"
 #include "debug.h"
@@ -28,6 +31,9 @@ static Dbg trace(Dbg::Trace, "hba");
 namespace Ahci {
 
 bool Hba::check_address_width = true;
+std::array<unsigned char, 32> Hba::max_link_speed;
+std::array<Ahci_port::Lpm_policy, 32> Hba::lpm_policy;
+unsigned Hba::lpm_idle_ms = 100;
 
 Hba::Hba(L4vbus::Pci_dev const &dev,
          L4Re::Util::Shared_cap<L4Re::Dma_space> const &dma)
@@ -47,8 +53,11 @@ Hba::Hba(L4vbus::Pci_dev const &dev,
       cfg_write_16(0x04, cmd | 4);
     }
 
-  // set AHCI mode -- XXX done by BIOS?
-  _regs[Regs::Hba::Ghc].set(Regs::Hba::Ghc_ae);
+  bios_handoff();
+
+  // set AHCI mode, the firmware may have done so already
+  if (!(_regs[Regs::Hba::Ghc] & Regs::Hba::Ghc_ae))
+    _regs[Regs::Hba::Ghc].set(Regs::Hba::Ghc_ae);
 
   // setup ports
   Hba_features feats = features();
@@ -58,6 +67,9 @@ Hba::Hba(L4vbus::Pci_dev const &dev,
                  "Cannot address 32bit devices on 64bit system. "
                  "Start driver with -A to disable test.");
 
+  trace.printf("Maximum interface speed: %s\n",
+               Ahci_port::link_speed_name(feats.iss()));
+
   l4_uint32_t ports = _regs[Regs::Hba::Pi];
   trace.printf("Port information: 0x%x\n", ports);
 
@@ -67,7 +79,15 @@ Hba::Hba(L4vbus::Pci_dev const &dev,
     {
       if (ports & (1 << portno))
         {
-          int ret = p.attach(_iomem.port_base_address(portno), buswidth, dma);
+          p.set_staggered_spinup(feats.sss());
+          int ret = p.attach(portno, _iomem.port_base_address(portno),
+                             buswidth, dma);
+          p.set_speed_limit(max_link_speed[portno]);
+          p.set_ncq_supported(feats.sncq());
+          if (ret >= 0)
+            p.set_lpm_policy(lpm_policy[portno], lpm_idle_ms, feats,
+                             features2());
+          p.set_fatal_handler([this]() { reset([]{}); });
           trace.printf("Registration of port %d %s(%i) @0x%lx\n",
                        portno,
                        ret < 0 ? "failed" : "done", ret,
@@ -80,6 +100,44 @@ Hba::Hba(L4vbus::Pci_dev const &dev,
     }
 }
 
+void
+Hba::bios_handoff()
+{
+  // The handoff register exists since AHCI 1.2 if the HBA reports it.
+  if (_regs[Regs::Hba::Vs] < 0x10200 || !features2().boh())
+    return;
+
+  l4_uint32_t bohc = _regs[Regs::Hba::Bohc];
+  if (bohc & Regs::Hba::Bohc_oos)
+    return;
+
+  l4_kernel_clock_t start = l4_kip_clock(l4re_kip());
+  _regs[Regs::Hba::Bohc] = bohc | Regs::Hba::Bohc_oos;
+
+  // The firmware either releases the HBA right away or reports that it is
+  // busy finishing outstanding commands, which may take a while longer.
+  unsigned waited = 0;
+  for (;;)
+    {
+      l4_ipc_sleep_ms(Handoff_release_ms);
+      waited += Handoff_release_ms;
+
+      bohc = _regs[Regs::Hba::Bohc];
+      if (!(bohc & Regs::Hba::Bohc_bos))
+        break;
+
+      if (!(bohc & Regs::Hba::Bohc_bb) || waited >= Handoff_busy_ms)
+        {
+          Dbg::warn().printf("Firmware did not release the HBA, "
+                             "taking it over.\n");
+          break;
+        }
+    }
+
+  _handoff_ms = (l4_kip_clock(l4re_kip()) - start) / 1000;
+  trace.printf("BIOS/OS handoff took %u ms.\n", _handoff_ms);
+}
+
 void Hba::scan_ports(std::function<void(Ahci_port *)> callback)
 {
   // the raw value is 0-based, thus add one to get the real number
@@ -89,27 +147,53 @@ void Hba::scan_ports(std::function<void(Ahci_port *)> callback)
       if (p.device_type() != Ahci_port::Ahcidev_none)
         {
           auto port = &p;
-          p.initialize(
-            [=]()
-              {
-                try
-                  {
-                    port->initialize_memory(ncs);
-                    port->enable(
-                      [=]()
-                       {
-                         if (port->is_ready())
-                           callback(port);
-                         else
-                           callback(nullptr);
-                       });
-                  }
-                catch (L4::Runtime_error const &e)
+          auto setup = [=]()
+            {
+              try
+                {
+                  port->initialize_memory(ncs);
+                  port->enable(
+                    [=]()
+                     {
+                       if (port->is_ready())
+                         callback(port);
+                       else
+                         callback(nullptr);
+                     });
+                }
+              catch (L4::Runtime_error const &e)
+                {
+                  Err().printf("Could not enable port: %s\n", e.str());
+                  callback(nullptr);
+                }
+            };
+
+          auto start = [=]()
+            {
+              port->initialize(
+                [=]()
                   {
-                    Err().printf("Could not enable port: %s\n", e.str());
-                    callback(nullptr);
-                  }
+                    // A speed limit only takes effect with the next link
+                    // negotiation, which needs the stopped port.
+                    if (port->speed_limit())
+                      port->reset(setup);
+                    else
+                      setup();
+                  });
+            };
+
+          // Ports that are already up do not wait for the disks that still
+          // have to spin up.
+          if (port->spinup_pending())
+            port->spin_up([=](bool present)
+              {
+                if (present)
+                  start();
+                else
+                  callback(nullptr);
               });
+          else
+            start();
         }
       else
         callback(nullptr);
@@ -120,6 +204,8 @@ void Hba::scan_ports(std::function<void(Ahci_port *)> callback)
 void
 Hba::handle_irq()
 {
+  AHCI_CYCLE_SCOPE(_irq_cycles);
+
   l4_uint32_t is = _regs[Regs::Hba::Is];
   l4_uint32_t is_clear = is;
 
@@ -138,6 +224,73 @@ Hba::handle_irq()
 }
 
 
+void
+Hba::reset(Block_device::Errand::Callback const &callback)
+{
+  if (_resetting || _reset_scheduled)
+    return;
+
+  l4_kernel_clock_t start = l4_kip_clock(l4re_kip());
+  if (_resets && start - _last_reset < Min_reset_interval_us)
+    {
+      l4_kernel_clock_t wait = Min_reset_interval_us - (start - _last_reset);
+      Dbg::warn().printf("Port failure, delaying HBA reset by %llu ms.\n",
+                         wait / 1000);
+      _reset_scheduled = true;
+      Block_device::Errand::schedule([=]()
+                                       {
+                                         _reset_scheduled = false;
+                                         reset(callback);
+                                       }, wait);
+      return;
+    }
+
+  _resetting = true;
+  ++_resets;
+  Err().printf("Port failure, resetting HBA (reset #%u).\n", _resets);
+
+  for (auto &p : _ports)
+    p.suspend_for_hba_reset();
+
+  // The reset restores the HwInit fields to their defaults, which need
+  // not be what the firmware programmed (AHCI 1.3, 10.4.3).
+  l4_uint32_t cap = _regs[Regs::Hba::Cap];
+  l4_uint32_t pi = _regs[Regs::Hba::Pi];
+
+  _regs[Regs::Hba::Ghc].set(Regs::Hba::Ghc_hr);
+
+  // The HBA must complete the reset within one second.
+  Block_device::Errand::poll(10, 100000,
+    [this]() { return !(_regs[Regs::Hba::Ghc] & Regs::Hba::Ghc_hr); },
+    [=](bool ret)
+      {
+        if (!ret)
+          Err().printf("HBA reset did not complete.\n");
+
+        _regs[Regs::Hba::Ghc].set(Regs::Hba::Ghc_ae);
+        _regs[Regs::Hba::Cap] = cap;
+        _regs[Regs::Hba::Pi] = pi;
+        _regs[Regs::Hba::Is] = 0xFFFFFFFF;
+        _regs[Regs::Hba::Ghc].set(Regs::Hba::Ghc_ie);
+
+        auto pending = std::make_shared<unsigned>(_ports.size());
+        for (auto &p : _ports)
+          p.resume_after_hba_reset(
+            [=]()
+              {
+                if (--*pending > 0)
+                  return;
+
+                _resetting = false;
+                _last_reset = l4_kip_clock(l4re_kip());
+                Dbg::info().printf("HBA reset finished after %llu ms.\n",
+                                   (_last_reset - start) / 1000);
+                callback();
+              });
+      });
+}
+
+
 void
 Hba::register_interrupt_handler(L4::Cap<L4::Icu> icu,
                                 L4Re::Util::Object_registry *registry)
@@ -172,6 +325,48 @@ Hba::register_interrupt_handler(L4::Cap<L4::Icu> icu,
 }
 
 
+void
+Hba::dump_stats(Dbg const &log) const
+{
+  log.printf("hba %lx: %u resets, BIOS handoff %u ms\n",
+             (unsigned long)_dev.dev_handle(), _resets, _handoff_ms);
+#ifdef AHCI_CYCLE_STATS
+  log.printf("  cycles irq: %llu calls, %llu per call\n",
+             _irq_cycles.calls, _irq_cycles.per_call());
+#endif
+
+  int portno = 0;
+  for (auto const &p : _ports)
+    {
+      if (p.device_type() != Ahci_port::Ahcidev_none)
+        {
+          log.printf("  port %d: link %s", portno,
+                     Ahci_port::link_speed_name(p.link_speed()));
+          if (p.speed_limit())
+            log.cprintf(" (limit %s)",
+                        Ahci_port::link_speed_name(p.speed_limit()));
+          log.cprintf(", %u speed downgrades\n", p.speed_downgrades());
+          p.dump_boot_stats(log);
+          p.dump_lpm_stats(log);
+#ifdef AHCI_FAULT_INJECTION
+          p.faults().dump_stats(log, portno);
+#endif
+        }
+
+#ifdef AHCI_CYCLE_STATS
+      Port_cycles const &c = p.cycles();
+      if (c.submit.calls)
+        log.printf("  port %d cycles: irq %llu/%llu submit %llu/%llu "
+                   "complete %llu/%llu (per call/calls), %llu per I/O\n",
+                   portno, c.irq.per_call(), c.irq.calls,
+                   c.submit.per_call(), c.submit.calls,
+                   c.complete.per_call(), c.complete.calls, c.per_io());
+#endif
+      ++portno;
+    }
+}
+
+
 bool
 Hba::is_ahci_hba(L4vbus::Device const &dev, l4vbus_device_t const &dev_info)
 {
@@ -21,6 +21,8 @@
 
 #include "ahci_port.h"
 #include "ahci_types.h"
+#include "cycle_stats.h"
+#include "stats.h"
 
 namespace Ahci {
 
@@ -29,7 +31,7 @@ namespace Ahci {
  *
  * Includes a server loop for handling device interrupts.
  */
-class Hba : public L4::Irqep_t<Hba>
+class Hba : public L4::Irqep_t<Hba>, public Stats_provider
 {
 private:
   /**
@@ -76,6 +78,12 @@ public:
    */
   Hba_features features() const { return Hba_features(_regs[Regs::Hba::Cap]); }
 
+  /**
+   * Return the extended feature set of the HBA.
+   */
+  Hba_features2 features2() const
+  { return Hba_features2(_regs[Regs::Hba::Cap2]); }
+
   /**
    * Return a pointer to the given port
    *
@@ -93,6 +101,21 @@ public:
    */
   void handle_irq();
 
+  /**
+   * Reset the whole HBA and restore all ports.
+   *
+   * \param callback Errand to execute when the reset has finished.
+   *
+   * Used when a port cannot be recovered by a port reset. Commands in
+   * flight are reissued once their port is operational again and aborted
+   * if it is not. New commands are rejected with -L4_EBUSY during the
+   * reset, so that clients retry them. Calls while a reset is already in
+   * progress are ignored. A reset requested less than Min_reset_interval_us
+   * after the previous one is delayed, so that a failing port cannot keep
+   * the other ports of the HBA from doing their work.
+   */
+  void reset(Block_device::Errand::Callback const &callback);
+
   /**
    * Register the interrupt handler with a registry.
    *
@@ -134,6 +157,22 @@ public:
    * 4GB anyway, so this flag may be used to explicitly skip this check.
    */
   static bool check_address_width;
+
+  /**
+   * Highest interface speed generation to negotiate per port number.
+   *
+   * 0 means no limit. The limit is applied by a port reset before the
+   * port is initialized.
+   */
+  static std::array<unsigned char, 32> max_link_speed;
+
+  /// Link power management policy per port number.
+  static std::array<Ahci_port::Lpm_policy, 32> lpm_policy;
+
+  /// Idle time in milliseconds before a link enters its low power state.
+  static unsigned lpm_idle_ms;
+
+  void dump_stats(Dbg const &log) const override;
 private:
   l4_uint32_t cfg_read(l4_uint32_t reg) const
   {
@@ -156,11 +195,40 @@ private:
     L4Re::chksys(_dev.cfg_write(reg, val, 16));
   }
 
+  /**
+   * Take over the HBA from the firmware.
+   *
+   * Requests ownership via the BIOS/OS handoff register if the HBA
+   * implements it and waits for the firmware to release the HBA.
+   */
+  void bios_handoff();
+
+  enum
+  {
+    /// Time the firmware has to release the HBA or to report it is busy.
+    Handoff_release_ms = 25,
+    /// Time a busy firmware has to finish its outstanding commands.
+    Handoff_busy_ms = 2000,
+    /// Minimum time between the end of a HBA reset and the next one.
+    Min_reset_interval_us = 5000000,
+  };
+
   L4vbus::Pci_dev _dev;
   Iomem _iomem;
   L4drivers::Register_block<32> _regs;
   unsigned char _irq_trigger_type;
   std::array<Ahci_port, 32> _ports;
+  bool _resetting = false;
+  /// A delayed reset is pending.
+  bool _reset_scheduled = false;
+  unsigned _resets = 0;
+  /// Time the last HBA reset finished.
+  l4_kernel_clock_t _last_reset = 0;
+  /// Time spent waiting for the firmware to release the HBA, in ms.
+  unsigned _handoff_ms = 0;
+#ifdef AHCI_CYCLE_STATS
+  Cycle_counter _irq_cycles;
+#endif
 };
 
 }
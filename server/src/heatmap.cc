@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include <initializer_list>
+
+#include <l4/cxx/minmax>
+
+#include "heatmap.h"
+
+namespace Ahci {
+
+void
+Lba_heatmap::init(l4_uint64_t num_sectors)
+{
+  if (!num_sectors)
+    return;
+
+  // Use a power-of-two bucket size, so that the bucket of a request
+  // can be found with a single shift.
+  _shift = 0;
+  while ((num_sectors - 1) >> _shift >= Buckets)
+    ++_shift;
+
+  _num_sectors = num_sectors;
+  _next_decay = l4_kip_clock(l4re_kip()) + Decay_us;
+}
+
+void
+Lba_heatmap::decay(l4_kernel_clock_t now)
+{
+  // Catch up on all periods that passed without any request.
+  unsigned periods = 1 + (now - _next_decay) / Decay_us;
+  _next_decay += l4_kernel_clock_t(periods) * Decay_us;
+
+  if (periods >= 32)
+    periods = 31;
+
+  for (unsigned i = 0; i < Buckets; ++i)
+    {
+      _reads[i] >>= periods;
+      _writes[i] >>= periods;
+    }
+}
+
+void
+Lba_heatmap::dump_stats(Dbg const &log) const
+{
+  if (!_num_sectors)
+    return;
+
+  // Counters are only decayed on access, bring them up to date without
+  // modifying the map.
+  l4_kernel_clock_t now = l4_kip_clock(l4re_kip());
+  unsigned periods = 0;
+  if (now >= _next_decay)
+    periods = cxx::min<l4_uint64_t>(31, 1 + (now - _next_decay) / Decay_us);
+
+  log.printf("heatmap %s: %u buckets of %llu sectors\n", _name.c_str(),
+             unsigned(Buckets), 1ULL << _shift);
+
+  for (auto const *map : { _reads, _writes })
+    {
+      log.printf("  %s:", map == _reads ? "read " : "write");
+      for (unsigned i = 0; i < Buckets; ++i)
+        log.cprintf(" %u", map[i] >> periods);
+      log.cprintf("\n");
+    }
+}
+
+} // namespace Ahci
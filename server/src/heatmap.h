@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <string>
+
+#include <l4/re/dma_space>
+#include <l4/sys/kip.h>
+
+#include "stats.h"
+
+namespace Ahci {
+
+/**
+ * Coarse access-count heatmap over the LBA space of a disk.
+ *
+ * The sector range of the disk is divided into a fixed number of
+ * equally sized buckets. Every request increments the counter of the
+ * bucket containing its first sector, separately for reads and writes.
+ * All counters are halved once per decay period, so that the map reflects
+ * recent activity.
+ */
+class Lba_heatmap : public Stats_provider
+{
+public:
+  enum
+  {
+    /// Number of buckets over the sector range of the device.
+    Buckets = 32,
+    /// Time after which all counters are halved.
+    Decay_us = 60 * 1000 * 1000,
+  };
+
+  /**
+   * Create a heatmap.
+   *
+   * \param name  Name of the device used in the report. The string is
+   *              referenced, not copied.
+   */
+  explicit Lba_heatmap(std::string const &name) : _name(name) {}
+
+  /**
+   * Set the size of the device.
+   *
+   * \param num_sectors  Number of sectors of the device.
+   */
+  void init(l4_uint64_t num_sectors);
+
+  /**
+   * Count an access to the device.
+   *
+   * \param sector  First sector of the request.
+   * \param dir     Direction of the request.
+   */
+  void record(l4_uint64_t sector, L4Re::Dma_space::Direction dir)
+  {
+    if (!_num_sectors)
+      return;
+
+    l4_kernel_clock_t now = l4_kip_clock(l4re_kip());
+    if (now >= _next_decay)
+      decay(now);
+
+    unsigned b = sector >> _shift;
+    if (b >= Buckets)
+      b = Buckets - 1;
+
+    if (dir == L4Re::Dma_space::Direction::To_device)
+      ++_writes[b];
+    else
+      ++_reads[b];
+  }
+
+  void dump_stats(Dbg const &log) const override;
+
+private:
+  void decay(l4_kernel_clock_t now);
+
+  std::string const &_name;
+  l4_uint64_t _num_sectors = 0;
+  unsigned _shift = 0;
+  l4_kernel_clock_t _next_decay = 0;
+  l4_uint32_t _reads[Buckets] = { 0 };
+  l4_uint32_t _writes[Buckets] = { 0 };
+};
+
+} // namespace Ahci
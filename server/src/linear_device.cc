@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include <l4/cxx/minmax>
+
+#include "block_list.h"
+#include "linear_device.h"
+
+static Dbg trace(Dbg::Trace, "linear");
+
+namespace Ahci {
+
+Linear_device::Linear_device(std::string const &name,
+                             std::vector<cxx::Ref_ptr<Device>> const &members)
+: _name(name),
+  _sector_size(members[0]->sector_size()),
+  _max_size(members[0]->max_size()),
+  _max_segments(members[0]->max_segments()),
+  _max_in_flight(members[0]->max_in_flight())
+{
+  for (auto const &dev : members)
+    {
+      l4_uint64_t sectors = dev->capacity() / _sector_size;
+      _members.push_back({dev, _sectors, sectors});
+      _dma.add_device(dev);
+      _sectors += sectors;
+
+      _max_size = cxx::min(_max_size, dev->max_size());
+      _max_segments = cxx::min(_max_segments, dev->max_segments());
+      _max_in_flight = cxx::min(_max_in_flight, dev->max_in_flight());
+      if (dev->is_read_only())
+        _read_only = true;
+    }
+
+  Dbg::info().printf("Linear device %s: %zu members, %llu MiB.\n",
+                     _name.c_str(), _members.size(),
+                     (_sectors * _sector_size) >> 20);
+}
+
+unsigned
+Linear_device::member_at(l4_uint64_t sector) const
+{
+  unsigned i = 0;
+  while (sector >= _members[i].start + _members[i].sectors)
+    ++i;
+
+  return i;
+}
+
+int
+Linear_device::inout_data(l4_uint64_t sector,
+                          Block_device::Inout_block const &blocks,
+                          Block_device::Inout_callback const &cb,
+                          L4Re::Dma_space::Direction dir)
+{
+  l4_uint64_t count = block_list_sectors(blocks);
+  if (!count || sector >= _sectors || count > _sectors - sector)
+    return -L4_EINVAL;
+
+  auto req = std::make_shared<Split_request>();
+  req->cb = cb;
+
+  unsigned pieces = 0;
+  unsigned m = member_at(sector);
+  for (l4_uint64_t skip = 0; skip < count; ++m)
+    {
+      Member &member = _members[m];
+      l4_uint64_t pos = sector + skip;
+      l4_uint64_t n = cxx::min(count - skip,
+                               member.start + member.sectors - pos);
+
+      Block_device::Inout_block piece;
+      slice_blocks(&piece, blocks, skip, n, _sector_size);
+      if (!_dma.translate(&piece, m))
+        {
+          req->abandoned = true;
+          return -L4_EINVAL;
+        }
+
+      ++req->pending;
+      int ret = member.dev->inout_data(pos - member.start, piece,
+                                       [req](int error, l4_size_t size)
+                                         { req->piece_done(error, size); },
+                                       dir);
+      if (ret < 0)
+        {
+          // Parts already issued complete without completing the request,
+          // the client sees the error instead.
+          --req->pending;
+          req->abandoned = true;
+          return ret;
+        }
+
+      ++member.requests;
+      ++pieces;
+      skip += n;
+    }
+
+  if (pieces > 1)
+    {
+      ++_split_requests;
+      trace.printf("Request at sector %llu split over %u members.\n",
+                   sector, pieces);
+    }
+
+  req->piece_done(L4_EOK, 0);
+  return L4_EOK;
+}
+
+int
+Linear_device::flush(Block_device::Inout_callback const &cb)
+{
+  auto req = std::make_shared<Split_request>();
+  req->cb = cb;
+
+  for (auto &m : _members)
+    {
+      ++req->pending;
+      int ret = m.dev->flush([req](int error, l4_size_t)
+                               { req->piece_done(error, 0); });
+      if (ret < 0)
+        {
+          --req->pending;
+          req->abandoned = true;
+          return ret;
+        }
+    }
+
+  req->piece_done(L4_EOK, 0);
+  return L4_EOK;
+}
+
+void
+Linear_device::dump_stats(Dbg const &log) const
+{
+  log.printf("linear %s: %llu split requests\n", _name.c_str(),
+             _split_requests);
+
+  for (auto const &m : _members)
+    log.printf("  member %s: sectors %llu-%llu, %llu requests\n",
+               m.dev->hid().c_str(), m.start, m.start + m.sectors - 1,
+               m.requests);
+}
+
+} // namespace Ahci
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <l4/cxx/ref_ptr>
+
+#include "ahci_device.h"
+#include "composite_io.h"
+#include "stats.h"
+
+namespace Ahci {
+
+/**
+ * Virtual disk made of several disks or partitions, one after the other.
+ *
+ * Requests crossing the boundary between two members are split and the
+ * parts are issued to both members at the same time.
+ *
+ * Members may be attached to different controllers, so memory registered
+ * by a client is mapped for every member, see Composite_dma.
+ */
+class Linear_device
+: public Block_device::Device_with_notification_domain<Device>,
+  public Stats_provider
+{
+  struct Member
+  {
+    cxx::Ref_ptr<Device> dev;
+    /// First sector of the member in the linear device.
+    l4_uint64_t start;
+    /// Size of the member in sectors.
+    l4_uint64_t sectors;
+    l4_uint64_t requests = 0;
+  };
+
+public:
+  /**
+   * Create a linear device.
+   *
+   * \param name     Name of the device, used by clients to select it.
+   * \param members  Disks or partitions in the order they are concatenated.
+   *                 All members must have the same sector size.
+   */
+  Linear_device(std::string const &name,
+                std::vector<cxx::Ref_ptr<Device>> const &members);
+
+  bool is_read_only() const override
+  { return _read_only; }
+
+  bool match_hid(cxx::String const &hid) const override
+  { return hid == cxx::String(_name.c_str(), _name.length()); }
+
+  l4_uint64_t capacity() const override
+  { return _sectors * _sector_size; }
+
+  l4_size_t sector_size() const override
+  { return _sector_size; }
+
+  l4_size_t max_size() const override
+  { return _max_size; }
+
+  unsigned max_segments() const override
+  { return _max_segments; }
+
+  unsigned max_in_flight() const override
+  { return _max_in_flight; }
+
+  std::string const &hid() const override
+  { return _name; }
+
+  void reset() override
+  {
+    for (auto &m : _members)
+      m.dev->reset();
+  }
+
+  int dma_map(Block_device::Mem_region *region, l4_addr_t offset,
+              l4_size_t num_sectors, L4Re::Dma_space::Direction dir,
+              L4Re::Dma_space::Dma_addr *phys) override
+  { return _dma.map(region, offset, num_sectors, dir, phys); }
+
+  int dma_unmap(L4Re::Dma_space::Dma_addr phys, l4_size_t num_sectors,
+                L4Re::Dma_space::Direction dir) override
+  { return _dma.unmap(phys, num_sectors, dir); }
+
+  int inout_data(l4_uint64_t sector, Block_device::Inout_block const &blocks,
+                 Block_device::Inout_callback const &cb,
+                 L4Re::Dma_space::Direction dir) override;
+
+  int flush(Block_device::Inout_callback const &cb) override;
+
+  void start_device_scan(Block_device::Errand::Callback const &callback) override
+  { callback(); }
+
+  void dump_stats(Dbg const &log) const override;
+
+private:
+  unsigned member_at(l4_uint64_t sector) const;
+
+  std::string _name;
+  std::vector<Member> _members;
+  l4_uint64_t _sectors = 0;
+  l4_size_t _sector_size;
+  l4_size_t _max_size;
+  unsigned _max_segments;
+  unsigned _max_in_flight;
+  bool _read_only = false;
+
+  /// Client memory mapped for all members, in the order of _members.
+  Composite_dma _dma;
+
+  l4_uint64_t _split_requests = 0;
+};
+
+} // namespace Ahci
@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/cxx/minmax>
+#include <l4/cxx/unique_ptr>
+
+#include "ahci_device.h"
+
+namespace Ahci {
+
+/**
+ * Device presenting a larger logical block size than the underlying device.
+ *
+ * Each logical block covers a fixed number of sectors of the underlying
+ * disk or partition. Sector numbers and counts are translated, so that the
+ * underlying device only sees I/O aligned to the logical block size. Requests
+ * that are not aligned to the logical block size are already rejected by the
+ * client layer because they are not a multiple of sector_size().
+ *
+ * Discards are translated the same way if the underlying device supports
+ * them.
+ */
+class Logical_block_device
+: public Device,
+  public Block_device::Device_discard_feature
+{
+public:
+  Logical_block_device(cxx::Ref_ptr<Device> const &dev, l4_size_t block_size)
+  : _dev(dev), _block_size(block_size),
+    _factor(block_size / dev->sector_size())
+  {}
+
+  /**
+   * Check whether a device can be presented with the given block size.
+   *
+   * The block size must be a power of two and a multiple of the sector size
+   * of the device.
+   */
+  static bool is_valid_block_size(Device const *dev, l4_size_t block_size)
+  {
+    return (block_size & (block_size - 1)) == 0
+           && block_size > dev->sector_size()
+           && block_size % dev->sector_size() == 0;
+  }
+
+  /**
+   * Check whether the logical blocks of a device start on a block size
+   * boundary of the disk.
+   *
+   * Otherwise every logical block would straddle two physical blocks.
+   */
+  static bool is_aligned(Device const *dev, l4_size_t block_size)
+  { return dev->start_sector() % (block_size / dev->sector_size()) == 0; }
+
+  Block_device::Notification_domain const *notification_domain() const override
+  { return _dev->notification_domain(); }
+
+  bool is_read_only() const override
+  { return _dev->is_read_only(); }
+
+  bool match_hid(cxx::String const &hid) const override
+  { return _dev->match_hid(hid); }
+
+  l4_uint64_t capacity() const override
+  { return _dev->capacity() / _block_size * _block_size; }
+
+  l4_size_t sector_size() const override
+  { return _block_size; }
+
+  l4_size_t max_size() const override
+  { return _dev->max_size() / _block_size * _block_size; }
+
+  unsigned max_segments() const override
+  { return _dev->max_segments(); }
+
+  unsigned max_in_flight() const override
+  { return _dev->max_in_flight(); }
+
+  std::string const &hid() const override
+  { return _dev->hid(); }
+
+  l4_uint64_t start_sector() const override
+  { return _dev->start_sector(); }
+
+  void reset() override
+  { _dev->reset(); }
+
+  int dma_map(Block_device::Mem_region *region, l4_addr_t offset,
+              l4_size_t num_sectors, L4Re::Dma_space::Direction dir,
+              L4Re::Dma_space::Dma_addr *phys) override
+  { return _dev->dma_map(region, offset, num_sectors * _factor, dir, phys); }
+
+  int dma_unmap(L4Re::Dma_space::Dma_addr phys, l4_size_t num_sectors,
+                L4Re::Dma_space::Direction dir) override
+  { return _dev->dma_unmap(phys, num_sectors * _factor, dir); }
+
+  int inout_data(l4_uint64_t sector, Block_device::Inout_block const &blocks,
+                 Block_device::Inout_callback const &cb,
+                 L4Re::Dma_space::Direction dir) override
+  {
+    // The block list is only needed until the command has been set up,
+    // so the first, usually only, element can live on the stack.
+    Block_device::Inout_block native;
+    translate_block(&native, &blocks);
+
+    Block_device::Inout_block *out = &native;
+    for (auto *in = blocks.next.get(); in; in = in->next.get())
+      {
+        out->next = cxx::make_unique<Block_device::Inout_block>();
+        out = out->next.get();
+        translate_block(out, in);
+      }
+
+    return _dev->inout_data(sector * _factor, native, cb, dir);
+  }
+
+  int flush(Block_device::Inout_callback const &cb) override
+  { return _dev->flush(cb); }
+
+  void start_device_scan(Block_device::Errand::Callback const &callback) override
+  { callback(); }
+
+  Discard_info discard_info() const override
+  {
+    Discard_info di;
+    auto const *dev = discard_dev();
+    if (!dev)
+      return di;
+
+    Discard_info native = dev->discard_info();
+    if (native.max_discard_sectors < _factor)
+      return di;
+
+    di.max_discard_sectors = native.max_discard_sectors / _factor;
+    di.max_discard_seg = native.max_discard_seg;
+    di.discard_sector_alignment
+      = cxx::max<unsigned>(1, (native.discard_sector_alignment + _factor - 1)
+                              / _factor);
+    return di;
+  }
+
+  int discard(l4_uint64_t offset, Block_device::Inout_block const &blocks,
+              Block_device::Inout_callback const &cb, bool discard) override
+  {
+    auto *dev = discard_dev();
+    if (!dev)
+      return -L4_ENOSYS;
+
+    Block_device::Inout_block native;
+    translate_range(&native, &blocks);
+
+    Block_device::Inout_block *out = &native;
+    for (auto *in = blocks.next.get(); in; in = in->next.get())
+      {
+        out->next = cxx::make_unique<Block_device::Inout_block>();
+        out = out->next.get();
+        translate_range(out, in);
+      }
+
+    return dev->discard(offset * _factor, native, cb, discard);
+  }
+
+private:
+  Block_device::Device_discard_feature *discard_dev() const
+  { return dynamic_cast<Block_device::Device_discard_feature *>(_dev.get()); }
+
+  void translate_range(Block_device::Inout_block *out,
+                       Block_device::Inout_block const *in) const
+  {
+    out->sector = in->sector * _factor;
+    out->num_sectors = in->num_sectors * _factor;
+  }
+
+  void translate_block(Block_device::Inout_block *out,
+                       Block_device::Inout_block const *in) const
+  {
+    out->dma_addr = in->dma_addr;
+    out->virt_addr = in->virt_addr;
+    out->num_sectors = in->num_sectors * _factor;
+  }
+
+  cxx::Ref_ptr<Device> _dev;
+  l4_size_t _block_size;
+  unsigned _factor;
+};
+
+} // namespace Ahci
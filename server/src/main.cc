@@ -5,11 +5,13 @@
  * License: see LICENSE.spdx (in this directory or the directories above)
  */
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 #include <unistd.h>
 #include <getopt.h>
 #include <map>
+#include <utility>
 #include <vector>
 
 #include <l4/re/env>
@@ -25,14 +27,36 @@
 #include "ahci_partition.h"
 #include "ahci_port.h"
 #include "ahci_device.h"
+#include "client_stats_device.h"
+#include "copy_job.h"
+#include "cow_device.h"
+#include "cycle_stats.h"
+#include "fault_injection.h"
 #include "hba.h"
+#include "linear_device.h"
+#include "logical_block_device.h"
+#include "pinned_partition.h"
+#include "ram_device.h"
+#include "ring_client.h"
+#include "shared_write_device.h"
+#include "spinup_queue.h"
+#include "stats.h"
+#include "thin_pool.h"
 
 #include "debug.h" // needs to come before liblock-dev includes
 #include <l4/libblock-device/block_device_mgr.h>
 #include <l4/libblock-device/virtio_client.h>
 
 static char const *const usage_str =
-"Usage: %s [-vqA] [--client CAP --device UUID [--ds-max NUM] [--readonly]]\n\n"
+"Usage: %s [-vqA] [--stats-interval MS] [--pin-ram UUID] [--ramdisk NAME:MB]\n"
+"          [--max-link-speed [PORT:]GEN] [--lpm [PORT:]POLICY] [--lpm-idle MS]\n"
+"          [--thin-pool[-create] UUID [--thin-volume NAME:MB]...]\n"
+"          [--linear NAME:UUID,UUID...] [--io-retries NUM] [--ncq]\n"
+"          [--spinup-max NUM] [--cow-clone[-create] NAME:UUID,UUID]...\n"
+"          [--coalesce-reads]\n"
+"          [--client CAP --device UUID [--ds-max NUM]\n"
+"          [--slot-max NUM] [--block-size BYTES] [--shared-write]\n"
+"          [--readonly]]\n\n"
 "Options:\n"
 " -v   Verbose mode.\n"
 " -q   Quiet mode (do not print any warnings).\n"
@@ -41,7 +65,63 @@ static char const *const usage_str =
 " --client CAP    Add a static client via the CAP capability\n"
 " --device UUID   Specify the UUID of the device or partition\n"
 " --ds-max NUM    Specify maximum number of dataspaces the client can register\n"
-" --readonly      Only allow readonly access to the device\n";
+" --slot-max NUM  Specify maximum number of parallel requests of the client\n"
+" --block-size BYTES  Present a logical block size of BYTES to the client\n"
+" --shared-write  Order overlapping requests with other shared-write clients\n"
+" --readonly      Only allow readonly access to the device\n"
+" --stats-interval MS  Print runtime statistics every MS milliseconds\n"
+" --pin-ram UUID  Serve the read-only partition UUID from memory\n"
+" --ramdisk NAME:MB  Add a RAM disk of MB megabytes named NAME\n"
+" --max-link-speed [PORT:]GEN  Limit the SATA link of PORT (default: all\n"
+"                 ports) to GEN (1: 1.5 Gbps, 2: 3 Gbps, 3: 6 Gbps)\n"
+" --lpm [PORT:]POLICY  Link power management policy of PORT (default: all\n"
+"                 ports): max_performance, medium, min_power or devsleep\n"
+" --lpm-idle MS   Idle time before the link enters a low power state\n"
+" --thin-pool UUID  Serve thin volumes from the pool on device UUID\n"
+" --thin-pool-create UUID  Like --thin-pool, create the pool if missing\n"
+" --thin-volume NAME:MB  Add a thin volume of MB megabytes named NAME\n"
+" --linear NAME:UUID,UUID...  Add a device NAME concatenating the given\n"
+"                 disks or partitions\n"
+" --io-retries NUM  Retry failed disk transfers up to NUM times (default: 3)\n"
+" --ncq           Use native command queuing for reads, writes and discards\n"
+" --spinup-max NUM  Spin up at most NUM disks at the same time\n"
+" --cow-clone NAME:BASE,OVERLAY  Add a copy-on-write clone NAME of device\n"
+"                 BASE keeping its changes on device OVERLAY\n"
+" --cow-clone-create NAME:BASE,OVERLAY  Like --cow-clone, create the clone\n"
+"                 if missing\n"
+" --coalesce-reads  Serve identical reads in flight with a single disk read\n";
+
+/**
+ * Settings of a single client.
+ *
+ * Several clients may share a device, so these are not kept in the device.
+ */
+struct Client_settings
+{
+  /// Logical block size for the client, 0 for the native sector size.
+  l4_size_t block_size = 0;
+  /// Order requests with other shared-write clients.
+  bool shared_write = false;
+};
+
+/**
+ * Client that counts as a client of the device it was connected to.
+ *
+ * The client itself may work on a view of the device, see
+ * Ahci_device_factory::client_device().
+ */
+template <typename CLIENT>
+class Registered_client : public CLIENT
+{
+public:
+  template <typename... ARGS>
+  Registered_client(cxx::Ref_ptr<Ahci::Device> const &dev, ARGS &&...args)
+  : CLIENT(std::forward<ARGS>(args)...), _registration(dev)
+  {}
+
+private:
+  Ahci::Client_registration _registration;
+};
 
 struct Ahci_device_factory
 {
@@ -51,21 +131,198 @@ struct Ahci_device_factory
   static cxx::unique_ptr<Client_type>
   create_client(cxx::Ref_ptr<Device_type> const &dev, unsigned numds, bool readonly)
   {
-    return cxx::make_unique<Client_type>(dev, numds, readonly);
+    Client_settings s = next_client;
+    next_client = Client_settings();
+
+    auto cdev = client_device(dev, s.shared_write, s.block_size);
+    return cxx::unique_ptr<Client_type>(
+             new Registered_client<Client_type>(dev, cdev, numds, readonly));
+  }
+
+  /**
+   * Return the view of a device a client works on.
+   *
+   * The outermost view records the request pattern of the client.
+   *
+   * \param dev           Device the client is connected to.
+   * \param shared_write  Order requests with other shared-write clients.
+   * \param bs            Logical block size for the client, 0 for the
+   *                      native sector size.
+   */
+  static cxx::Ref_ptr<Device_type>
+  client_device(cxx::Ref_ptr<Device_type> const &dev, bool shared_write,
+                l4_size_t bs)
+  {
+    cxx::Ref_ptr<Device_type> cdev = dev;
+    if (shared_write)
+      cdev = cxx::make_ref_obj<Ahci::Shared_write_device>(dev);
+
+    if (bs && bs != dev->sector_size())
+      {
+        if (!Ahci::Logical_block_device::is_valid_block_size(dev.get(), bs))
+          Dbg::warn().printf("Block size %zu not supported by device %s "
+                             "with %zu byte sectors. Ignored.\n",
+                             bs, dev->hid().c_str(), dev->sector_size());
+        else if (!Ahci::Logical_block_device::is_aligned(dev.get(), bs))
+          Dbg::warn().printf("Device %s does not start on a %zu byte "
+                             "boundary of the disk. Block size ignored.\n",
+                             dev->hid().c_str(), bs);
+        else
+          cdev = cxx::make_ref_obj<Ahci::Logical_block_device>(cdev, bs);
+      }
+
+    // Clients are numbered to tell them apart in the request statistics.
+    static unsigned num_clients = 0;
+    return cxx::make_ref_obj<Ahci::Client_stats_device>(
+             cdev, dev->hid() + " client " + std::to_string(++num_clients));
   }
 
   static cxx::Ref_ptr<Device_type>
   create_partition(cxx::Ref_ptr<Device_type> const &dev, unsigned partition_id,
                    Block_device::Partition_info const &pi)
   {
-    return cxx::Ref_ptr<Device_type>(new Ahci::Partitioned_device(dev, partition_id, pi));
+    cxx::Ref_ptr<Device_type> part;
+    if (is_pinned(pi.guid))
+      {
+        auto pinned = cxx::make_ref_obj<Ahci::Pinned_partition>(dev, partition_id, pi);
+        pinned_partitions.push_back(pinned);
+        part = pinned;
+      }
+    else
+      part = cxx::Ref_ptr<Device_type>(
+               new Ahci::Partitioned_device(dev, partition_id, pi));
+
+    devices.push_back(part);
+    return part;
+  }
+
+  /// Return true if the partition with the given UUID is to be kept in memory.
+  static bool is_pinned(char const *guid)
+  {
+    for (auto const &uuid : pinned_uuids)
+      if (uuid == guid)
+        return true;
+
+    return false;
+  }
+
+  /**
+   * Find a disk or partition by its hardware ID.
+   *
+   * \param hid  Serial number of the disk or UUID of the partition.
+   *
+   * \return The device or an invalid pointer if no such device is known.
+   */
+  static cxx::Ref_ptr<Device_type> find_device(std::string const &hid)
+  {
+    cxx::String s(hid.c_str(), hid.length());
+    for (auto const &d : devices)
+      if (d->match_hid(s))
+        return d;
+
+    return cxx::Ref_ptr<Device_type>();
+  }
+
+  /**
+   * Return true if clients may access the sectors of a device.
+   *
+   * Checks for clients of the device itself and of all disks and partitions
+   * sharing sectors with it. Devices built on top of it are not considered.
+   */
+  static bool is_in_use(Device_type *dev)
+  {
+    for (auto const &d : devices)
+      if (d->num_clients() && overlaps(d.get(), dev))
+        return true;
+
+    return false;
+  }
+
+  /**
+   * Return true if a client needs sectors of a device for itself.
+   *
+   * Checked like is_in_use(), for exclusive clients such as copy jobs.
+   */
+  static bool is_reserved(Device_type *dev)
+  {
+    for (auto const &d : devices)
+      if (d->is_reserved() && overlaps(d.get(), dev))
+        return true;
+
+    return false;
+  }
+
+  /// Return true if two disks or partitions share sectors.
+  static bool overlaps(Device_type *a, Device_type *b)
+  {
+    if (disk_of(a) != disk_of(b))
+      return false;
+
+    l4_uint64_t astart = a->start_sector();
+    l4_uint64_t bstart = b->start_sector();
+    return astart < bstart + b->capacity() / b->sector_size()
+           && bstart < astart + a->capacity() / a->sector_size();
+  }
+
+  /// Return the disk a partition is on, or the device itself.
+  static Device_type *disk_of(Device_type *dev)
+  {
+    while (auto *part = dynamic_cast<Ahci::Partitioned_device *>(dev))
+      dev = part->parent();
+
+    return dev;
   }
+
+  /// All disks and partitions found during the device scan.
+  static std::vector<cxx::Ref_ptr<Device_type>> devices;
+  /// UUIDs of partitions that are to be kept in memory.
+  static std::vector<std::string> pinned_uuids;
+  /// Partitions that are kept in memory.
+  static std::vector<cxx::Ref_ptr<Ahci::Pinned_partition>> pinned_partitions;
+  /**
+   * Settings of the client created next. The device manager calls the
+   * Device_config callback right before create_client().
+   */
+  static Client_settings next_client;
 };
 
+std::vector<cxx::Ref_ptr<Ahci::Device>> Ahci_device_factory::devices;
+std::vector<std::string> Ahci_device_factory::pinned_uuids;
+std::vector<cxx::Ref_ptr<Ahci::Pinned_partition>>
+  Ahci_device_factory::pinned_partitions;
+Client_settings Ahci_device_factory::next_client;
+
 
 using Base_device_mgr = Block_device::Device_mgr<Block_device::Device,
                                                  Ahci_device_factory>;
 
+/**
+ * Client-specific device settings.
+ *
+ * The settings are applied right before the client is connected to the
+ * device. Only the slot limit is a setting of the device, the others are
+ * handed to the client.
+ */
+struct Device_config
+{
+  int slot_max = 0;
+  unsigned block_size = 0;
+  bool shared_write = false;
+
+  void apply(Block_device::Device *d) const
+  {
+    auto *part = dynamic_cast<Ahci::Partitioned_device *>(d);
+    if (part)
+      part->set_max_in_flight(slot_max);
+    else
+      if (slot_max)
+        Dbg::warn("slot-max parameter ignored for full disk access.\n");
+
+    Ahci_device_factory::next_client.block_size = block_size;
+    Ahci_device_factory::next_client.shared_write = shared_write;
+  }
+};
+
 class Blk_mgr
 : public Base_device_mgr,
   public L4::Epiface_t<Blk_mgr, L4::Factory>
@@ -74,7 +331,10 @@ class Blk_mgr
   {
   public:
     void handle_irq()
-    { _parent->check_clients(); }
+    {
+      _parent->check_clients();
+      _parent->check_sessions();
+    }
 
     Deletion_irq(Blk_mgr *parent) : _parent{parent} {}
 
@@ -83,8 +343,17 @@ class Blk_mgr
   };
 
 public:
+  enum Object_type
+  {
+    Virtio_block_host = 0,
+    Ring_block_host = Ahci_ring::Object_type,
+    Copy_job_host = Ahci_copy::Object_type,
+    Fault_control_host = Ahci_fault::Object_type,
+  };
+
   Blk_mgr(L4Re::Util::Object_registry *registry)
   : Base_device_mgr(registry),
+    _registry(registry),
     _del_irq(this)
   {
     auto c = L4Re::chkcap(registry->register_irq_obj(&_del_irq),
@@ -93,16 +362,30 @@ public:
                  "Registering deletion IRQ at the thread.");
   }
 
-  long op_create(L4::Factory::Rights, L4::Ipc::Cap<void> &res, l4_umword_t,
+  long op_create(L4::Factory::Rights, L4::Ipc::Cap<void> &res, l4_umword_t type,
                  L4::Ipc::Varg_list_ref valist)
   {
     Dbg::trace().printf("Client requests connection.\n");
 
+    if (type == Copy_job_host)
+      return create_copy_job(res, valist);
+
+#ifdef AHCI_FAULT_INJECTION
+    if (type == Fault_control_host)
+      return create_fault_control(res, valist);
+#endif
+
+    if (type != Virtio_block_host && type != Ring_block_host)
+      {
+        Dbg::warn().printf("Unknown object type %lu requested.\n", type);
+        return -L4_ENODEV;
+      }
+
     // default values
     std::string device;
     int num_ds = 2;
     bool readonly = false;
-    int max_slots = 0;
+    Device_config config;
 
     for (L4::Ipc::Varg p: valist)
       {
@@ -130,10 +413,25 @@ public:
               }
             continue;
           }
-        if (parse_int_param(p, "slot-max=", &max_slots))
+        if (parse_int_param(p, "slot-max=", &config.slot_max))
           continue;
+        int block_size;
+        if (parse_int_param(p, "block-size=", &block_size))
+          {
+            if (block_size < 512 || block_size > 65536
+                || (block_size & (block_size - 1)))
+              {
+                Dbg::warn().printf("Invalid parameter 'block-size'. Power of "
+                                   "two between 512 and 65536 required.\n");
+                return -L4_EINVAL;
+              }
+            config.block_size = block_size;
+            continue;
+          }
         if (strncmp(p.value<char const *>(), "read-only", p.length()) == 0)
           readonly = true;
+        if (strncmp(p.value<char const *>(), "shared-write", p.length()) == 0)
+          config.shared_write = true;
       }
 
     if (device.empty())
@@ -143,17 +441,21 @@ public:
         return -L4_EINVAL;
       }
 
+    // A copy is writing to the device.
+    auto dev = Ahci_device_factory::find_device(device);
+    if (dev && Ahci_device_factory::is_reserved(dev.get()))
+      {
+        Dbg::warn().printf("Device %s is reserved by a copy.\n",
+                           device.c_str());
+        return -L4_EBUSY;
+      }
+
+    if (type == Ring_block_host)
+      return create_ring_client(device, readonly, config, res);
+
     L4::Cap<void> cap;
     int ret = create_dynamic_client(device, -1, num_ds, &cap, readonly,
-                [max_slots](Block_device::Device *d)
-                  {
-                    auto *part = dynamic_cast<Ahci::Partitioned_device *>(d);
-                    if (part)
-                      part->set_max_in_flight(max_slots);
-                    else
-                      if (max_slots)
-                        Dbg::warn("slot-max parameter ignored for full disk access.\n");
-                  });
+                [config](Block_device::Device *d) { config.apply(d); });
     if (ret >= 0)
       {
         res = L4::Ipc::make_cap(cap, L4_CAP_FPAGE_RWSD);
@@ -166,7 +468,178 @@ public:
   void scan_finished()
   { _scan_in_progress = false; }
 
+  /**
+   * Remove ring sessions, copy jobs and fault controls whose IPC gate has
+   * been deleted.
+   */
+  void check_sessions()
+  {
+    remove_closed_sessions(_ring_clients);
+    remove_closed_sessions(_copy_jobs);
+#ifdef AHCI_FAULT_INJECTION
+    remove_closed_sessions(_fault_controls);
+#endif
+  }
+
 private:
+  long create_ring_client(std::string const &device, bool readonly,
+                          Device_config const &config,
+                          L4::Ipc::Cap<void> &res)
+  {
+    auto dev = Ahci_device_factory::find_device(device);
+    if (!dev)
+      return _scan_in_progress ? -L4_EAGAIN : -L4_ENODEV;
+
+    // The slot limit has the same meaning as for partitions.
+    unsigned max_in_flight = 0;
+    if (config.slot_max > 0)
+      max_in_flight = cxx::min((unsigned)config.slot_max,
+                               dev->max_in_flight());
+    else if (config.slot_max < 0)
+      max_in_flight = cxx::max(1, (int)dev->max_in_flight()
+                                  + config.slot_max);
+
+    auto cdev = Ahci_device_factory::client_device(dev, config.shared_write,
+                                                   config.block_size);
+    auto clt =
+      cxx::make_ref_obj<Registered_client<Ahci::Ring_client>>(dev, cdev,
+                                                              readonly,
+                                                              max_in_flight,
+                                                              _registry);
+    L4::Cap<void> cap = _registry->register_obj(clt.get());
+    if (!cap.is_valid())
+      return -L4_ENOMEM;
+
+    _ring_clients.push_back(clt);
+    res = L4::Ipc::make_cap(cap, L4_CAP_FPAGE_RWSD);
+    L4::cap_cast<L4::Kobject>(cap)->dec_refcnt(1);
+
+    return L4_EOK;
+  }
+
+  long create_copy_job(L4::Ipc::Cap<void> &res, L4::Ipc::Varg_list_ref valist)
+  {
+    std::string from, to;
+    l4_uint64_t from_lba = 0;
+    l4_uint64_t to_lba = 0;
+    l4_uint64_t count = 0;
+
+    for (L4::Ipc::Varg p: valist)
+      {
+        if (!p.is_of<char const *>())
+          {
+            Dbg::warn().printf("String parameter expected.\n");
+            return -L4_EINVAL;
+          }
+
+        std::string device_param;
+        if (parse_string_param(p, "from=", &device_param))
+          {
+            long ret = parse_device_name(device_param, from);
+            if (ret < 0)
+              return ret;
+            continue;
+          }
+        if (parse_string_param(p, "to=", &device_param))
+          {
+            long ret = parse_device_name(device_param, to);
+            if (ret < 0)
+              return ret;
+            continue;
+          }
+        if (parse_uint64_param(p, "from-lba=", &from_lba))
+          continue;
+        if (parse_uint64_param(p, "to-lba=", &to_lba))
+          continue;
+        if (parse_uint64_param(p, "count=", &count))
+          continue;
+      }
+
+    if (from.empty() || to.empty() || count == 0)
+      {
+        Dbg::warn().printf("Copy requires parameters 'from=', 'to=' "
+                           "and 'count='.\n");
+        return -L4_EINVAL;
+      }
+
+    auto src = Ahci_device_factory::find_device(from);
+    auto dst = Ahci_device_factory::find_device(to);
+    if (!src || !dst)
+      return _scan_in_progress ? -L4_EAGAIN : -L4_ENODEV;
+
+    if (dst->is_read_only())
+      return -L4_EPERM;
+
+    // The copy would overwrite data clients are working on.
+    if (Ahci_device_factory::is_in_use(dst.get()))
+      {
+        Dbg::warn().printf("Copy destination %s is in use.\n",
+                           dst->hid().c_str());
+        return -L4_EBUSY;
+      }
+
+    if (src->sector_size() != dst->sector_size())
+      {
+        Dbg::warn().printf("Copy between devices with different sector "
+                           "sizes not supported.\n");
+        return -L4_EINVAL;
+      }
+
+    l4_uint64_t src_sectors = src->capacity() / src->sector_size();
+    l4_uint64_t dst_sectors = dst->capacity() / dst->sector_size();
+    if (count > src_sectors || from_lba > src_sectors - count
+        || count > dst_sectors || to_lba > dst_sectors - count)
+      {
+        Dbg::warn().printf("Copy range exceeds device size.\n");
+        return -L4_EINVAL;
+      }
+
+    if (src.get() == dst.get()
+        && from_lba < to_lba + count && to_lba < from_lba + count)
+      {
+        Dbg::warn().printf("Overlapping copy ranges not supported.\n");
+        return -L4_EINVAL;
+      }
+
+    auto job = cxx::make_ref_obj<Ahci::Copy_job>(src, from_lba, dst, to_lba,
+                                                 count, _registry);
+    long ret = job->setup_buffers();
+    if (ret < 0)
+      return ret;
+
+    L4::Cap<void> cap = _registry->register_obj(job.get());
+    if (!cap.is_valid())
+      return -L4_ENOMEM;
+
+    _copy_jobs.push_back(job);
+    job->start();
+
+    res = L4::Ipc::make_cap(cap, L4_CAP_FPAGE_RWSD);
+    L4::cap_cast<L4::Kobject>(cap)->dec_refcnt(1);
+
+    return L4_EOK;
+  }
+
+#ifdef AHCI_FAULT_INJECTION
+  long create_fault_control(L4::Ipc::Cap<void> &res,
+                            L4::Ipc::Varg_list_ref valist);
+#endif
+
+  template <typename T>
+  static void remove_closed_sessions(std::vector<cxx::Ref_ptr<T>> &sessions)
+  {
+    for (auto it = sessions.begin(); it != sessions.end();)
+      {
+        if ((*it)->obj_cap().validate().label())
+          ++it;
+        else
+          {
+            (*it)->shutdown();
+            it = sessions.erase(it);
+          }
+      }
+  }
+
   static bool parse_string_param(L4::Ipc::Varg const &param, char const *prefix,
                                  std::string *out)
   {
@@ -214,8 +687,43 @@ private:
     return true;
   }
 
+  static bool parse_uint64_param(L4::Ipc::Varg const &param, char const *prefix,
+                                 l4_uint64_t *out)
+  {
+    l4_size_t headlen = strlen(prefix);
+
+    if (param.length() < headlen)
+      return false;
+
+    char const *pstr = param.value<char const *>();
+
+    if (strncmp(pstr, prefix, headlen) != 0)
+      return false;
+
+    std::string tail(pstr + headlen, param.length() - headlen);
+
+    char *endp;
+    unsigned long long num = strtoull(tail.c_str(), &endp, 10);
+
+    if (tail.empty() || *endp != '\0')
+      {
+        Dbg::warn().printf("Bad parameter '%s'. Number required.\n", prefix);
+        L4Re::chksys(-L4_EINVAL);
+      }
+
+    *out = num;
+
+    return true;
+  }
+
+  L4Re::Util::Object_registry *_registry;
   Deletion_irq _del_irq;
   bool _scan_in_progress = true;
+  std::vector<cxx::Ref_ptr<Ahci::Ring_client>> _ring_clients;
+  std::vector<cxx::Ref_ptr<Ahci::Copy_job>> _copy_jobs;
+#ifdef AHCI_FAULT_INJECTION
+  std::vector<cxx::Ref_ptr<Ahci::Fault_control>> _fault_controls;
+#endif
 };
 
 struct Client_opts
@@ -238,17 +746,9 @@ struct Client_opts
             return false;
           }
 
-        int mx = slot_max;
+        Device_config cfg = config;
         blk_mgr->add_static_client(cap, device.c_str(), -1, ds_max, readonly,
-          [mx](Block_device::Device *d)
-            {
-              auto *part = dynamic_cast<Ahci::Partitioned_device *>(d);
-              if (part)
-                part->set_max_in_flight(mx);
-              else
-                if (mx)
-                  Dbg::warn("slot-max parameter ignored for full disk access.\n");
-            });
+          [cfg](Block_device::Device *d) { cfg.apply(d); });
       }
 
     return true;
@@ -258,13 +758,92 @@ struct Client_opts
   std::string device;
   int ds_max = 2;
   bool readonly = false;
-  int slot_max = 0;
+  Device_config config;
 };
 
 static Block_device::Errand::Errand_server server;
 static Blk_mgr drv(server.registry());
 std::vector<cxx::unique_ptr<Ahci::Hba>> _hbas;
 unsigned static devices_in_scan = 0;
+static int stats_interval = 0;
+
+#ifdef AHCI_FAULT_INJECTION
+long
+Blk_mgr::create_fault_control(L4::Ipc::Cap<void> &res,
+                              L4::Ipc::Varg_list_ref valist)
+{
+  l4_uint64_t hba = 0;
+  l4_uint64_t port = ~0ULL;
+
+  for (L4::Ipc::Varg p: valist)
+    {
+      if (!p.is_of<char const *>())
+        {
+          Dbg::warn().printf("String parameter expected.\n");
+          return -L4_EINVAL;
+        }
+
+      if (parse_uint64_param(p, "hba=", &hba))
+        continue;
+      if (parse_uint64_param(p, "port=", &port))
+        continue;
+    }
+
+  if (hba >= _hbas.size() || port >= (l4_uint64_t)_hbas[hba]->num_ports())
+    {
+      Dbg::warn().printf("Fault injection requires parameter 'port=' "
+                         "naming an existing port.\n");
+      return -L4_EINVAL;
+    }
+
+  auto *p = _hbas[hba]->port(port);
+  if (p->device_type() == Ahci::Ahci_port::Ahcidev_none)
+    return -L4_ENODEV;
+
+  auto ctl = cxx::make_ref_obj<Ahci::Fault_control>(&p->faults());
+  L4::Cap<void> cap = _registry->register_obj(ctl.get());
+  if (!cap.is_valid())
+    return -L4_ENOMEM;
+
+  _fault_controls.push_back(ctl);
+  res = L4::Ipc::make_cap(cap, L4_CAP_FPAGE_RWSD);
+  L4::cap_cast<L4::Kobject>(cap)->dec_refcnt(1);
+
+  return L4_EOK;
+}
+#endif
+
+struct Ram_disk_opts
+{
+  std::string name;
+  l4_uint64_t size;
+};
+
+static std::vector<Ram_disk_opts> ram_disks;
+
+static std::string thin_pool_device;
+static bool thin_pool_create = false;
+static std::vector<Ram_disk_opts> thin_volumes;
+static cxx::unique_ptr<Ahci::Thin_pool> thin_pool;
+
+struct Linear_opts
+{
+  std::string name;
+  std::vector<std::string> members;
+};
+
+static std::vector<Linear_opts> linear_devices;
+
+struct Cow_opts
+{
+  std::string name;
+  std::string base;
+  std::string overlay;
+  bool create;
+};
+
+static std::vector<Cow_opts> cow_clones;
+static std::vector<cxx::Ref_ptr<Ahci::Cow_device>> cow_devices;
 
 static int
 parse_args(int argc, char *const *argv)
@@ -277,7 +856,25 @@ parse_args(int argc, char *const *argv)
     OPT_DEVICE,
     OPT_DS_MAX,
     OPT_SLOT_MAX,
+    OPT_BLOCK_SIZE,
     OPT_READONLY,
+    OPT_SHARED_WRITE,
+    OPT_STATS_INTERVAL,
+    OPT_PIN_RAM,
+    OPT_RAMDISK,
+    OPT_MAX_LINK_SPEED,
+    OPT_LPM,
+    OPT_LPM_IDLE,
+    OPT_THIN_POOL,
+    OPT_THIN_POOL_CREATE,
+    OPT_THIN_VOLUME,
+    OPT_LINEAR,
+    OPT_IO_RETRIES,
+    OPT_NCQ,
+    OPT_SPINUP_MAX,
+    OPT_COW_CLONE,
+    OPT_COW_CLONE_CREATE,
+    OPT_COALESCE_READS,
   };
 
   struct option const loptions[] =
@@ -289,7 +886,25 @@ parse_args(int argc, char *const *argv)
     { "device",        required_argument, NULL,  OPT_DEVICE },
     { "ds-max",        required_argument, NULL,  OPT_DS_MAX },
     { "slot-max",      required_argument, NULL,  OPT_SLOT_MAX },
+    { "block-size",    required_argument, NULL,  OPT_BLOCK_SIZE },
     { "readonly",      no_argument,       NULL,  OPT_READONLY },
+    { "shared-write",  no_argument,       NULL,  OPT_SHARED_WRITE },
+    { "stats-interval", required_argument, NULL, OPT_STATS_INTERVAL },
+    { "pin-ram",       required_argument, NULL,  OPT_PIN_RAM },
+    { "ramdisk",       required_argument, NULL,  OPT_RAMDISK },
+    { "max-link-speed", required_argument, NULL, OPT_MAX_LINK_SPEED },
+    { "lpm",           required_argument, NULL,  OPT_LPM },
+    { "lpm-idle",      required_argument, NULL,  OPT_LPM_IDLE },
+    { "thin-pool",     required_argument, NULL,  OPT_THIN_POOL },
+    { "thin-pool-create", required_argument, NULL, OPT_THIN_POOL_CREATE },
+    { "thin-volume",   required_argument, NULL,  OPT_THIN_VOLUME },
+    { "linear",        required_argument, NULL,  OPT_LINEAR },
+    { "io-retries",    required_argument, NULL,  OPT_IO_RETRIES },
+    { "ncq",           no_argument,       NULL,  OPT_NCQ },
+    { "spinup-max",    required_argument, NULL,  OPT_SPINUP_MAX },
+    { "cow-clone",     required_argument, NULL,  OPT_COW_CLONE },
+    { "cow-clone-create", required_argument, NULL, OPT_COW_CLONE_CREATE },
+    { "coalesce-reads", no_argument,      NULL,  OPT_COALESCE_READS },
     { 0, 0, 0, 0 },
   };
 
@@ -329,11 +944,170 @@ parse_args(int argc, char *const *argv)
           opts.ds_max = atoi(optarg);
           break;
         case OPT_SLOT_MAX:
-          opts.slot_max = atoi(optarg);
+          opts.config.slot_max = atoi(optarg);
+          break;
+        case OPT_BLOCK_SIZE:
+          opts.config.block_size = atoi(optarg);
           break;
         case OPT_READONLY:
           opts.readonly = true;
           break;
+        case OPT_SHARED_WRITE:
+          opts.config.shared_write = true;
+          break;
+        case OPT_STATS_INTERVAL:
+          stats_interval = atoi(optarg);
+          break;
+        case OPT_PIN_RAM:
+          {
+            std::string uuid;
+            if (Blk_mgr::parse_device_name(optarg, uuid) < 0)
+              {
+                Dbg::warn().printf("Invalid partition name parameter.\n");
+                return -1;
+              }
+            Ahci_device_factory::pinned_uuids.push_back(uuid);
+          }
+          break;
+        case OPT_RAMDISK:
+          {
+            char const *sep = strchr(optarg, ':');
+            unsigned long mib = sep ? strtoul(sep + 1, nullptr, 10) : 0;
+            if (!sep || sep == optarg || mib == 0)
+              {
+                Dbg::warn().printf("Invalid RAM disk parameter. "
+                                   "NAME:SIZE_MB expected.\n");
+                return -1;
+              }
+            ram_disks.push_back({std::string(optarg, sep - optarg),
+                                 l4_uint64_t(mib) << 20});
+          }
+          break;
+        case OPT_MAX_LINK_SPEED:
+          {
+            auto &limits = Ahci::Hba::max_link_speed;
+            char const *sep = strchr(optarg, ':');
+            unsigned long port = sep ? strtoul(optarg, nullptr, 10) : 0;
+            unsigned long gen = strtoul(sep ? sep + 1 : optarg, nullptr, 10);
+            if (gen < 1 || gen > 3 || port >= limits.size())
+              {
+                Dbg::warn().printf("Invalid link speed parameter. "
+                                   "[PORT:]GEN with GEN 1-3 expected.\n");
+                return -1;
+              }
+            if (sep)
+              limits[port] = gen;
+            else
+              limits.fill(gen);
+          }
+          break;
+        case OPT_LPM:
+          {
+            auto &policies = Ahci::Hba::lpm_policy;
+            char const *sep = strchr(optarg, ':');
+            unsigned long port = sep ? strtoul(optarg, nullptr, 10) : 0;
+            Ahci::Ahci_port::Lpm_policy policy;
+            if (!Ahci::Ahci_port::parse_lpm_policy(sep ? sep + 1 : optarg,
+                                                   &policy)
+                || port >= policies.size())
+              {
+                Dbg::warn().printf("Invalid link power management parameter. "
+                                   "[PORT:]POLICY expected.\n");
+                return -1;
+              }
+            if (sep)
+              policies[port] = policy;
+            else
+              policies.fill(policy);
+          }
+          break;
+        case OPT_LPM_IDLE:
+          Ahci::Hba::lpm_idle_ms = atoi(optarg);
+          break;
+        case OPT_THIN_POOL:
+        case OPT_THIN_POOL_CREATE:
+          if (Blk_mgr::parse_device_name(optarg, thin_pool_device) < 0)
+            {
+              Dbg::warn().printf("Invalid thin pool device parameter.\n");
+              return -1;
+            }
+          thin_pool_create = (opt == OPT_THIN_POOL_CREATE);
+          break;
+        case OPT_THIN_VOLUME:
+          {
+            char const *sep = strchr(optarg, ':');
+            unsigned long mib = sep ? strtoul(sep + 1, nullptr, 10) : 0;
+            if (!sep || sep == optarg || mib == 0)
+              {
+                Dbg::warn().printf("Invalid thin volume parameter. "
+                                   "NAME:SIZE_MB expected.\n");
+                return -1;
+              }
+            thin_volumes.push_back({std::string(optarg, sep - optarg),
+                                    l4_uint64_t(mib) << 20});
+          }
+          break;
+        case OPT_LINEAR:
+          {
+            char const *sep = strchr(optarg, ':');
+            if (!sep || sep == optarg || !sep[1])
+              {
+                Dbg::warn().printf("Invalid linear device parameter. "
+                                   "NAME:UUID,UUID... expected.\n");
+                return -1;
+              }
+
+            Linear_opts lin{std::string(optarg, sep - optarg), {}};
+            for (char const *s = sep + 1; *s;)
+              {
+                char const *e = strchr(s, ',');
+                if (!e)
+                  e = s + strlen(s);
+                std::string member;
+                if (Blk_mgr::parse_device_name(std::string(s, e - s).c_str(),
+                                               member) < 0)
+                  {
+                    Dbg::warn().printf("Invalid linear device member.\n");
+                    return -1;
+                  }
+                lin.members.push_back(member);
+                s = *e ? e + 1 : e;
+              }
+            linear_devices.push_back(lin);
+          }
+          break;
+        case OPT_IO_RETRIES:
+          Ahci::Retry_policy::max_retries = atoi(optarg);
+          break;
+        case OPT_NCQ:
+          Ahci::Ahci_device::use_ncq = true;
+          break;
+        case OPT_SPINUP_MAX:
+          Ahci::Spinup_queue::max_concurrent = atoi(optarg);
+          break;
+        case OPT_COW_CLONE:
+        case OPT_COW_CLONE_CREATE:
+          {
+            char const *sep = strchr(optarg, ':');
+            char const *comma = sep ? strchr(sep + 1, ',') : nullptr;
+            Cow_opts cow{std::string(optarg, sep ? sep - optarg : 0), {}, {},
+                         opt == OPT_COW_CLONE_CREATE};
+            if (!comma || cow.name.empty()
+                || Blk_mgr::parse_device_name(
+                     std::string(sep + 1, comma - sep - 1).c_str(),
+                     cow.base) < 0
+                || Blk_mgr::parse_device_name(comma + 1, cow.overlay) < 0)
+              {
+                Dbg::warn().printf("Invalid clone parameter. "
+                                   "NAME:UUID,UUID expected.\n");
+                return -1;
+              }
+            cow_clones.push_back(cow);
+          }
+          break;
+        case OPT_COALESCE_READS:
+          Ahci::Read_coalescer::enabled = true;
+          break;
         default:
           Dbg::warn().printf(usage_str, argv[0]);
           return -1;
@@ -343,21 +1117,193 @@ parse_args(int argc, char *const *argv)
   if (!opts.add_client(&drv))
     return 1;
 
+  if (stats_interval > 0)
+    debug_level |= Dbg::Stats;
+
   Dbg::set_level(debug_level);
   return optind;
 }
 
+static void device_scan_finished();
+
+/**
+ * Load the configured copy-on-write clones from their overlay devices.
+ *
+ * \return True if clones are being loaded and device_scan_finished() will
+ *         be called again when they have been added.
+ */
+static bool
+start_cow_clones()
+{
+  if (cow_clones.empty())
+    return false;
+
+  // Keep the scan open until all clones have been loaded.
+  ++devices_in_scan;
+
+  for (auto const &opts : cow_clones)
+    {
+      auto base = Ahci_device_factory::find_device(opts.base);
+      auto overlay = Ahci_device_factory::find_device(opts.overlay);
+      if (!base || !overlay)
+        {
+          Err().printf("Base or overlay of clone %s not found.\n",
+                       opts.name.c_str());
+          continue;
+        }
+
+      if (base.get() == overlay.get())
+        {
+          Err().printf("Clone %s needs different base and overlay devices.\n",
+                       opts.name.c_str());
+          continue;
+        }
+
+      auto cow = cxx::make_ref_obj<Ahci::Cow_device>(opts.name, base, overlay,
+                                                     opts.create);
+      cow_devices.push_back(cow);
+      ++devices_in_scan;
+      cow->load([cow]()
+        {
+          if (cow->ready())
+            {
+              ++devices_in_scan;
+              Ahci_device_factory::devices.push_back(cow);
+              drv.add_disk(cow, device_scan_finished);
+            }
+
+          device_scan_finished();
+        });
+    }
+
+  cow_clones.clear();
+  device_scan_finished();
+  return true;
+}
+
+/**
+ * Set up the thin pool once its device has been found.
+ *
+ * \return True if the pool is being loaded and device_scan_finished() will
+ *         be called again when its volumes have been added.
+ */
+static bool
+start_thin_pool()
+{
+  if (thin_pool_device.empty() || thin_pool)
+    return false;
+
+  auto dev = Ahci_device_factory::find_device(thin_pool_device);
+  if (!dev)
+    {
+      Err().printf("Thin pool device %s not found.\n",
+                   thin_pool_device.c_str());
+      thin_pool_device.clear();
+      return false;
+    }
+
+  thin_pool = cxx::make_unique<Ahci::Thin_pool>(dev, thin_pool_create);
+  for (auto const &v : thin_volumes)
+    thin_pool->add_volume(v.name, v.size);
+
+  ++devices_in_scan;
+  thin_pool->load([]()
+    {
+      for (auto const &vol : thin_pool->volumes())
+        {
+          ++devices_in_scan;
+          Ahci_device_factory::devices.push_back(vol);
+          drv.add_disk(vol, device_scan_finished);
+        }
+
+      device_scan_finished();
+    });
+
+  return true;
+}
+
+/**
+ * Create the configured linear devices from the devices found by the scan.
+ *
+ * \return True if devices were added and device_scan_finished() will be
+ *         called again when their partitions have been scanned.
+ */
+static bool
+start_linear_devices()
+{
+  if (linear_devices.empty())
+    return false;
+
+  // Keep the scan open until all devices have been added.
+  ++devices_in_scan;
+
+  for (auto const &opts : linear_devices)
+    {
+      std::vector<cxx::Ref_ptr<Ahci::Device>> members;
+      for (auto const &hid : opts.members)
+        {
+          auto dev = Ahci_device_factory::find_device(hid);
+          if (!dev)
+            {
+              Err().printf("Member %s of linear device %s not found.\n",
+                           hid.c_str(), opts.name.c_str());
+              break;
+            }
+
+          if (!members.empty()
+              && dev->sector_size() != members.front()->sector_size())
+            {
+              Err().printf("Members of linear device %s differ in sector "
+                           "size.\n", opts.name.c_str());
+              break;
+            }
+
+          if (std::find_if(members.begin(), members.end(),
+                           [&dev](cxx::Ref_ptr<Ahci::Device> const &m)
+                             { return m.get() == dev.get(); })
+              != members.end())
+            {
+              Err().printf("Member %s used twice in linear device %s.\n",
+                           hid.c_str(), opts.name.c_str());
+              break;
+            }
+
+          members.push_back(dev);
+        }
+
+      if (members.size() != opts.members.size())
+        continue;
+
+      auto lin = cxx::make_ref_obj<Ahci::Linear_device>(opts.name, members);
+      ++devices_in_scan;
+      Ahci_device_factory::devices.push_back(lin);
+      drv.add_disk(lin, device_scan_finished);
+    }
+
+  linear_devices.clear();
+  device_scan_finished();
+  return true;
+}
+
 static void
 device_scan_finished()
 {
   if (--devices_in_scan > 0)
     return;
 
+  // Linear devices, the thin pool and clones are built from disks and
+  // partitions, so they can only be added once the scan has found all of
+  // them. A thin pool may live on a linear device and a clone may use any
+  // of them.
+  if (start_linear_devices() || start_thin_pool() || start_cow_clones())
+    return;
+
   drv.scan_finished();
-  if (!server.registry()->register_obj(&drv, "svr").is_valid())
-    Dbg::warn().printf("Capability 'svr' not found. No dynamic clients accepted.\n");
-  else
-    Dbg::trace().printf("Device now accepts new clients.\n");
+
+  for (auto const &part : Ahci_device_factory::pinned_partitions)
+    part->preload();
+
+  Dbg::trace().printf("Device scan finished.\n");
 }
 
 static L4Re::Util::Shared_cap<L4Re::Dma_space>
@@ -395,6 +1341,32 @@ device_discovery(L4::Cap<L4vbus::Vbus> bus, L4::Cap<L4::Icu> icu)
   // make sure that we don't finish device scan before the while loop is done
   ++devices_in_scan;
 
+  // Disks may take a long time to spin up. Clients of devices that are
+  // ready are served right away, the others are asked to retry until the
+  // scan has finished.
+  if (!server.registry()->register_obj(&drv, "svr").is_valid())
+    Dbg::warn().printf("Capability 'svr' not found. No dynamic clients accepted.\n");
+  else
+    Dbg::trace().printf("Device now accepts new clients.\n");
+
+  for (auto const &opts : ram_disks)
+    {
+      cxx::Ref_ptr<Ahci::Ram_device> dev;
+      try
+        {
+          dev = cxx::make_ref_obj<Ahci::Ram_device>(opts.name, opts.size);
+        }
+      catch (L4::Runtime_error const &e)
+        {
+          Err().printf("%s: %s\n", e.str(), e.extra_str());
+          continue;
+        }
+
+      ++devices_in_scan;
+      Ahci_device_factory::devices.push_back(dev);
+      drv.add_disk(dev, device_scan_finished);
+    }
+
   while (root.next_device(&child, L4VBUS_MAX_DEPTH, &di) == L4_EOK)
     {
       Dbg::trace().printf("Scanning child 0x%lx.\n", child.dev_handle());
@@ -437,8 +1409,11 @@ device_discovery(L4::Cap<L4vbus::Vbus> bus, L4::Cap<L4::Icu> icu)
             [=](Ahci::Ahci_port *port)
               {
                 if (port && Ahci::Ahci_device::is_compatible_device(port))
-                  drv.add_disk(cxx::make_ref_obj<Ahci::Ahci_device>(port),
-                               device_scan_finished);
+                  {
+                    auto dev = cxx::make_ref_obj<Ahci::Ahci_device>(port);
+                    Ahci_device_factory::devices.push_back(dev);
+                    drv.add_disk(dev, device_scan_finished);
+                  }
                 else
                   device_scan_finished();
               });
@@ -479,6 +1454,14 @@ main(int argc, char *const *argv)
   Dbg::info().printf("AHCI driver says hello.\n");
 
   Block_device::Errand::set_server_iface(&server);
+  if (stats_interval > 0)
+    {
+#ifdef AHCI_CYCLE_STATS
+      new Ahci::Thread_cpu_stats();
+#endif
+      Ahci::Stats_provider::start_reporting(stats_interval);
+    }
+
   setup_hardware();
 
   Dbg::trace().printf("Beginning server loop...\n");
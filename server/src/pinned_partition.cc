@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include <cstring>
+
+#include <l4/cxx/minmax>
+#include <l4/re/env>
+#include <l4/re/error_helper>
+#include <l4/re/util/unique_cap>
+
+#include <l4/libblock-device/errand.h>
+
+#include "pinned_partition.h"
+
+static Dbg trace(Dbg::Trace, "pinned");
+
+namespace Ahci {
+
+int
+Pinned_partition::inout_data(l4_uint64_t sector,
+                             Block_device::Inout_block const &blocks,
+                             Block_device::Inout_callback const &cb,
+                             L4Re::Dma_space::Direction dir)
+{
+  if (dir != L4Re::Dma_space::Direction::From_device)
+    return -L4_EPERM;
+
+  l4_uint64_t offset = sector * sector_size();
+  l4_size_t total = 0;
+  bool mapped = true;
+  for (auto const *b = &blocks; b; b = b->next.get())
+    {
+      l4_size_t len = b->num_sectors * sector_size();
+      if (offset + total + len > capacity())
+        return -L4_EINVAL;
+
+      mapped = mapped && b->virt_addr;
+      total += len;
+    }
+
+  // Buffers without a local mapping can only be filled by the disk.
+  if (!_loaded || !mapped)
+    {
+      ++_disk_reads;
+      return Partitioned_device::inout_data(sector, blocks, cb, dir);
+    }
+
+  for (auto const *b = &blocks; b; b = b->next.get())
+    {
+      l4_size_t len = b->num_sectors * sector_size();
+      copy_out(offset, static_cast<char *>(b->virt_addr), len);
+      offset += len;
+    }
+
+  ++_ram_reads;
+  _ram_bytes += total;
+
+  // Like a flush, the request is complete before inout_data() returns.
+  cb(L4_EOK, total);
+  return L4_EOK;
+}
+
+void
+Pinned_partition::copy_out(l4_uint64_t offset, char *dest, l4_size_t len) const
+{
+  while (len > 0)
+    {
+      Chunk const &c = _chunks[offset / _chunk_bytes];
+      l4_size_t in_chunk = offset % _chunk_bytes;
+      l4_size_t sz = cxx::min<l4_size_t>(len, _chunk_bytes - in_chunk);
+
+      memcpy(dest, c.data + in_chunk, sz);
+
+      dest += sz;
+      offset += sz;
+      len -= sz;
+    }
+}
+
+long
+Pinned_partition::alloc_chunks()
+{
+  auto *env = L4Re::Env::env();
+  l4_uint64_t remaining = capacity() / sector_size();
+  l4_uint32_t chunk_sectors = _chunk_bytes / sector_size();
+
+  _chunks.resize((remaining + chunk_sectors - 1) / chunk_sectors);
+  for (auto &c : _chunks)
+    {
+      c.sectors = cxx::min<l4_uint64_t>(chunk_sectors, remaining);
+      remaining -= c.sectors;
+
+      l4_size_t size = c.sectors * sector_size();
+      auto ds = L4Re::Util::make_unique_cap<L4Re::Dataspace>();
+      if (!ds.is_valid())
+        return -L4_ENOMEM;
+
+      long ret = env->mem_alloc()->alloc(size, ds.get(),
+                                         L4Re::Mem_alloc::Continuous
+                                         | L4Re::Mem_alloc::Pinned);
+      if (ret < 0)
+        return ret;
+
+      try
+        {
+          c.region = cxx::make_unique<Block_device::Mem_region>(0, size, 0,
+                                                                cxx::move(ds));
+        }
+      catch (L4::Runtime_error const &e)
+        {
+          return e.err_no();
+        }
+
+      c.data = static_cast<char *>(c.region->local(L4virtio::Ptr<void>(0)));
+    }
+
+  return L4_EOK;
+}
+
+void
+Pinned_partition::free_chunks()
+{
+  for (auto &c : _chunks)
+    if (c.phys)
+      dma_unmap(c.phys, c.sectors, L4Re::Dma_space::Direction::From_device);
+
+  _chunks.clear();
+}
+
+void
+Pinned_partition::preload()
+{
+  _chunk_bytes = cxx::min<l4_size_t>(Chunk_bytes, max_size());
+  _chunk_bytes -= _chunk_bytes % sector_size();
+
+  long ret = alloc_chunks();
+  if (ret < 0)
+    {
+      Err().printf("Cannot allocate %llu bytes to pin partition %s: %ld\n",
+                   capacity(), hid().c_str(), ret);
+      _failed = true;
+      free_chunks();
+      return;
+    }
+
+  Dbg::info().printf("Preloading partition %s (%llu bytes) into memory.\n",
+                     hid().c_str(), capacity());
+
+  _preload_start = now();
+  preload_next();
+}
+
+void
+Pinned_partition::preload_next()
+{
+  while (!_failed && _next_chunk < _chunks.size())
+    {
+      if (!start_read(_next_chunk))
+        break;
+
+      ++_next_chunk;
+    }
+}
+
+void
+Pinned_partition::fail(int error)
+{
+  if (!_failed)
+    Err().printf("Preload of partition %s failed: %d\n", hid().c_str(), error);
+
+  _failed = true;
+
+  // Memory may only be released when no more reads are in flight.
+  if (_chunks_done == _next_chunk)
+    free_chunks();
+}
+
+bool
+Pinned_partition::start_read(unsigned idx)
+{
+  Chunk &c = _chunks[idx];
+
+  int ret = dma_map(c.region.get(), 0, c.sectors,
+                    L4Re::Dma_space::Direction::From_device, &c.phys);
+  if (ret < 0)
+    {
+      c.phys = 0;
+      fail(ret);
+      return false;
+    }
+
+  Block_device::Inout_block block;
+  block.dma_addr = c.phys;
+  block.virt_addr = c.data;
+  block.num_sectors = c.sectors;
+
+  l4_uint64_t sector = l4_uint64_t(idx) * (_chunk_bytes / sector_size());
+  ret = Partitioned_device::inout_data(
+          sector, block,
+          [this, idx](int error, l4_size_t) { finish_read(idx, error); },
+          L4Re::Dma_space::Direction::From_device);
+
+  if (ret >= 0)
+    {
+      trace.printf("Preloading chunk %u of %s.\n", idx, hid().c_str());
+      return true;
+    }
+
+  dma_unmap(c.phys, c.sectors, L4Re::Dma_space::Direction::From_device);
+  c.phys = 0;
+
+  if (ret != -L4_EBUSY)
+    fail(ret);
+  else if (_next_chunk == _chunks_done && !_retry_pending)
+    {
+      // No read in flight that would continue the preload on completion,
+      // so try again after a short time.
+      _retry_pending = true;
+      Block_device::Errand::schedule([this]()
+                                       {
+                                         _retry_pending = false;
+                                         preload_next();
+                                       }, Retry_us);
+    }
+
+  return false;
+}
+
+void
+Pinned_partition::finish_read(unsigned idx, int error)
+{
+  Chunk &c = _chunks[idx];
+  dma_unmap(c.phys, c.sectors, L4Re::Dma_space::Direction::From_device);
+  c.phys = 0;
+  ++_chunks_done;
+
+  if (error < 0 || _failed)
+    {
+      fail(error);
+      return;
+    }
+
+  if (_chunks_done < _chunks.size())
+    {
+      preload_next();
+      return;
+    }
+
+  _preload_time = now() - _preload_start;
+  _loaded = true;
+  Dbg::info().printf("Partition %s pinned in memory after %llu ms.\n",
+                     hid().c_str(), _preload_time / 1000);
+}
+
+void
+Pinned_partition::dump_stats(Dbg const &log) const
+{
+  log.printf("pinned %s: %s, %u/%zu chunks, %llu ram reads (%llu KiB), "
+             "%llu disk reads, preload %llu ms\n",
+             hid().c_str(),
+             _loaded ? "loaded" : (_failed ? "failed" : "loading"),
+             _chunks_done, _chunks.size(), _ram_reads, _ram_bytes >> 10,
+             _disk_reads, _preload_time / 1000);
+}
+
+} // namespace Ahci
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/cxx/unique_ptr>
+#include <l4/sys/kip.h>
+
+#include <vector>
+
+#include "ahci_partition.h"
+#include "stats.h"
+
+#include <l4/libblock-device/types.h>
+
+namespace Ahci {
+
+/**
+ * Read-only partition that is served from driver memory.
+ *
+ * After preload() the complete partition content is kept in pinned
+ * memory and all reads are answered by copying into the client buffers
+ * without any disk I/O. Until the preload has finished, reads are
+ * forwarded to the disk as usual.
+ */
+class Pinned_partition : public Partitioned_device, public Stats_provider
+{
+  struct Chunk
+  {
+    cxx::unique_ptr<Block_device::Mem_region> region;
+    char *data = nullptr;
+    L4Re::Dma_space::Dma_addr phys = 0;
+    l4_uint32_t sectors = 0;
+  };
+
+public:
+  enum
+  {
+    /// Size of a memory chunk and of a single preload read in bytes.
+    Chunk_bytes = 0x400000,
+    /// Time to back off when the disk is busy during preload.
+    Retry_us = 1000,
+  };
+
+  Pinned_partition(cxx::Ref_ptr<Device> const &dev, unsigned partition_id,
+                   Block_device::Partition_info const &pi)
+  : Partitioned_device(dev, partition_id, pi)
+  {}
+
+  bool is_read_only() const override
+  { return true; }
+
+  int inout_data(l4_uint64_t sector, Block_device::Inout_block const &blocks,
+                 Block_device::Inout_callback const &cb,
+                 L4Re::Dma_space::Direction dir) override;
+
+  /**
+   * Allocate memory for the partition and start reading its content.
+   *
+   * Reads are issued on all command slots available to the partition.
+   */
+  void preload();
+
+  /// Return true when all reads are served from memory.
+  bool is_loaded() const
+  { return _loaded; }
+
+  void dump_stats(Dbg const &log) const override;
+
+private:
+  static l4_kernel_clock_t now()
+  { return l4_kip_clock(l4re_kip()); }
+
+  long alloc_chunks();
+  void free_chunks();
+  void preload_next();
+  bool start_read(unsigned idx);
+  void finish_read(unsigned idx, int error);
+
+  /// Abort the preload, the partition stays served from disk.
+  void fail(int error);
+
+  /// Copy `len` bytes at byte offset `offset` of the partition to `dest`.
+  void copy_out(l4_uint64_t offset, char *dest, l4_size_t len) const;
+
+  std::vector<Chunk> _chunks;
+  l4_size_t _chunk_bytes = 0;
+  unsigned _next_chunk = 0;
+  unsigned _chunks_done = 0;
+  bool _loaded = false;
+  bool _failed = false;
+  bool _retry_pending = false;
+
+  l4_kernel_clock_t _preload_start = 0;
+  l4_kernel_clock_t _preload_time = 0;
+  l4_uint64_t _ram_reads = 0;
+  l4_uint64_t _ram_bytes = 0;
+  l4_uint64_t _disk_reads = 0;
+};
+
+} // namespace Ahci
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include <cstring>
+
+#include <l4/re/env>
+#include <l4/re/error_helper>
+
+#include <l4/libblock-device/errand.h>
+
+#include "ram_device.h"
+
+namespace Ahci {
+
+Ram_device::Ram_device(std::string const &name, l4_uint64_t size)
+: _name(name), _size(size - size % Sector_size)
+{
+  auto *e = L4Re::Env::env();
+
+  _ds = L4Re::chkcap(L4Re::Util::make_unique_cap<L4Re::Dataspace>(),
+                     "Allocate capability for RAM disk.");
+  L4Re::chksys(e->mem_alloc()->alloc(_size, _ds.get(),
+                                     L4Re::Mem_alloc::Pinned),
+               "Allocate memory for RAM disk.");
+  L4Re::chksys(e->rm()->attach(&_mem, _size,
+                               L4Re::Rm::F::Search_addr | L4Re::Rm::F::RW,
+                               L4::Ipc::make_cap_rw(_ds.get())),
+               "Attach RAM disk memory.");
+
+  Dbg::info().printf("RAM disk %s with %llu sectors.\n", _name.c_str(),
+                     _size / Sector_size);
+}
+
+int
+Ram_device::inout_data(l4_uint64_t sector,
+                       Block_device::Inout_block const &blocks,
+                       Block_device::Inout_callback const &cb,
+                       L4Re::Dma_space::Direction dir)
+{
+  l4_uint64_t offset = sector * Sector_size;
+  l4_size_t total = 0;
+  for (auto const *b = &blocks; b; b = b->next.get())
+    {
+      l4_size_t len = b->num_sectors * Sector_size;
+      if (!b->virt_addr || offset > _size || total + len > _size - offset)
+        {
+          Err().printf("Client error: invalid RAM disk access.\n");
+          return -L4_EINVAL;
+        }
+
+      total += len;
+    }
+
+  char *mem = _mem.get() + offset;
+  for (auto const *b = &blocks; b; b = b->next.get())
+    {
+      l4_size_t len = b->num_sectors * Sector_size;
+      if (dir == L4Re::Dma_space::Direction::To_device)
+        memcpy(mem, b->virt_addr, len);
+      else
+        memcpy(b->virt_addr, mem, len);
+
+      mem += len;
+    }
+
+  // Complete like a command slot of a port does.
+  Block_device::Errand::schedule([cb, total]() { cb(L4_EOK, total); }, 0);
+  return L4_EOK;
+}
+
+int
+Ram_device::flush(Block_device::Inout_callback const &cb)
+{
+  cb(0, 0);
+  return L4_EOK;
+}
+
+} // namespace Ahci
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <string>
+
+#include <l4/re/dataspace>
+#include <l4/re/rm>
+#include <l4/re/util/unique_cap>
+
+#include "ahci_device.h"
+
+namespace Ahci {
+
+/**
+ * Memory-backed disk for measuring the overhead of the driver.
+ *
+ * The device behaves like an AHCI disk towards clients and partitions
+ * but transfers data by copying from and to driver memory. Completions
+ * are delivered asynchronously like those of a real port, so the full
+ * client path is exercised.
+ */
+class Ram_device : public Block_device::Device_with_notification_domain<Device>
+{
+public:
+  enum
+  {
+    Sector_size = 512,
+    /// Same request limits as an LBA48 disk.
+    Max_size = 65536 * Sector_size,
+    Max_segments = Command_table::Max_entries
+                   - Max_size / Command_table::Prd_max_bytes,
+    /// Number of requests reported to be processed in parallel.
+    Max_in_flight = 32,
+  };
+
+  /**
+   * Create a RAM disk.
+   *
+   * \param name  Hardware ID of the disk, used to select it for clients.
+   * \param size  Size of the disk in bytes, rounded down to whole sectors.
+   *
+   * \throws L4::Runtime_error  Memory for the disk could not be allocated.
+   */
+  Ram_device(std::string const &name, l4_uint64_t size);
+
+  bool is_read_only() const override
+  { return false; }
+
+  bool match_hid(cxx::String const &hid) const override
+  { return hid == cxx::String(_name.c_str(), _name.length()); }
+
+  l4_uint64_t capacity() const override
+  { return _size; }
+
+  l4_size_t sector_size() const override
+  { return Sector_size; }
+
+  l4_size_t max_size() const override
+  { return Max_size; }
+
+  unsigned max_segments() const override
+  { return Max_segments; }
+
+  unsigned max_in_flight() const override
+  { return Max_in_flight; }
+
+  std::string const &hid() const override
+  { return _name; }
+
+  void reset() override
+  {}
+
+  // Data is copied by the CPU, DMA addresses are not used.
+  int dma_map(Block_device::Mem_region *, l4_addr_t, l4_size_t,
+              L4Re::Dma_space::Direction,
+              L4Re::Dma_space::Dma_addr *phys) override
+  {
+    *phys = 0;
+    return L4_EOK;
+  }
+
+  int dma_unmap(L4Re::Dma_space::Dma_addr, l4_size_t,
+                L4Re::Dma_space::Direction) override
+  { return L4_EOK; }
+
+  int inout_data(l4_uint64_t sector,
+                 Block_device::Inout_block const &blocks,
+                 Block_device::Inout_callback const &cb,
+                 L4Re::Dma_space::Direction dir) override;
+
+  int flush(Block_device::Inout_callback const &cb) override;
+
+  void start_device_scan(Block_device::Errand::Callback const &callback) override
+  { callback(); }
+
+private:
+  std::string _name;
+  l4_uint64_t _size;
+  L4Re::Util::Unique_cap<L4Re::Dataspace> _ds;
+  L4Re::Rm::Unique_region<char *> _mem;
+};
+
+} // namespace Ahci
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include <utility>
+#include <vector>
+
+#include "ahci_device.h"
+#include "range_lock.h"
+
+namespace Ahci {
+
+bool
+Range_lock::conflicts_held(l4_uint64_t start, l4_uint64_t end,
+                           bool write) const
+{
+  auto it = _held.lower_bound(start > _max_len ? start - _max_len : 0);
+  for (; it != _held.end() && it->first < end; ++it)
+    if (conflicts(start, end, write, it->first, it->second.end,
+                  it->second.write))
+      return true;
+
+  return false;
+}
+
+void
+Range_lock::take(l4_uint64_t start, l4_uint64_t end, bool write)
+{
+  _held.insert({start, {end, write}});
+  if (end - start > _max_len)
+    _max_len = end - start;
+}
+
+bool
+Range_lock::try_lock(l4_uint64_t start, l4_uint64_t end, bool write)
+{
+  bool wait = conflicts_held(start, end, write);
+  for (auto it = _waiters.begin(); !wait && it != _waiters.end(); ++it)
+    wait = conflicts(start, end, write, it->start, it->end, it->write);
+
+  if (wait)
+    return false;
+
+  ++_locks;
+  take(start, end, write);
+  return true;
+}
+
+void
+Range_lock::wait(l4_uint64_t start, l4_uint64_t end, bool write,
+                 Grant const &grant)
+{
+  ++_locks;
+  ++_contended;
+  _waiters.push_back({start, end, write, grant, now()});
+  if (_waiters.size() > _max_waiters)
+    _max_waiters = _waiters.size();
+}
+
+void
+Range_lock::unlock(l4_uint64_t start, l4_uint64_t end, bool write)
+{
+  auto range = _held.equal_range(start);
+  for (auto it = range.first; it != range.second; ++it)
+    if (it->second.end == end && it->second.write == write)
+      {
+        _held.erase(it);
+        break;
+      }
+
+  // Grant in submission order. A waiter stays queued if it conflicts with
+  // a held range or with an earlier waiter that is still queued.
+  std::vector<Grant> granted;
+  for (auto it = _waiters.begin(); it != _waiters.end();)
+    {
+      bool wait = conflicts_held(it->start, it->end, it->write);
+      for (auto e = _waiters.begin(); !wait && e != it; ++e)
+        wait = conflicts(it->start, it->end, it->write,
+                         e->start, e->end, e->write);
+
+      if (wait)
+        {
+          ++it;
+          continue;
+        }
+
+      take(it->start, it->end, it->write);
+      _wait.record(now() - it->since);
+      granted.push_back(std::move(it->grant));
+      it = _waiters.erase(it);
+    }
+
+  // Granted requests may complete and unlock again right away, so they
+  // are only started once the waiter list is consistent.
+  for (auto const &g : granted)
+    g();
+}
+
+void
+Range_lock::dump_stats(Dbg const &log) const
+{
+  if (!_locks)
+    return;
+
+  log.printf("range lock %s: %llu locks, %llu contended (%u%%), "
+             "%zu held, %zu waiting, max %llu waiting, wait",
+             _dev->hid().c_str(), _locks, _contended,
+             stats_percent(_contended, _locks), _held.size(),
+             _waiters.size(), _max_waiters);
+  _wait.dump(log);
+}
+
+} // namespace Ahci
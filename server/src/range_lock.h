@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <functional>
+#include <list>
+#include <map>
+
+#include <l4/sys/kip.h>
+
+#include "stats.h"
+
+namespace Ahci {
+
+struct Device;
+
+/**
+ * Lock over sector ranges of a device with requests in flight.
+ *
+ * Overlapping ranges are only held at the same time if none of them is
+ * written, everything else is ordered: a range that conflicts with a held
+ * range or with a range that is already waiting is queued and granted in
+ * submission order once the conflicting ranges have been released. Ranges
+ * that do not overlap are never delayed.
+ *
+ * Held ranges are kept sorted by their first sector. As no range is longer
+ * than the longest range seen so far, only ranges starting at most that
+ * distance before a new range need to be checked for overlaps.
+ */
+class Range_lock : public Stats_provider
+{
+public:
+  using Grant = std::function<void()>;
+
+  explicit Range_lock(Device const *dev) : _dev(dev) {}
+
+  /**
+   * Lock the sectors [start, end) if possible without waiting.
+   *
+   * \param start  First sector of the range.
+   * \param end    First sector after the range.
+   * \param write  The range is written.
+   *
+   * \retval true   The range has been locked.
+   * \retval false  The range conflicts with a held or waiting range, it
+   *                must be queued with wait().
+   */
+  bool try_lock(l4_uint64_t start, l4_uint64_t end, bool write);
+
+  /**
+   * Queue a range that could not be locked by try_lock().
+   *
+   * \param grant  Called once the range has been locked.
+   */
+  void wait(l4_uint64_t start, l4_uint64_t end, bool write,
+            Grant const &grant);
+
+  /// Release a range locked before, granting waiting ranges where possible.
+  void unlock(l4_uint64_t start, l4_uint64_t end, bool write);
+
+  void dump_stats(Dbg const &log) const override;
+
+private:
+  struct Held
+  {
+    l4_uint64_t end;
+    bool write;
+  };
+
+  struct Waiter
+  {
+    l4_uint64_t start;
+    l4_uint64_t end;
+    bool write;
+    Grant grant;
+    l4_kernel_clock_t since;
+  };
+
+  static l4_kernel_clock_t now()
+  { return l4_kip_clock(l4re_kip()); }
+
+  static bool conflicts(l4_uint64_t start, l4_uint64_t end, bool write,
+                        l4_uint64_t o_start, l4_uint64_t o_end, bool o_write)
+  { return start < o_end && o_start < end && (write || o_write); }
+
+  bool conflicts_held(l4_uint64_t start, l4_uint64_t end, bool write) const;
+  void take(l4_uint64_t start, l4_uint64_t end, bool write);
+
+  Device const *_dev;
+  std::multimap<l4_uint64_t, Held> _held;
+  std::list<Waiter> _waiters;
+  l4_uint64_t _max_len = 0;
+
+  l4_uint64_t _locks = 0;
+  l4_uint64_t _contended = 0;
+  l4_uint64_t _max_waiters = 0;
+  Latency_histogram _wait;
+};
+
+} // namespace Ahci
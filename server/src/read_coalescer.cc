@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include <l4/cxx/minmax>
+#include <l4/sys/cache.h>
+
+#include "block_list.h"
+#include "read_coalescer.h"
+
+static Dbg trace(Dbg::Trace, "coalesce");
+
+namespace Ahci {
+
+bool Read_coalescer::enabled = false;
+
+static bool
+has_virt_addr(Block_device::Inout_block const &blocks)
+{
+  for (auto const *b = &blocks; b; b = b->next.get())
+    if (!b->virt_addr)
+      return false;
+
+  return true;
+}
+
+bool
+Read_coalescer::attach(l4_uint64_t sector,
+                       Block_device::Inout_block const &blocks,
+                       Block_device::Inout_callback const &cb)
+{
+  if (_reads.empty())
+    return false;
+
+  l4_uint64_t count = block_list_sectors(blocks);
+  auto it = std::find_if(_reads.begin(), _reads.end(),
+                         [sector, count](Read_ref const &r)
+                           { return r->sector == sector && r->count == count; });
+  if (it == _reads.end() || !has_virt_addr(blocks))
+    return false;
+
+  Read &read = **it;
+  read.waiters.emplace_back();
+  Waiter &w = read.waiters.back();
+  // The block list of the client is gone by the time the data arrives.
+  slice_blocks(&w.blocks, blocks, 0, count, read.sector_size);
+  w.cb = cb;
+
+  ++_saved;
+  _saved_sectors += count;
+  _max_waiters = cxx::max<unsigned>(_max_waiters, read.waiters.size());
+
+  trace.printf("%s: read at sector %llu attached to the outstanding read "
+               "(%zu waiting).\n", _name.c_str(), sector, read.waiters.size());
+  return true;
+}
+
+Read_coalescer::Read_ref
+Read_coalescer::start(l4_uint64_t sector,
+                      Block_device::Inout_block const &blocks,
+                      l4_size_t sector_size)
+{
+  l4_uint64_t count = block_list_sectors(blocks);
+  if (!_buf_virt || !_free_slots || count * sector_size > Slot_bytes
+      || !has_virt_addr(blocks))
+    return Read_ref();
+
+  auto read = std::make_shared<Read>();
+  read->sector = sector;
+  read->count = count;
+  read->sector_size = sector_size;
+  read->slot = __builtin_ctz(_free_slots);
+  slice_blocks(&read->blocks, blocks, 0, count, sector_size);
+
+  _free_slots &= ~(1U << read->slot);
+  _reads.push_back(read);
+  ++_issued;
+  return read;
+}
+
+void
+Read_coalescer::buffer_block(Read_ref const &read,
+                             Block_device::Inout_block *block) const
+{
+  block->dma_addr = _buf_phys + read->slot * Slot_bytes;
+  block->virt_addr = _buf_virt + read->slot * Slot_bytes;
+  block->num_sectors = read->count;
+}
+
+void
+Read_coalescer::finish(Read_ref const &read, int error, l4_size_t size)
+{
+  remove(read.get());
+
+  char const *data = _buf_virt + read->slot * Slot_bytes;
+  if (error >= 0)
+    {
+      l4_size_t bytes = read->count * read->sector_size;
+      l4_cache_inv_data(reinterpret_cast<unsigned long>(data),
+                        reinterpret_cast<unsigned long>(data + bytes));
+      copy_data(read->blocks, data, read->sector_size);
+    }
+
+  for (auto const &w : read->waiters)
+    {
+      if (error >= 0)
+        copy_data(w.blocks, data, read->sector_size);
+      w.cb(error, size);
+    }
+
+  read->waiters.clear();
+  release(read.get());
+}
+
+void
+Read_coalescer::invalidate(l4_uint64_t sector, l4_uint64_t count)
+{
+  // Reads already attached were issued before the write and may complete
+  // with the old data, as they would have without coalescing.
+  auto it = std::remove_if(_reads.begin(), _reads.end(),
+                           [sector, count](Read_ref const &r)
+                             {
+                               return r->sector < sector + count
+                                      && sector < r->sector + r->count;
+                             });
+  _invalidated += _reads.end() - it;
+  _reads.erase(it, _reads.end());
+}
+
+void
+Read_coalescer::remove(Read const *read)
+{
+  auto it = std::find_if(_reads.begin(), _reads.end(),
+                         [read](Read_ref const &r) { return r.get() == read; });
+  if (it != _reads.end())
+    _reads.erase(it);
+}
+
+void
+Read_coalescer::copy_data(Block_device::Inout_block const &dst,
+                          char const *src, l4_size_t sector_size)
+{
+  for (auto const *d = &dst; d; d = d->next.get())
+    {
+      l4_size_t n = d->num_sectors * sector_size;
+      memcpy(d->virt_addr, src, n);
+      src += n;
+    }
+}
+
+void
+Read_coalescer::dump_stats(Dbg const &log) const
+{
+  if (!_saved)
+    return;
+
+  log.printf("coalesce %s: %llu reads issued, %llu reads saved (%u%%, "
+             "%llu sectors), %llu invalidated, max %u waiting\n",
+             _name.c_str(), _issued, _saved,
+             stats_percent(_saved, _issued + _saved), _saved_sectors,
+             _invalidated, _max_waiters);
+}
+
+} // namespace Ahci
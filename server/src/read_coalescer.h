@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <l4/sys/l4int.h>
+
+#include <l4/libblock-device/types.h>
+
+#include "stats.h"
+
+namespace Ahci {
+
+/**
+ * Coalescing of identical reads of a disk.
+ *
+ * A read covering exactly the same sectors as a read still in flight is
+ * not issued to the disk. It waits for the outstanding read instead and
+ * receives a copy of its data when that completes.
+ *
+ * The buffers of the issuing client may be changed by that client at any
+ * time, so reads that others may attach to go to a bounce buffer owned by
+ * the driver, from which the data is copied to the issuer and to every
+ * waiter. Only reads that fit into a slot of the bounce buffer and whose
+ * blocks all have a virtual address take part.
+ *
+ * A write or discard overlapping an outstanding read stops further reads
+ * from attaching to it, as they must see the new data.
+ */
+class Read_coalescer : public Stats_provider
+{
+  struct Waiter
+  {
+    /// Copy of the block list of the waiting request.
+    Block_device::Inout_block blocks;
+    Block_device::Inout_callback cb;
+  };
+
+public:
+  enum
+  {
+    /// Number of reads that may use the bounce buffer at the same time.
+    Buffer_slots = 8,
+    /// Size of a slot of the bounce buffer in bytes.
+    Slot_bytes = 0x10000,
+    /// Size of the bounce buffer in bytes.
+    Buffer_bytes = Buffer_slots * Slot_bytes,
+  };
+
+  /// Read in flight that other reads may attach to.
+  struct Read
+  {
+    l4_uint64_t sector;
+    l4_uint64_t count;
+    l4_size_t sector_size;
+    /// Slot of the bounce buffer the disk reads into.
+    unsigned slot;
+    /// Copy of the block list of the issuing request.
+    Block_device::Inout_block blocks;
+    std::vector<Waiter> waiters;
+  };
+
+  using Read_ref = std::shared_ptr<Read>;
+
+  /// Coalesce identical reads, off by default.
+  static bool enabled;
+
+  /**
+   * Create a read coalescer.
+   *
+   * \param name  Name of the device used in the report. The string is
+   *              referenced, not copied.
+   */
+  explicit Read_coalescer(std::string const &name) : _name(name) {}
+
+  /**
+   * Set the bounce buffer of Buffer_bytes bytes.
+   *
+   * No reads are coalesced until the buffer has been set.
+   *
+   * \param virt  Local address of the buffer.
+   * \param phys  DMA address of the buffer for the disk.
+   */
+  void set_buffer(char *virt, L4Re::Dma_space::Dma_addr phys)
+  {
+    _buf_virt = virt;
+    _buf_phys = phys;
+  }
+
+  /**
+   * Attach a read to an identical read in flight.
+   *
+   * \retval true   The read has been attached, `cb` is called when the
+   *                outstanding read completes.
+   * \retval false  No matching read, the read must be issued.
+   */
+  bool attach(l4_uint64_t sector, Block_device::Inout_block const &blocks,
+              Block_device::Inout_callback const &cb);
+
+  /**
+   * Record a read that is about to be issued.
+   *
+   * \return The read to pass to finish() or cancel(), or an empty reference
+   *         if the read cannot be shared. The disk read must go to the
+   *         block returned by buffer_block() instead of the client buffers.
+   */
+  Read_ref start(l4_uint64_t sector, Block_device::Inout_block const &blocks,
+                 l4_size_t sector_size);
+
+  /// Fill in the block of the bounce buffer a read goes to.
+  void buffer_block(Read_ref const &read,
+                    Block_device::Inout_block *block) const;
+
+  /**
+   * Copy the data of a read to the issuer and complete the waiters.
+   *
+   * Must be called before the issuing request is completed.
+   */
+  void finish(Read_ref const &read, int error, l4_size_t size);
+
+  /// Forget a read that could not be issued.
+  void cancel(Read_ref const &read)
+  {
+    remove(read.get());
+    release(read.get());
+  }
+
+  /// Stop reads from attaching to outstanding reads overlapping a range.
+  void invalidate(l4_uint64_t sector, l4_uint64_t count);
+
+  void dump_stats(Dbg const &log) const override;
+
+private:
+  void remove(Read const *read);
+  void release(Read const *read)
+  { _free_slots |= 1U << read->slot; }
+  static void copy_data(Block_device::Inout_block const &dst,
+                        char const *src, l4_size_t sector_size);
+
+  std::string const &_name;
+  /// Reads in flight that may still be attached to.
+  std::vector<Read_ref> _reads;
+
+  char *_buf_virt = nullptr;
+  L4Re::Dma_space::Dma_addr _buf_phys = 0;
+  l4_uint32_t _free_slots = (1U << Buffer_slots) - 1;
+
+  l4_uint64_t _issued = 0;
+  l4_uint64_t _saved = 0;
+  l4_uint64_t _saved_sectors = 0;
+  l4_uint64_t _invalidated = 0;
+  unsigned _max_waiters = 0;
+};
+
+} // namespace Ahci
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include "request_histogram.h"
+
+namespace Ahci {
+
+void
+Request_histogram::dump_stats(Dbg const &log) const
+{
+  if (!_requests)
+    return;
+
+  log.printf("requests %s: %llu total, %u%% writes, read %llu KiB, "
+             "write %llu KiB\n",
+             _name.c_str(), _requests, stats_percent(_writes, _requests),
+             _read_bytes >> 10, _write_bytes >> 10);
+
+  log.printf("  distance: sequential %u%% near %u%% random %u%%\n",
+             stats_percent(_distances[D_sequential], _requests),
+             stats_percent(_distances[D_near], _requests),
+             stats_percent(_distances[D_random], _requests));
+
+  log.printf("  size:");
+  for (unsigned i = 0; i < Size_classes; ++i)
+    {
+      if (!_sizes[i])
+        continue;
+
+      l4_uint64_t kib = 1ULL << i >> 1;
+      if (i == 0)
+        log.cprintf(" <1K:%llu", _sizes[i]);
+      else if (i == Size_classes - 1)
+        log.cprintf(" >=%lluK:%llu", kib, _sizes[i]);
+      else
+        log.cprintf(" %lluK:%llu", kib, _sizes[i]);
+    }
+  log.cprintf("\n");
+}
+
+} // namespace Ahci
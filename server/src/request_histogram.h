@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <string>
+
+#include <l4/re/dma_space>
+
+#include "stats.h"
+
+namespace Ahci {
+
+/**
+ * Histograms describing the request pattern of a client.
+ *
+ * Requests are counted by transfer size in power-of-two classes, by their
+ * distance to the end of the previous request and by direction.
+ */
+class Request_histogram : public Stats_provider
+{
+public:
+  enum
+  {
+    /// Number of size classes, the first for requests below 1 KiB.
+    Size_classes = 13,
+    /// Maximum distance in bytes for a request to be considered near.
+    Near_bytes = 0x100000,
+  };
+
+  enum Distance
+  {
+    D_sequential, ///< Starts where the previous request ended
+    D_near,       ///< Starts within Near_bytes of the previous request
+    D_random,     ///< Anything else
+    Num_distances
+  };
+
+  /**
+   * Create a request histogram.
+   *
+   * \param name  Name of the client used in the report.
+   */
+  explicit Request_histogram(std::string const &name) : _name(name) {}
+
+  /**
+   * Count a request.
+   *
+   * \param sector       First sector of the request.
+   * \param num_sectors  Length of the request in sectors.
+   * \param sector_size  Size of a sector in bytes.
+   * \param dir          Direction of the request.
+   */
+  void record(l4_uint64_t sector, l4_size_t num_sectors, l4_size_t sector_size,
+              L4Re::Dma_space::Direction dir)
+  {
+    l4_uint64_t bytes = num_sectors * sector_size;
+
+    unsigned sz = 0;
+    while (sz < Size_classes - 1 && (bytes >> (10 + sz)))
+      ++sz;
+    ++_sizes[sz];
+
+    l4_uint64_t dist = sector > _last_end ? sector - _last_end
+                                          : _last_end - sector;
+    if (_requests == 0)
+      ++_distances[D_random];
+    else if (dist == 0)
+      ++_distances[D_sequential];
+    else if (dist * sector_size <= Near_bytes)
+      ++_distances[D_near];
+    else
+      ++_distances[D_random];
+
+    _last_end = sector + num_sectors;
+    ++_requests;
+
+    if (dir == L4Re::Dma_space::Direction::To_device)
+      {
+        ++_writes;
+        _write_bytes += bytes;
+      }
+    else
+      _read_bytes += bytes;
+  }
+
+  void dump_stats(Dbg const &log) const override;
+
+private:
+  std::string _name;
+  l4_uint64_t _last_end = 0;
+  l4_uint64_t _requests = 0;
+  l4_uint64_t _writes = 0;
+  l4_uint64_t _read_bytes = 0;
+  l4_uint64_t _write_bytes = 0;
+  l4_uint64_t _sizes[Size_classes] = { 0 };
+  l4_uint64_t _distances[Num_distances] = { 0 };
+};
+
+} // namespace Ahci
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include "ahci_port.h"
+#include "retry_policy.h"
+
+namespace Ahci {
+
+unsigned Retry_policy::max_retries = 3;
+
+void
+Retry_policy::success(l4_size_t full)
+{
+  _errors_in_row = 0;
+  if (!_limit || ++_successes_in_row < Successes_to_grow)
+    return;
+
+  _successes_in_row = 0;
+  _limit *= 2;
+  if (_limit >= full)
+    {
+      _limit = 0;
+      Dbg::info().printf("%s: back to full transfer size.\n", _name.c_str());
+    }
+}
+
+void
+Retry_policy::failure(int error, l4_size_t sectors, l4_size_t sector_size)
+{
+  ++_errors;
+  _successes_in_row = 0;
+
+  if (error != Ahci_port::Interface_error)
+    return;
+
+  ++_interface_errors;
+  if (++_errors_in_row < Errors_to_halve)
+    return;
+
+  _errors_in_row = 0;
+  l4_size_t current = _limit ? _limit : sectors;
+  if (current / 2 * sector_size < Min_transfer_bytes)
+    return;
+
+  _limit = current / 2;
+  ++_downgrades;
+  Dbg::warn().printf("%s: interface errors, limiting transfers to %zu KiB.\n",
+                     _name.c_str(), (_limit * sector_size) >> 10);
+}
+
+void
+Retry_policy::dump_stats(Dbg const &log) const
+{
+  if (!_errors)
+    return;
+
+  log.printf("retries %s: %llu errors (%llu interface), %llu retries, "
+             "%llu recovered, %llu failed, %llu downgrades, limit ",
+             _name.c_str(), _errors, _interface_errors, _retries, _recovered,
+             _failed, _downgrades);
+  if (_limit)
+    log.cprintf("%zu sectors\n", _limit);
+  else
+    log.cprintf("none\n");
+}
+
+} // namespace Ahci
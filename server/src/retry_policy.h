@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <string>
+
+#include <l4/sys/l4int.h>
+
+#include "stats.h"
+
+namespace Ahci {
+
+/**
+ * Retry policy of a disk.
+ *
+ * Failed transfers are retried up to max_retries times. Interface errors
+ * on a marginal link typically hit large transfers, so after
+ * Errors_to_halve interface errors in a row the transfer size of the disk
+ * is halved, down to Min_transfer_bytes. Every run of Successes_to_grow
+ * successful transfers doubles it again until the full size is reached.
+ */
+class Retry_policy : public Stats_provider
+{
+public:
+  enum
+  {
+    /// Interface errors in a row before the transfer size is halved.
+    Errors_to_halve = 2,
+    /// Successful transfers in a row before the transfer size is doubled.
+    Successes_to_grow = 64,
+    /// Smallest transfer size the policy reduces to.
+    Min_transfer_bytes = 4096,
+    /// Time to wait before a retry, giving the port time to recover.
+    Retry_delay_us = 10000,
+  };
+
+  /// Number of retries of a failed transfer, 0 disables retries.
+  static unsigned max_retries;
+
+  /**
+   * Create a retry policy.
+   *
+   * \param name  Name of the device used in the report. The string is
+   *              referenced, not copied.
+   */
+  explicit Retry_policy(std::string const &name) : _name(name) {}
+
+  /// Return the current transfer limit in sectors, 0 if not limited.
+  l4_size_t limit() const
+  { return _limit; }
+
+  /**
+   * Account a successful transfer.
+   *
+   * \param full  Maximum transfer size of the device in sectors.
+   */
+  void success(l4_size_t full);
+
+  /**
+   * Account a failed transfer.
+   *
+   * \param error        Error reported by the port.
+   * \param sectors      Size of the failed transfer in sectors.
+   * \param sector_size  Size of a sector in bytes.
+   */
+  void failure(int error, l4_size_t sectors, l4_size_t sector_size);
+
+  /// A failed transfer is issued again.
+  void retried()
+  { ++_retries; }
+
+  /// A transfer succeeded after having been retried.
+  void recovered()
+  { ++_recovered; }
+
+  /// A transfer failed for good.
+  void gave_up()
+  { ++_failed; }
+
+  void dump_stats(Dbg const &log) const override;
+
+private:
+  std::string const &_name;
+  l4_size_t _limit = 0;
+  unsigned _errors_in_row = 0;
+  unsigned _successes_in_row = 0;
+
+  l4_uint64_t _errors = 0;
+  l4_uint64_t _interface_errors = 0;
+  l4_uint64_t _retries = 0;
+  l4_uint64_t _recovered = 0;
+  l4_uint64_t _failed = 0;
+  l4_uint64_t _downgrades = 0;
+};
+
+} // namespace Ahci
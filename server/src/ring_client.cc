@@ -0,0 +1,353 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include <l4/re/env>
+#include <l4/sys/kip.h>
+
+#include "ring_client.h"
+
+static Dbg trace(Dbg::Trace, "ring");
+
+namespace Ahci {
+
+Ring_client::Ring_client(cxx::Ref_ptr<Device> const &dev, bool readonly,
+                         unsigned max_in_flight,
+                         L4Re::Util::Object_registry *registry)
+: _dev(dev), _readonly(readonly || dev->is_read_only()),
+  _max_in_flight(max_in_flight), _registry(registry), _kick(this),
+  _retry(this)
+{}
+
+Ring_client::~Ring_client()
+{
+  l4_size_t ss = _dev->sector_size();
+  for (auto const &b : _buffers)
+    _dev->dma_unmap(b.phys, b.size / ss,
+                    L4Re::Dma_space::Direction::Bidirectional);
+}
+
+void
+Ring_client::shutdown()
+{
+  trace.printf("Shutting down ring session (%u requests in flight).\n",
+               _in_flight);
+
+  if (_retry_pending)
+    server_iface()->remove_timeout(&_retry);
+  _retry_pending = false;
+  _shutdown = true;
+
+  while (!_queue.empty())
+    _queue.pop();
+
+  if (_ring.get())
+    _registry->unregister_obj(&_kick);
+  _registry->unregister_obj(this);
+}
+
+long
+Ring_client::op_info(Ahci_ring::Ring_block::Rights, l4_uint64_t &capacity,
+                     l4_uint32_t &sector_size, l4_uint32_t &max_size,
+                     l4_uint32_t &max_entries)
+{
+  capacity = _dev->capacity();
+  sector_size = _dev->sector_size();
+  max_size = _dev->max_size();
+  max_entries = Max_entries;
+
+  return L4_EOK;
+}
+
+long
+Ring_client::op_setup(Ahci_ring::Ring_block::Rights,
+                      L4::Ipc::Snd_fpage ring_fp, l4_uint32_t entries,
+                      L4::Ipc::Snd_fpage irq_fp, L4::Ipc::Cap<L4::Irq> &sq_irq)
+{
+  if (_ring.get())
+    return -L4_EEXIST;
+
+  if (!ring_fp.cap_received() || !irq_fp.cap_received())
+    return -L4_EINVAL;
+
+  L4Re::Util::Unique_cap<L4Re::Dataspace>
+    ds(server_iface()->template rcv_cap<L4Re::Dataspace>(0));
+  L4Re::Util::Unique_cap<L4::Irq>
+    irq(server_iface()->template rcv_cap<L4::Irq>(1));
+
+  long ret = server_iface()->realloc_rcv_cap(0);
+  if (ret >= 0)
+    ret = server_iface()->realloc_rcv_cap(1);
+  if (ret < 0)
+    return ret;
+
+  if (entries == 0 || entries > Max_entries || (entries & (entries - 1)))
+    {
+      Dbg::warn().printf("Ring size must be a power of two up to %d.\n",
+                         Max_entries);
+      return -L4_EINVAL;
+    }
+
+  l4_size_t sz = l4_round_page(Ahci_ring::Ring_header::size(entries));
+  if (ds->size() < sz)
+    return -L4_EINVAL;
+
+  ret = L4Re::Env::env()->rm()->attach(&_ring, sz,
+                                       L4Re::Rm::F::Search_addr
+                                       | L4Re::Rm::F::RW,
+                                       L4::Ipc::make_cap_rw(ds.get()), 0,
+                                       L4_PAGESHIFT);
+  if (ret < 0)
+    return ret;
+
+  auto kick = _registry->register_irq_obj(&_kick);
+  if (!kick.is_valid())
+    {
+      _ring.reset();
+      return -L4_ENOMEM;
+    }
+
+  _ring_ds = cxx::move(ds);
+  _cq_irq = cxx::move(irq);
+  _entries = entries;
+  sq_irq = L4::Ipc::make_cap(kick, L4_CAP_FPAGE_RO);
+
+  trace.printf("Ring with %u entries set up.\n", entries);
+
+  return L4_EOK;
+}
+
+long
+Ring_client::op_register_buffer(Ahci_ring::Ring_block::Rights,
+                                L4::Ipc::Snd_fpage ds_fp, l4_uint8_t &index)
+{
+  if (!ds_fp.cap_received())
+    return -L4_EINVAL;
+
+  L4Re::Util::Unique_cap<L4Re::Dataspace>
+    ds(server_iface()->template rcv_cap<L4Re::Dataspace>(0));
+
+  long ret = server_iface()->realloc_rcv_cap(0);
+  if (ret < 0)
+    return ret;
+
+  if (_buffers.size() >= Ahci_ring::Max_buffers)
+    return -L4_ENOMEM;
+
+  l4_size_t ss = _dev->sector_size();
+  l4_size_t size = ds->size();
+  if (size == 0 || size % ss)
+    return -L4_EINVAL;
+
+  Buffer buf;
+  buf.size = size;
+  try
+    {
+      buf.region = cxx::make_unique<Block_device::Mem_region>(0, size, 0,
+                                                              cxx::move(ds));
+    }
+  catch (L4::Runtime_error const &e)
+    {
+      Dbg::warn().printf("Cannot attach buffer: %s\n", e.str());
+      return e.err_no();
+    }
+
+  ret = _dev->dma_map(buf.region.get(), 0, size / ss,
+                      L4Re::Dma_space::Direction::Bidirectional, &buf.phys);
+  if (ret < 0)
+    return ret;
+
+  index = _buffers.size();
+  _buffers.push_back(cxx::move(buf));
+
+  return L4_EOK;
+}
+
+void
+Ring_client::process()
+{
+  if (_shutdown || !_ring.get())
+    return;
+
+  // Completions of requests that finish synchronously must not start
+  // new requests from within start_request().
+  if (_processing)
+    {
+      _reprocess = true;
+      return;
+    }
+
+  _processing = true;
+  do
+    {
+      _reprocess = false;
+      fetch_submissions();
+
+      while (!_queue.empty() && !_barrier_in_flight)
+        {
+          Ahci_ring::Sqe const &sqe = _queue.top().sqe;
+
+          if ((sqe.flags & Ahci_ring::Sqe_barrier) && _in_flight > 0)
+            break;
+
+          // every request in flight needs a free completion entry
+          if (_in_flight + cq_pending() >= _entries)
+            break;
+
+          if (_max_in_flight && _in_flight >= _max_in_flight)
+            break;
+
+          int ret = start_request(sqe);
+          if (ret == -L4_EBUSY)
+            {
+              // The device is occupied by other clients, so no completion
+              // of our own is going to restart processing.
+              if (_in_flight == 0 && !_retry_pending)
+                {
+                  _retry_pending = true;
+                  server_iface()->add_timeout(&_retry,
+                                              l4_kip_clock(l4re_kip())
+                                              + Retry_us);
+                }
+              break;
+            }
+
+          if (ret < 0)
+            complete(sqe.user_data, sqe.flags, ret);
+
+          _queue.pop();
+        }
+    }
+  while (_reprocess);
+  _processing = false;
+}
+
+void
+Ring_client::fetch_submissions()
+{
+  auto &sq = _ring->sq;
+  l4_uint32_t tail = __atomic_load_n(&sq.tail, __ATOMIC_ACQUIRE);
+  l4_uint32_t head = sq.head;
+
+  if (tail - head > _entries)
+    {
+      Dbg::warn().printf("Client error: bad submission queue index.\n");
+      return;
+    }
+
+  // Entries beyond what the session can work on stay in the submission
+  // queue, which keeps the client from submitting more than fits into it.
+  Ahci_ring::Sqe const *sqes = _ring->sqes();
+  for (; head != tail && _queue.size() + _in_flight < fetch_limit(); ++head)
+    _queue.push(Queued{sqes[head & (_entries - 1)], _seq++});
+
+  __atomic_store_n(&sq.head, head, __ATOMIC_RELEASE);
+}
+
+int
+Ring_client::start_request(Ahci_ring::Sqe const &sqe)
+{
+  L4Re::Dma_space::Direction dir;
+
+  switch (sqe.opcode)
+    {
+    case Ahci_ring::Op_read:
+      dir = L4Re::Dma_space::Direction::From_device;
+      break;
+    case Ahci_ring::Op_write:
+      if (_readonly)
+        return -L4_EPERM;
+      dir = L4Re::Dma_space::Direction::To_device;
+      break;
+    case Ahci_ring::Op_flush:
+      break;
+    default:
+      return -L4_EINVAL;
+    }
+
+  auto *req = new Inflight();
+  req->user_data = sqe.user_data;
+  req->flags = sqe.flags;
+
+  cxx::Ref_ptr<Ring_client> self(this);
+  auto cb = [self, req](int error, l4_size_t sz) { self->finish(req, error, sz); };
+
+  ++_in_flight;
+  if (sqe.flags & Ahci_ring::Sqe_barrier)
+    _barrier_in_flight = true;
+
+  int ret;
+  if (sqe.opcode == Ahci_ring::Op_flush)
+    ret = _dev->flush(cb);
+  else
+    {
+      l4_size_t ss = _dev->sector_size();
+      l4_uint64_t nsec = sqe.length / ss;
+      l4_uint64_t dev_sectors = _dev->capacity() / ss;
+
+      ret = -L4_EINVAL;
+      if (sqe.buffer < _buffers.size())
+        {
+          Buffer const &buf = _buffers[sqe.buffer];
+          if (sqe.length > 0 && sqe.length % ss == 0
+              && sqe.length <= _dev->max_size()
+              && sqe.offset <= buf.size && buf.size - sqe.offset >= sqe.length
+              && sqe.lba < dev_sectors && dev_sectors - sqe.lba >= nsec)
+            {
+              req->block.dma_addr = buf.phys + sqe.offset;
+              req->block.virt_addr
+                = buf.region->local(L4virtio::Ptr<void>(sqe.offset));
+              req->block.num_sectors = nsec;
+              ret = _dev->inout_data(sqe.lba, req->block, cb, dir);
+            }
+        }
+    }
+
+  if (ret < 0)
+    {
+      --_in_flight;
+      if (sqe.flags & Ahci_ring::Sqe_barrier)
+        _barrier_in_flight = false;
+      delete req;
+    }
+
+  return ret;
+}
+
+void
+Ring_client::finish(Inflight *req, int error, l4_size_t sz)
+{
+  --_in_flight;
+  if (req->flags & Ahci_ring::Sqe_barrier)
+    _barrier_in_flight = false;
+
+  complete(req->user_data, req->flags, error < 0 ? error : (int)sz);
+  delete req;
+
+  process();
+}
+
+void
+Ring_client::complete(l4_uint64_t user_data, l4_uint8_t flags, int result)
+{
+  if (_shutdown)
+    return;
+
+  auto &cq = _ring->cq;
+  l4_uint32_t tail = cq.tail;
+  bool caught_up = cxx::access_once(&cq.head) == tail;
+
+  Ahci_ring::Cqe *e = &_ring->cqes(_entries)[tail & (_entries - 1)];
+  e->user_data = user_data;
+  e->result = result;
+  e->reserved = 0;
+  __atomic_store_n(&cq.tail, tail + 1, __ATOMIC_RELEASE);
+
+  if (caught_up && !(flags & Ahci_ring::Sqe_no_notify)
+      && !(cxx::access_once(&cq.flags) & Ahci_ring::Cq_no_notify))
+    _cq_irq->trigger();
+}
+
+} // namespace Ahci
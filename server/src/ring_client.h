@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/cxx/ipc_timeout_queue>
+#include <l4/cxx/ref_ptr>
+#include <l4/cxx/unique_ptr>
+#include <l4/cxx/utils>
+#include <l4/re/rm>
+#include <l4/re/util/object_registry>
+#include <l4/re/util/unique_cap>
+#include <l4/ahci-driver/ring_block.h>
+
+#include <queue>
+#include <vector>
+
+#include "ahci_device.h"
+#include "debug.h"
+
+#include <l4/libblock-device/types.h>
+
+namespace Ahci {
+
+/**
+ * Server side of a native ring session.
+ *
+ * Requests are fetched from the submission queue into an internal queue
+ * ordered by priority and started on the device as long as it accepts
+ * them. See <l4/ahci-driver/ring_block.h> for the protocol.
+ *
+ * The object is reference counted because pending requests keep it alive
+ * after the client has gone away.
+ */
+class Ring_client
+: public L4::Epiface_t<Ring_client, Ahci_ring::Ring_block>,
+  public cxx::Ref_obj
+{
+  class Kick_irq : public L4::Irqep_t<Kick_irq>
+  {
+  public:
+    explicit Kick_irq(Ring_client *client) : _client(client) {}
+
+    void handle_irq()
+    { _client->process(); }
+
+  private:
+    Ring_client *_client;
+  };
+
+  class Retry_timeout : public L4::Ipc_svr::Timeout_queue::Timeout
+  {
+  public:
+    explicit Retry_timeout(Ring_client *client) : _client(client) {}
+
+    void expired() override
+    {
+      _client->_retry_pending = false;
+      _client->process();
+    }
+
+  private:
+    Ring_client *_client;
+  };
+
+  struct Buffer
+  {
+    cxx::unique_ptr<Block_device::Mem_region> region;
+    L4Re::Dma_space::Dma_addr phys;
+    l4_size_t size;
+  };
+
+  struct Queued
+  {
+    Ahci_ring::Sqe sqe;
+    unsigned long seq;
+
+    bool operator < (Queued const &o) const
+    {
+      // std::priority_queue returns the largest element first
+      if (sqe.priority != o.sqe.priority)
+        return sqe.priority > o.sqe.priority;
+      return seq > o.seq;
+    }
+  };
+
+  struct Inflight
+  {
+    l4_uint64_t user_data;
+    l4_uint8_t flags;
+    Block_device::Inout_block block;
+  };
+
+public:
+  enum
+  {
+    /// Maximum number of entries of the submission and completion queue.
+    Max_entries = 1024,
+    /// Time to wait before retrying when the device is busy.
+    Retry_us = 100,
+  };
+
+  /**
+   * Create a ring session.
+   *
+   * \param dev            Device the session works on.
+   * \param readonly       Reject writes.
+   * \param max_in_flight  Maximum number of requests of the session in
+   *                       flight, 0 for no limit beyond the ring size.
+   * \param registry       Registry the session and its IRQ are registered
+   *                       with.
+   */
+  Ring_client(cxx::Ref_ptr<Device> const &dev, bool readonly,
+              unsigned max_in_flight,
+              L4Re::Util::Object_registry *registry);
+
+  ~Ring_client();
+
+  /**
+   * Detach the session from the server loop.
+   *
+   * Requests still in flight finish in the background.
+   */
+  void shutdown();
+
+  long op_info(Ahci_ring::Ring_block::Rights, l4_uint64_t &capacity,
+               l4_uint32_t &sector_size, l4_uint32_t &max_size,
+               l4_uint32_t &max_entries);
+
+  long op_setup(Ahci_ring::Ring_block::Rights, L4::Ipc::Snd_fpage ring_fp,
+                l4_uint32_t entries, L4::Ipc::Snd_fpage irq_fp,
+                L4::Ipc::Cap<L4::Irq> &sq_irq);
+
+  long op_register_buffer(Ahci_ring::Ring_block::Rights,
+                          L4::Ipc::Snd_fpage ds_fp, l4_uint8_t &index);
+
+private:
+  /// Fetch new submissions and start as many requests as possible.
+  void process();
+
+  void fetch_submissions();
+  int start_request(Ahci_ring::Sqe const &sqe);
+  void finish(Inflight *req, int error, l4_size_t sz);
+  void complete(l4_uint64_t user_data, l4_uint8_t flags, int result);
+
+  /// Number of requests fetched from the submission queue at most.
+  l4_uint32_t fetch_limit() const
+  {
+    return _max_in_flight ? cxx::min<l4_uint32_t>(_entries, _max_in_flight)
+                          : _entries;
+  }
+
+  /// Number of completion entries not yet consumed by the client.
+  l4_uint32_t cq_pending() const
+  { return _ring->cq.tail - cxx::access_once(&_ring->cq.head); }
+
+  cxx::Ref_ptr<Device> _dev;
+  bool _readonly;
+  unsigned _max_in_flight;
+  L4Re::Util::Object_registry *_registry;
+
+  Kick_irq _kick;
+  Retry_timeout _retry;
+  bool _retry_pending = false;
+  bool _shutdown = false;
+  bool _processing = false;
+  bool _reprocess = false;
+
+  L4Re::Util::Unique_cap<L4Re::Dataspace> _ring_ds;
+  L4Re::Rm::Unique_region<Ahci_ring::Ring_header *> _ring;
+  L4Re::Util::Unique_cap<L4::Irq> _cq_irq;
+  l4_uint32_t _entries = 0;
+
+  std::vector<Buffer> _buffers;
+  std::priority_queue<Queued> _queue;
+  unsigned long _seq = 0;
+  unsigned _in_flight = 0;
+  bool _barrier_in_flight = false;
+};
+
+} // namespace Ahci
@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <memory>
+
+#include <l4/libblock-device/errand.h>
+
+#include "ahci_device.h"
+#include "block_list.h"
+
+namespace Ahci {
+
+/**
+ * View of a device for a client that shares it with other writers.
+ *
+ * Every request locks its sector range in the range lock of the underlying
+ * device for as long as it is in flight. Requests that conflict with a
+ * request of this or another shared-write client are accepted, but only
+ * issued once the conflicting requests have completed. Clients that do not
+ * use shared-write mode bypass the lock, so all clients writing to a
+ * shared device must use it.
+ *
+ * Discards are forwarded if the underlying device supports them and lock
+ * the range from their first to their last sector like a write.
+ */
+class Shared_write_device
+: public Device,
+  public Block_device::Device_discard_feature
+{
+  enum
+  {
+    /// Time to back off when a delayed request finds the device busy.
+    Retry_us = 1000,
+  };
+
+public:
+  explicit Shared_write_device(cxx::Ref_ptr<Device> const &dev)
+  : _dev(dev)
+  {}
+
+  Block_device::Notification_domain const *notification_domain() const override
+  { return _dev->notification_domain(); }
+
+  bool is_read_only() const override
+  { return _dev->is_read_only(); }
+
+  bool match_hid(cxx::String const &hid) const override
+  { return _dev->match_hid(hid); }
+
+  l4_uint64_t capacity() const override
+  { return _dev->capacity(); }
+
+  l4_size_t sector_size() const override
+  { return _dev->sector_size(); }
+
+  l4_size_t max_size() const override
+  { return _dev->max_size(); }
+
+  unsigned max_segments() const override
+  { return _dev->max_segments(); }
+
+  unsigned max_in_flight() const override
+  { return _dev->max_in_flight(); }
+
+  std::string const &hid() const override
+  { return _dev->hid(); }
+
+  l4_uint64_t start_sector() const override
+  { return _dev->start_sector(); }
+
+  void reset() override
+  { _dev->reset(); }
+
+  int dma_map(Block_device::Mem_region *region, l4_addr_t offset,
+              l4_size_t num_sectors, L4Re::Dma_space::Direction dir,
+              L4Re::Dma_space::Dma_addr *phys) override
+  { return _dev->dma_map(region, offset, num_sectors, dir, phys); }
+
+  int dma_unmap(L4Re::Dma_space::Dma_addr phys, l4_size_t num_sectors,
+                L4Re::Dma_space::Direction dir) override
+  { return _dev->dma_unmap(phys, num_sectors, dir); }
+
+  int inout_data(l4_uint64_t sector, Block_device::Inout_block const &blocks,
+                 Block_device::Inout_callback const &cb,
+                 L4Re::Dma_space::Direction dir) override
+  {
+    l4_uint64_t count = block_list_sectors(blocks);
+    l4_uint64_t end = sector + count;
+    bool write = dir == L4Re::Dma_space::Direction::To_device;
+    cxx::Ref_ptr<Device> dev = _dev;
+
+    if (dev->range_lock().try_lock(sector, end, write))
+      {
+        int ret = dev->inout_data(sector, blocks,
+                                  [dev, sector, end, write, cb](int error,
+                                                                l4_size_t sz)
+                                    {
+                                      dev->range_lock().unlock(sector, end,
+                                                               write);
+                                      cb(error, sz);
+                                    }, dir);
+        if (ret < 0)
+          dev->range_lock().unlock(sector, end, write);
+
+        return ret;
+      }
+
+    // The block list of the client is gone by the time the range is
+    // granted, so issue a copy.
+    auto copy = std::make_shared<Block_device::Inout_block>();
+    slice_blocks(copy.get(), blocks, 0, count, dev->sector_size());
+
+    dev->range_lock().wait(sector, end, write,
+                           [dev, sector, copy, cb, dir]()
+                             { issue(dev, sector, copy, cb, dir); });
+    return L4_EOK;
+  }
+
+  int flush(Block_device::Inout_callback const &cb) override
+  { return _dev->flush(cb); }
+
+  void start_device_scan(Block_device::Errand::Callback const &callback) override
+  { callback(); }
+
+  Discard_info discard_info() const override
+  {
+    auto const *dd = discard_dev(_dev);
+    return dd ? dd->discard_info() : Discard_info();
+  }
+
+  int discard(l4_uint64_t offset, Block_device::Inout_block const &blocks,
+              Block_device::Inout_callback const &cb, bool discard) override
+  {
+    auto *dd = discard_dev(_dev);
+    if (!dd)
+      return -L4_ENOSYS;
+
+    l4_uint64_t start, end;
+    discard_range(offset, blocks, &start, &end);
+    cxx::Ref_ptr<Device> dev = _dev;
+
+    if (dev->range_lock().try_lock(start, end, true))
+      {
+        int ret = dd->discard(offset, blocks,
+                              [dev, start, end, cb](int error, l4_size_t sz)
+                                {
+                                  dev->range_lock().unlock(start, end, true);
+                                  cb(error, sz);
+                                }, discard);
+        if (ret < 0)
+          dev->range_lock().unlock(start, end, true);
+
+        return ret;
+      }
+
+    auto copy = std::make_shared<Block_device::Inout_block>();
+    Block_device::Inout_block *out = copy.get();
+    for (auto const *in = &blocks; in; in = in->next.get())
+      {
+        out->sector = in->sector;
+        out->num_sectors = in->num_sectors;
+        if (in->next)
+          {
+            out->next = cxx::make_unique<Block_device::Inout_block>();
+            out = out->next.get();
+          }
+      }
+
+    dev->range_lock().wait(start, end, true,
+                           [dev, offset, copy, cb, discard]()
+                             { issue_discard(dev, offset, copy, cb, discard); });
+    return L4_EOK;
+  }
+
+private:
+  static Block_device::Device_discard_feature *
+  discard_dev(cxx::Ref_ptr<Device> const &dev)
+  { return dynamic_cast<Block_device::Device_discard_feature *>(dev.get()); }
+
+  /// Compute the sector range [start, end) covered by a discard.
+  static void discard_range(l4_uint64_t offset,
+                            Block_device::Inout_block const &blocks,
+                            l4_uint64_t *start, l4_uint64_t *end)
+  {
+    *start = ~0ULL;
+    *end = 0;
+    for (auto const *b = &blocks; b; b = b->next.get())
+      {
+        *start = cxx::min(*start, offset + b->sector);
+        *end = cxx::max(*end, offset + b->sector + b->num_sectors);
+      }
+  }
+
+  /// Issue a discard whose range has been granted after waiting.
+  static void
+  issue_discard(cxx::Ref_ptr<Device> const &dev, l4_uint64_t offset,
+                std::shared_ptr<Block_device::Inout_block> const &blocks,
+                Block_device::Inout_callback const &cb, bool discard)
+  {
+    l4_uint64_t start, end;
+    discard_range(offset, *blocks, &start, &end);
+
+    int ret = discard_dev(dev)->discard(offset, *blocks,
+                                        [dev, start, end, cb](int error,
+                                                              l4_size_t sz)
+                                          {
+                                            dev->range_lock().unlock(start, end,
+                                                                     true);
+                                            cb(error, sz);
+                                          }, discard);
+    if (ret == -L4_EBUSY)
+      Block_device::Errand::schedule([dev, offset, blocks, cb, discard]()
+                                       {
+                                         issue_discard(dev, offset, blocks, cb,
+                                                       discard);
+                                       },
+                                     Retry_us);
+    else if (ret < 0)
+      {
+        dev->range_lock().unlock(start, end, true);
+        cb(ret, 0);
+      }
+  }
+
+  /// Issue a request whose range has been granted after waiting.
+  static void issue(cxx::Ref_ptr<Device> const &dev, l4_uint64_t sector,
+                    std::shared_ptr<Block_device::Inout_block> const &blocks,
+                    Block_device::Inout_callback const &cb,
+                    L4Re::Dma_space::Direction dir)
+  {
+    l4_uint64_t end = sector + block_list_sectors(*blocks);
+    bool write = dir == L4Re::Dma_space::Direction::To_device;
+
+    int ret = dev->inout_data(sector, *blocks,
+                              [dev, sector, end, write, cb](int error,
+                                                            l4_size_t sz)
+                                {
+                                  dev->range_lock().unlock(sector, end, write);
+                                  cb(error, sz);
+                                }, dir);
+    if (ret == -L4_EBUSY)
+      // The request has already been accepted, so it cannot be handed back
+      // to the client.
+      Block_device::Errand::schedule([dev, sector, blocks, cb, dir]()
+                                       { issue(dev, sector, blocks, cb, dir); },
+                                     Retry_us);
+    else if (ret < 0)
+      {
+        dev->range_lock().unlock(sector, end, write);
+        cb(ret, 0);
+      }
+  }
+
+  cxx::Ref_ptr<Device> _dev;
+};
+
+} // namespace Ahci
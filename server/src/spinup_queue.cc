@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include <l4/libblock-device/errand.h>
+
+#include "spinup_queue.h"
+
+static Dbg trace(Dbg::Trace, "spinup");
+
+namespace Ahci {
+
+unsigned Spinup_queue::max_concurrent = 0;
+
+Spinup_queue &
+Spinup_queue::get()
+{
+  static Spinup_queue queue;
+  return queue;
+}
+
+void
+Spinup_queue::acquire(Grant const &grant)
+{
+  if (!max_concurrent || _active < max_concurrent)
+    {
+      ++_active;
+      ++_spinups;
+      if (_active > _max_active)
+        _max_active = _active;
+      _wait.record(0);
+      grant();
+      return;
+    }
+
+  _waiting.push_back({grant, now()});
+  if (_waiting.size() > _max_waiting)
+    _max_waiting = _waiting.size();
+  trace.printf("Spin-up delayed, %zu disks waiting.\n", _waiting.size());
+}
+
+void
+Spinup_queue::release()
+{
+  if (_waiting.empty())
+    {
+      --_active;
+      return;
+    }
+
+  // The slot passes on to the next disk directly.
+  Waiter w = _waiting.front();
+  _waiting.pop_front();
+  ++_spinups;
+  _wait.record(now() - w.since);
+
+  // Releases happen in completion handlers of the disk, so start the
+  // next spin-up from an errand.
+  Block_device::Errand::schedule(w.grant, 0);
+}
+
+void
+Spinup_queue::dump_stats(Dbg const &log) const
+{
+  if (!_spinups)
+    return;
+
+  log.printf("spin-up: %llu disks, limit %u, max %u at once, %u spinning, "
+             "%zu waiting (max %u), wait",
+             _spinups, max_concurrent, _max_active, _active, _waiting.size(),
+             _max_waiting);
+  _wait.dump(log);
+}
+
+} // namespace Ahci
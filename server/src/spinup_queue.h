@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <functional>
+#include <list>
+
+#include <l4/sys/kip.h>
+
+#include "stats.h"
+
+namespace Ahci {
+
+/**
+ * Limit on the number of disks spinning up at the same time.
+ *
+ * A disk takes a slot before its spin-up is triggered and returns it once
+ * it reports to be ready. Disks that do not get a slot right away are
+ * granted one in the order they asked for it. The queue is shared by all
+ * HBAs, as they usually share the power supply.
+ */
+class Spinup_queue : public Stats_provider
+{
+  struct Waiter
+  {
+    std::function<void()> grant;
+    l4_kernel_clock_t since;
+  };
+
+public:
+  using Grant = std::function<void()>;
+
+  /// Maximum number of disks spinning up at the same time, 0 for no limit.
+  static unsigned max_concurrent;
+
+  /// Return the queue of the driver.
+  static Spinup_queue &get();
+
+  /**
+   * Take a slot for spinning up a disk.
+   *
+   * \param grant  Called once a slot is available, right away if there is
+   *               a free one.
+   */
+  void acquire(Grant const &grant);
+
+  /// Return a slot taken with acquire().
+  void release();
+
+  void dump_stats(Dbg const &log) const override;
+
+private:
+  static l4_kernel_clock_t now()
+  { return l4_kip_clock(l4re_kip()); }
+
+  unsigned _active = 0;
+  std::list<Waiter> _waiting;
+
+  l4_uint64_t _spinups = 0;
+  unsigned _max_active = 0;
+  unsigned _max_waiting = 0;
+  Latency_histogram _wait;
+};
+
+} // namespace Ahci
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include "stats.h"
+
+#include <l4/libblock-device/errand.h>
+
+namespace Ahci {
+
+Stats_provider::Provider_list Stats_provider::_providers;
+
+void
+Stats_provider::dump_all()
+{
+  Dbg log(Dbg::Stats, "stats");
+
+  log.printf("--- statistics ---\n");
+  for (auto const *p : _providers)
+    p->dump_stats(log);
+}
+
+void
+Stats_provider::start_reporting(unsigned interval_ms)
+{
+  Block_device::Errand::schedule(
+    [=]()
+      {
+        dump_all();
+        start_reporting(interval_ms);
+      }, interval_ms * 1000);
+}
+
+void
+Latency_histogram::dump(Dbg const &log) const
+{
+  log.cprintf(" %llu, avg %llu us, max %llu us", _total,
+              _total ? _sum_us / _total : 0, _max_us);
+  for (unsigned c = 0; c < Classes - 1; ++c)
+    if (_counts[c])
+      log.cprintf(" <%lluus:%llu", 2ULL << c, _counts[c]);
+  if (_counts[Classes - 1])
+    log.cprintf(" >=%lluus:%llu", 1ULL << (Classes - 1), _counts[Classes - 1]);
+  log.cprintf("\n");
+}
+
+} // namespace Ahci
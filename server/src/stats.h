@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <l4/cxx/hlist>
+#include <l4/sys/l4int.h>
+
+#include "debug.h"
+
+namespace Ahci {
+
+/**
+ * Object that contributes to the runtime statistics report.
+ *
+ * Providers register themselves on construction and are removed
+ * from the report when they are destroyed.
+ */
+class Stats_provider : public cxx::H_list_item_t<Stats_provider>
+{
+public:
+  Stats_provider() { _providers.push_front(this); }
+  virtual ~Stats_provider() { Provider_list::remove(this); }
+
+  Stats_provider(Stats_provider const &) = delete;
+  Stats_provider &operator = (Stats_provider const &) = delete;
+
+  /**
+   * Write the current statistics of the object to the given log.
+   */
+  virtual void dump_stats(Dbg const &log) const = 0;
+
+  /**
+   * Write the statistics of all registered providers to the log.
+   */
+  static void dump_all();
+
+  /**
+   * Start periodic reporting of all statistics.
+   *
+   * \param interval_ms  Reporting interval in milliseconds.
+   */
+  static void start_reporting(unsigned interval_ms);
+
+private:
+  typedef cxx::H_list_t<Stats_provider> Provider_list;
+  static Provider_list _providers;
+};
+
+/**
+ * Return a percentage of `part` in `total` suitable for reporting.
+ */
+inline unsigned
+stats_percent(unsigned long long part, unsigned long long total)
+{ return total ? (part * 100) / total : 0; }
+
+/**
+ * Histogram of latencies in power-of-two microsecond classes.
+ */
+class Latency_histogram
+{
+public:
+  enum
+  {
+    /// Number of classes, the last one collects everything above 2^19 us.
+    Classes = 20,
+  };
+
+  void record(l4_uint64_t us)
+  {
+    unsigned c = 0;
+    while (c < Classes - 1 && (us >> (c + 1)))
+      ++c;
+
+    ++_counts[c];
+    ++_total;
+    _sum_us += us;
+    if (us > _max_us)
+      _max_us = us;
+  }
+
+  l4_uint64_t total() const
+  { return _total; }
+
+  l4_uint64_t sum_us() const
+  { return _sum_us; }
+
+  /**
+   * Append the histogram to the current line of the log and end the line.
+   */
+  void dump(Dbg const &log) const;
+
+private:
+  l4_uint64_t _counts[Classes] = { 0 };
+  l4_uint64_t _total = 0;
+  l4_uint64_t _sum_us = 0;
+  l4_uint64_t _max_us = 0;
+};
+
+} // namespace Ahci
@@ -0,0 +1,676 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include <l4/cxx/minmax>
+
+#include <l4/libblock-device/errand.h>
+
+#include "block_list.h"
+#include "thin_pool.h"
+
+static Dbg trace(Dbg::Trace, "thin");
+
+namespace Ahci {
+
+static char const Pool_magic[8] = { 'A', 'H', 'C', 'I', 'T', 'H', 'I', 'N' };
+
+Thin_pool::~Thin_pool()
+{
+  if (_meta_phys)
+    _dev->dma_unmap(_meta_phys, _data_sector,
+                    L4Re::Dma_space::Direction::Bidirectional);
+  if (_zero_phys)
+    _dev->dma_unmap(_zero_phys, _extent_sectors,
+                    L4Re::Dma_space::Direction::Bidirectional);
+}
+
+long
+Thin_pool::compute_layout()
+{
+  _sector_size = _dev->sector_size();
+  if (Extent_bytes % _sector_size || Header_bytes % _sector_size)
+    return -L4_EINVAL;
+
+  _extent_sectors = Extent_bytes / _sector_size;
+  _map_sector = Header_bytes / _sector_size;
+
+  l4_uint64_t total = _dev->capacity() / _sector_size;
+  if (total <= _map_sector + _extent_sectors)
+    return -L4_ENOSPC;
+
+  // Size the map for the extents that would fit without it. The extents
+  // remaining after the map always fit into that map.
+  l4_uint64_t n = (total - _map_sector) / _extent_sectors;
+  l4_uint64_t map_sectors = (n * sizeof(l4_uint64_t) + _sector_size - 1)
+                            / _sector_size;
+  _data_sector = (_map_sector + map_sectors + _extent_sectors - 1)
+                 / _extent_sectors * _extent_sectors;
+  if (_data_sector >= total)
+    return -L4_ENOSPC;
+
+  _num_extents = (total - _data_sector) / _extent_sectors;
+  return _num_extents ? L4_EOK : -L4_ENOSPC;
+}
+
+long
+Thin_pool::alloc_buffer(l4_size_t size,
+                        cxx::unique_ptr<Block_device::Mem_region> *region,
+                        L4Re::Dma_space::Dma_addr *phys, char **virt)
+{
+  char *local;
+  long ret = alloc_io_buffer(size, region, virt ? virt : &local);
+  if (ret < 0)
+    return ret;
+
+  ret = _dev->dma_map(region->get(), 0, size / _sector_size,
+                      L4Re::Dma_space::Direction::Bidirectional, phys);
+  if (ret < 0)
+    *phys = 0;
+
+  return ret;
+}
+
+void
+Thin_pool::load(Block_device::Errand::Callback const &callback)
+{
+  _load_cb = callback;
+
+  // The metadata buffer holds header and map, the zero buffer is the
+  // source for zeroing new extents. Fresh memory is zero-filled.
+  long ret = compute_layout();
+  if (ret >= 0)
+    ret = alloc_buffer(_data_sector * _sector_size, &_meta, &_meta_phys,
+                       &_meta_virt);
+  if (ret >= 0)
+    ret = alloc_buffer(Extent_bytes, &_zero, &_zero_phys, nullptr);
+
+  if (ret < 0)
+    {
+      load_done(ret);
+      return;
+    }
+
+  meta_io(0, _map_sector, L4Re::Dma_space::Direction::From_device,
+          [this](int error)
+    {
+      if (error < 0)
+        {
+          load_done(error);
+          return;
+        }
+
+      Header const *h = header();
+      if (memcmp(h->magic, Pool_magic, sizeof(Pool_magic)) != 0)
+        {
+          if (!_create)
+            {
+              Err().printf("No thin pool found on %s.\n",
+                           _dev->hid().c_str());
+              load_done(-L4_EINVAL);
+            }
+          else
+            format();
+          return;
+        }
+
+      if (h->version != 1 || h->extent_sectors != _extent_sectors
+          || h->num_extents != _num_extents || h->map_sector != _map_sector
+          || h->data_sector != _data_sector || h->num_volumes > Max_volumes)
+        {
+          Err().printf("Thin pool on %s does not match the device layout.\n",
+                       _dev->hid().c_str());
+          load_done(-L4_EINVAL);
+          return;
+        }
+
+      meta_io(_map_sector, _data_sector - _map_sector,
+              L4Re::Dma_space::Direction::From_device,
+              [this](int error)
+                {
+                  if (error < 0)
+                    load_done(error);
+                  else
+                    finish_load(false);
+                });
+    });
+}
+
+void
+Thin_pool::format()
+{
+  Dbg::info().printf("Creating thin pool with %llu extents on %s.\n",
+                     _num_extents, _dev->hid().c_str());
+
+  // The map part of the buffer has not been read and is still zero.
+  memset(_meta_virt, 0, Header_bytes);
+  Header *h = header();
+  memcpy(h->magic, Pool_magic, sizeof(Pool_magic));
+  h->version = 1;
+  h->extent_sectors = _extent_sectors;
+  h->num_extents = _num_extents;
+  h->map_sector = _map_sector;
+  h->data_sector = _data_sector;
+
+  // The empty map must be on the disk before the header declares the pool.
+  meta_io(_map_sector, _data_sector - _map_sector,
+          L4Re::Dma_space::Direction::To_device,
+          [this](int error)
+            {
+              if (error < 0)
+                load_done(error);
+              else
+                finish_load(true);
+            });
+}
+
+void
+Thin_pool::finish_load(bool write_header)
+{
+  if (setup_volumes())
+    write_header = true;
+
+  if (!write_header)
+    {
+      load_done(L4_EOK);
+      return;
+    }
+
+  meta_io(0, _map_sector, L4Re::Dma_space::Direction::To_device,
+          [this](int error) { load_done(error); });
+}
+
+bool
+Thin_pool::setup_volumes()
+{
+  Header *h = header();
+  bool changed = false;
+
+  for (auto const &r : _requested)
+    {
+      unsigned i;
+      for (i = 0; i < h->num_volumes; ++i)
+        if (strncmp(h->volumes[i].name, r.name.c_str(),
+                    sizeof(h->volumes[i].name)) == 0)
+          break;
+
+      l4_uint64_t sectors = r.size / _sector_size;
+      if (i < h->num_volumes)
+        {
+          if (h->volumes[i].sectors != sectors)
+            Dbg::warn().printf("Thin volume %s keeps its size of %llu MiB.\n",
+                               r.name.c_str(),
+                               (h->volumes[i].sectors * _sector_size) >> 20);
+          continue;
+        }
+
+      if (h->num_volumes >= Max_volumes
+          || r.name.length() >= sizeof(h->volumes[i].name) || !sectors)
+        {
+          Dbg::warn().printf("Cannot add thin volume %s.\n", r.name.c_str());
+          continue;
+        }
+
+      Volume_entry &v = h->volumes[h->num_volumes++];
+      memset(v.name, 0, sizeof(v.name));
+      memcpy(v.name, r.name.c_str(), r.name.length());
+      v.sectors = sectors;
+      changed = true;
+    }
+
+  _state.resize(h->num_volumes);
+  for (unsigned i = 0; i < h->num_volumes; ++i)
+    _state[i].extents.resize((h->volumes[i].sectors + _extent_sectors - 1)
+                             / _extent_sectors);
+
+  // Rebuild the per-volume extent tables from the allocation map.
+  l4_uint64_t const *m = map();
+  for (l4_uint64_t pext = 0; pext < _num_extents; ++pext)
+    {
+      if (!m[pext])
+        continue;
+
+      ++_used;
+      unsigned vol = (m[pext] >> Entry_extent_bits) - 1;
+      l4_uint64_t vext = m[pext] & ((1ULL << Entry_extent_bits) - 1);
+      if (vol >= _state.size() || vext >= _state[vol].extents.size()
+          || _state[vol].extents[vext])
+        {
+          Dbg::warn().printf("Thin pool extent %llu has an invalid map entry.\n",
+                             pext);
+          continue;
+        }
+
+      _state[vol].extents[vext] = pext + 1;
+      ++_state[vol].allocated;
+    }
+
+  for (unsigned i = 0; i < h->num_volumes; ++i)
+    {
+      Volume_entry const &v = h->volumes[i];
+      std::string name(v.name, strnlen(v.name, sizeof(v.name)));
+      _volumes.push_back(cxx::make_ref_obj<Thin_volume>(this, i, name,
+                                                        v.sectors));
+    }
+
+  return changed;
+}
+
+void
+Thin_pool::load_done(int error)
+{
+  if (error < 0)
+    {
+      Err().printf("Thin pool on %s not available: %d\n",
+                   _dev->hid().c_str(), error);
+      _volumes.clear();
+      _state.clear();
+    }
+  else
+    Dbg::info().printf("Thin pool on %s: %zu volumes, %llu of %llu extents "
+                       "used.\n", _dev->hid().c_str(), _volumes.size(),
+                       _used, _num_extents);
+
+  _load_cb();
+}
+
+void
+Thin_pool::meta_io(l4_uint64_t sector, l4_uint64_t count,
+                   L4Re::Dma_space::Direction dir, Io_done const &done)
+{
+  submit_io(_dev, sector, _meta_phys + sector * _sector_size,
+            _meta_virt + sector * _sector_size, count, dir, done);
+}
+
+void
+Thin_pool::write_map_entry(l4_uint64_t pext, Io_done const &done)
+{
+  meta_io(_map_sector + pext * sizeof(l4_uint64_t) / _sector_size, 1,
+          L4Re::Dma_space::Direction::To_device, done);
+}
+
+bool
+Thin_pool::is_allocating(unsigned volume, l4_uint64_t vext) const
+{
+  for (auto const &a : _allocating)
+    if (a.volume == volume && a.vext == vext)
+      return true;
+
+  return false;
+}
+
+bool
+Thin_pool::is_reserved(l4_uint64_t pext) const
+{
+  // Not yet in the map while it is being allocated and still in the map on
+  // the disk while it is being freed.
+  for (auto const &a : _allocating)
+    if (a.pext == pext)
+      return true;
+
+  for (auto const &f : _freeing)
+    if (f.pext == pext)
+      return true;
+
+  return false;
+}
+
+l4_uint64_t
+Thin_pool::find_free_extent()
+{
+  if (_used >= _num_extents)
+    return ~0ULL;
+
+  l4_uint64_t const *m = map();
+  for (l4_uint64_t i = 0; i < _num_extents; ++i)
+    {
+      l4_uint64_t pext = (_next_free + i) % _num_extents;
+      if (m[pext] || is_reserved(pext))
+        continue;
+
+      _next_free = pext + 1;
+      return pext;
+    }
+
+  return ~0ULL;
+}
+
+int
+Thin_pool::inout_data(unsigned volume, l4_uint64_t sector,
+                      Block_device::Inout_block const &blocks,
+                      Block_device::Inout_callback const &cb,
+                      L4Re::Dma_space::Direction dir)
+{
+  l4_uint64_t count = block_list_sectors(blocks);
+  l4_uint64_t sectors = header()->volumes[volume].sectors;
+  if (sector > sectors || count > sectors - sector)
+    return -L4_EINVAL;
+
+  auto req = std::make_shared<Request>();
+  req->cb = cb;
+  req->volume = volume;
+
+  // Split the request at extent boundaries. The request holds one
+  // reference of its own until all pieces have been started.
+  for (l4_uint64_t skip = 0; skip < count;)
+    {
+      l4_uint64_t pos = sector + skip;
+      l4_uint64_t offset = pos % _extent_sectors;
+      l4_uint64_t n = cxx::min(count - skip, _extent_sectors - offset);
+
+      int ret = start_piece(req, pos / _extent_sectors, offset, n, blocks,
+                            skip, dir);
+      if (ret < 0)
+        {
+          // Pieces already in flight finish without completing the request,
+          // the client sees the error instead.
+          req->abandoned = true;
+          return ret;
+        }
+
+      skip += n;
+    }
+
+  req->piece_done(L4_EOK, 0);
+  return L4_EOK;
+}
+
+int
+Thin_pool::start_piece(std::shared_ptr<Request> const &req, l4_uint64_t vext,
+                       l4_uint64_t offset, l4_uint64_t count,
+                       Block_device::Inout_block const &blocks,
+                       l4_uint64_t skip, L4Re::Dma_space::Direction dir)
+{
+  Volume_state &vs = _state[req->volume];
+  l4_uint64_t pext = vs.extents[vext];
+
+  if (!pext && dir == L4Re::Dma_space::Direction::To_device)
+    {
+      // Concurrent first writes to an extent would allocate it twice.
+      if (is_allocating(req->volume, vext))
+        return -L4_EBUSY;
+
+      return allocate(req, vext, offset, count, blocks, skip);
+    }
+
+  Block_device::Inout_block piece;
+  slice_blocks(&piece, blocks, skip, count, _sector_size);
+
+  if (!pext)
+    {
+      // Unallocated extents read as zeros.
+      for (auto const *b = &piece; b; b = b->next.get())
+        {
+          if (!b->virt_addr)
+            return -L4_EINVAL;
+          memset(b->virt_addr, 0, b->num_sectors * _sector_size);
+        }
+
+      req->bytes += count * _sector_size;
+      ++_zero_reads;
+      return L4_EOK;
+    }
+
+  ++req->pending;
+  int ret = _dev->inout_data(data_sector(pext - 1) + offset, piece,
+                             [this, req](int error, l4_size_t size)
+                               {
+                                 --_state[req->volume].in_flight;
+                                 req->piece_done(error, size);
+                               }, dir);
+  if (ret < 0)
+    --req->pending;
+  else
+    ++vs.in_flight;
+
+  return ret;
+}
+
+int
+Thin_pool::allocate(std::shared_ptr<Request> const &req, l4_uint64_t vext,
+                    l4_uint64_t offset, l4_uint64_t count,
+                    Block_device::Inout_block const &blocks, l4_uint64_t skip)
+{
+  l4_uint64_t pext = find_free_extent();
+  if (pext == ~0ULL)
+    {
+      Dbg::warn().printf("Thin pool on %s is full.\n", _dev->hid().c_str());
+      return -L4_ENOSPC;
+    }
+
+  auto op = std::make_shared<Alloc_op>();
+  op->req = req;
+  op->volume = req->volume;
+  op->vext = vext;
+  op->pext = pext;
+  op->offset = offset;
+  op->count = count;
+  // The data is written after zeroing, so keep a copy of the block list.
+  slice_blocks(&op->blocks, blocks, skip, count, _sector_size);
+
+  _allocating.push_back({op->volume, vext, pext});
+  ++_used;
+  ++req->pending;
+  ++_state[op->volume].in_flight;
+
+  trace.printf("Allocating extent %llu for extent %llu of volume %u.\n",
+               pext, vext, op->volume);
+
+  if (offset == 0 && count == _extent_sectors)
+    write_alloc_data(op);
+  else
+    // The zero buffer covers a whole extent.
+    submit_io(_dev, data_sector(pext), _zero_phys, nullptr, _extent_sectors,
+              L4Re::Dma_space::Direction::To_device,
+              [this, op](int error)
+                {
+                  if (error < 0)
+                    finish_alloc(op, error, 0);
+                  else
+                    write_alloc_data(op);
+                });
+
+  return L4_EOK;
+}
+
+void
+Thin_pool::write_alloc_data(std::shared_ptr<Alloc_op> const &op)
+{
+  int ret = _dev->inout_data(data_sector(op->pext) + op->offset, op->blocks,
+                             [this, op](int error, l4_size_t size)
+                               {
+                                 if (error < 0)
+                                   {
+                                     finish_alloc(op, error, 0);
+                                     return;
+                                   }
+
+                                 // The data must be on the disk before the
+                                 // map entry, which may otherwise expose
+                                 // the previous content of the extent after
+                                 // a crash.
+                                 flush_io(_dev, [this, op, size](int error)
+                                   {
+                                     if (error < 0)
+                                       finish_alloc(op, error, 0);
+                                     else
+                                       commit_alloc(op, size);
+                                   });
+                               },
+                             L4Re::Dma_space::Direction::To_device);
+  if (ret == -L4_EBUSY)
+    Block_device::Errand::schedule([this, op]() { write_alloc_data(op); },
+                                   Io_retry_us);
+  else if (ret < 0)
+    finish_alloc(op, ret, 0);
+}
+
+void
+Thin_pool::commit_alloc(std::shared_ptr<Alloc_op> const &op, l4_size_t bytes)
+{
+  map()[op->pext] = (l4_uint64_t(op->volume + 1) << Entry_extent_bits)
+                    | op->vext;
+
+  write_map_entry(op->pext, [this, op, bytes](int error)
+    {
+      if (error < 0)
+        {
+          map()[op->pext] = 0;
+          finish_alloc(op, error, 0);
+          return;
+        }
+
+      Volume_state &vs = _state[op->volume];
+      vs.extents[op->vext] = op->pext + 1;
+      ++vs.allocated;
+      ++_allocations;
+      finish_alloc(op, L4_EOK, bytes);
+    });
+}
+
+void
+Thin_pool::finish_alloc(std::shared_ptr<Alloc_op> const &op, int error,
+                        l4_size_t bytes)
+{
+  _allocating.erase(std::find_if(_allocating.begin(), _allocating.end(),
+                                 [&op](Allocating const &a)
+                                   { return a.pext == op->pext; }));
+  if (error < 0)
+    --_used;
+
+  --_state[op->volume].in_flight;
+  op->req->piece_done(error, bytes);
+}
+
+int
+Thin_pool::discard(unsigned volume, l4_uint64_t offset,
+                   Block_device::Inout_block const &blocks,
+                   Block_device::Inout_callback const &cb)
+{
+  Volume_state &vs = _state[volume];
+
+  // Freeing an extent that a request in flight still uses could hand it
+  // to another volume before that request has finished.
+  if (vs.in_flight)
+    return -L4_EBUSY;
+
+  l4_uint64_t sectors = header()->volumes[volume].sectors;
+  for (auto const *b = &blocks; b; b = b->next.get())
+    if (offset + b->sector > sectors
+        || b->num_sectors > sectors - offset - b->sector)
+      return -L4_EINVAL;
+
+  auto req = std::make_shared<Request>();
+  req->cb = cb;
+  req->volume = volume;
+
+  // Only extents covered completely are freed, the partially covered ones
+  // keep their content.
+  for (auto const *b = &blocks; b; b = b->next.get())
+    {
+      l4_uint64_t start = offset + b->sector;
+      l4_uint64_t end = start + b->num_sectors;
+      l4_uint64_t first = (start + _extent_sectors - 1) / _extent_sectors;
+      l4_uint64_t last = end / _extent_sectors;
+      if (end == sectors)
+        last = vs.extents.size();
+
+      for (l4_uint64_t vext = first; vext < last; ++vext)
+        {
+          l4_uint64_t pext = vs.extents[vext];
+          if (!pext)
+            continue;
+
+          vs.extents[vext] = 0;
+          --vs.allocated;
+          map()[pext - 1] = 0;
+
+          // The extent stays reserved until the cleared entry is on the
+          // disk, so that no other volume writes to it while the map on the
+          // disk still assigns it to this one.
+          Freeing f{volume, vext, pext - 1};
+          _freeing.push_back(f);
+
+          ++req->pending;
+          write_map_entry(pext - 1, [this, req, f](int error)
+            {
+              if (error < 0)
+                {
+                  finish_free(f, error);
+                  req->piece_done(error, 0);
+                  return;
+                }
+
+              flush_io(_dev, [this, req, f](int error)
+                {
+                  finish_free(f, error);
+                  req->piece_done(error, 0);
+                });
+            });
+        }
+    }
+
+  trace.printf("Discard on volume %u, %u map writes.\n", volume,
+               req->pending - 1);
+
+  req->piece_done(L4_EOK, 0);
+  return L4_EOK;
+}
+
+void
+Thin_pool::finish_free(Freeing const &f, int error)
+{
+  // The disk may still assign the extent to the volume after a failed map
+  // write. Give it back if the volume extent has not been allocated again
+  // meanwhile, otherwise keep the extent reserved until the next load.
+  Volume_state &vs = _state[f.volume];
+  if (error < 0 && vs.extents[f.vext])
+    {
+      Dbg::warn().printf("Thin pool extent %llu lost after failed discard.\n",
+                         f.pext);
+      return;
+    }
+
+  _freeing.erase(std::find_if(_freeing.begin(), _freeing.end(),
+                              [&f](Freeing const &e)
+                                { return e.pext == f.pext; }));
+
+  if (error < 0)
+    {
+      vs.extents[f.vext] = f.pext + 1;
+      ++vs.allocated;
+      map()[f.pext] = (l4_uint64_t(f.volume + 1) << Entry_extent_bits)
+                      | f.vext;
+      return;
+    }
+
+  --_used;
+  ++_frees;
+}
+
+void
+Thin_pool::dump_stats(Dbg const &log) const
+{
+  if (!_num_extents)
+    return;
+
+  log.printf("thin pool %s: %llu/%llu extents used (%u%%), %zu volumes, "
+             "%llu allocations, %llu frees, %llu zero reads\n",
+             _dev->hid().c_str(), _used, _num_extents,
+             stats_percent(_used, _num_extents), _volumes.size(),
+             _allocations, _frees, _zero_reads);
+
+  Header const *h = header();
+  for (unsigned i = 0; i < _volumes.size(); ++i)
+    log.printf("  volume %s: %llu/%llu MiB allocated\n",
+               _volumes[i]->hid().c_str(),
+               _state[i].allocated * Extent_bytes >> 20,
+               (h->volumes[i].sectors * _sector_size) >> 20);
+}
+
+} // namespace Ahci
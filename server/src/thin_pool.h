@@ -0,0 +1,338 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <l4/cxx/ref_ptr>
+#include <l4/cxx/unique_ptr>
+
+#include "ahci_device.h"
+#include "composite_io.h"
+#include "stats.h"
+
+#include <l4/libblock-device/types.h>
+
+namespace Ahci {
+
+class Thin_volume;
+
+/**
+ * Pool of disk space shared by thin-provisioned volumes.
+ *
+ * The pool occupies a whole disk or partition. It starts with a header
+ * describing the layout and the volumes, followed by the allocation map
+ * and the data extents. Each map entry belongs to one extent of the pool
+ * and names the volume and the volume extent stored there, or is 0 if the
+ * extent is free. Header and map are kept in memory; map changes are
+ * written through to the disk sector by sector.
+ *
+ * Extents are allocated on the first write to a volume extent. The new
+ * extent is zeroed unless the write covers it completely, then the data is
+ * written and flushed out of the write cache of the disk and only
+ * afterwards the map entry, so that a volume never sees stale data of the
+ * pool, not even after a crash. Reads of
+ * unallocated extents return zeros without disk I/O and discards return
+ * extents they cover completely to the pool once the cleared map entry is
+ * on the disk.
+ */
+class Thin_pool : public Stats_provider
+{
+  friend class Thin_volume;
+
+  struct Volume_entry
+  {
+    char name[40];
+    l4_uint64_t sectors;
+  };
+
+  struct Header
+  {
+    char magic[8];
+    l4_uint32_t version;
+    l4_uint32_t extent_sectors;
+    l4_uint64_t num_extents;
+    l4_uint64_t map_sector;
+    l4_uint64_t data_sector;
+    l4_uint32_t num_volumes;
+    l4_uint32_t reserved[5];
+    Volume_entry volumes[255];
+  };
+
+  /// In-memory state of a volume.
+  struct Volume_state
+  {
+    /// Pool extent + 1 per volume extent, 0 if unallocated.
+    std::vector<l4_uint64_t> extents;
+    l4_uint64_t allocated = 0;
+    unsigned in_flight = 0;
+  };
+
+  /// Completion state of a client request split over several extents.
+  struct Request : Split_request
+  {
+    unsigned volume;
+  };
+
+  /// Allocation of a pool extent for the first write to a volume extent.
+  struct Alloc_op
+  {
+    std::shared_ptr<Request> req;
+    unsigned volume;
+    l4_uint64_t vext;
+    l4_uint64_t pext;
+    l4_uint64_t offset;
+    l4_uint64_t count;
+    /// Part of the client request that goes into the extent.
+    Block_device::Inout_block blocks;
+  };
+
+  /// Volume extent with an allocation in progress.
+  struct Allocating
+  {
+    unsigned volume;
+    l4_uint64_t vext;
+    l4_uint64_t pext;
+  };
+
+  /// Extent freed by a discard whose map entry is not yet on the disk.
+  struct Freeing
+  {
+    unsigned volume;
+    l4_uint64_t vext;
+    l4_uint64_t pext;
+  };
+
+public:
+  enum
+  {
+    /// Allocation unit of the pool in bytes.
+    Extent_bytes = 0x100000,
+    /// Space reserved for the header in bytes.
+    Header_bytes = 0x4000,
+    /// Maximum number of volumes in a pool.
+    Max_volumes = 255,
+    /// Map entry bits holding the volume extent.
+    Entry_extent_bits = 48,
+  };
+
+  static_assert(sizeof(Header) <= Header_bytes, "Pool header too large.");
+
+  /**
+   * Create a pool on a disk or partition.
+   *
+   * \param dev     Device holding the pool.
+   * \param create  Initialize the device as an empty pool if it does not
+   *                contain one yet.
+   */
+  Thin_pool(cxx::Ref_ptr<Device> const &dev, bool create)
+  : _dev(dev), _create(create)
+  {}
+
+  ~Thin_pool();
+
+  /**
+   * Request a volume.
+   *
+   * \param name  Name of the volume, used by clients to select it.
+   * \param size  Size of the volume in bytes.
+   *
+   * Volumes that are not yet recorded in the pool are added when the pool
+   * is loaded. Existing volumes keep their size.
+   */
+  void add_volume(std::string const &name, l4_uint64_t size)
+  { _requested.push_back({name, size}); }
+
+  /**
+   * Read the pool metadata from the disk and set up the volumes.
+   *
+   * \param callback  Called when the volumes are available or the pool
+   *                  could not be loaded.
+   */
+  void load(Block_device::Errand::Callback const &callback);
+
+  /// Return the volumes of the pool, empty until load() has finished.
+  std::vector<cxx::Ref_ptr<Thin_volume>> const &volumes() const
+  { return _volumes; }
+
+  void dump_stats(Dbg const &log) const override;
+
+private:
+  Header *header() const
+  { return reinterpret_cast<Header *>(_meta_virt); }
+
+  l4_uint64_t *map() const
+  {
+    return reinterpret_cast<l4_uint64_t *>(_meta_virt
+                                           + _map_sector * _sector_size);
+  }
+
+  l4_uint64_t data_sector(l4_uint64_t pext) const
+  { return _data_sector + pext * _extent_sectors; }
+
+  long compute_layout();
+  long alloc_buffer(l4_size_t size,
+                    cxx::unique_ptr<Block_device::Mem_region> *region,
+                    L4Re::Dma_space::Dma_addr *phys, char **virt);
+  void format();
+  void finish_load(bool write_header);
+  bool setup_volumes();
+  void load_done(int error);
+
+  void meta_io(l4_uint64_t sector, l4_uint64_t count,
+               L4Re::Dma_space::Direction dir, Io_done const &done);
+  void write_map_entry(l4_uint64_t pext, Io_done const &done);
+
+  bool is_allocating(unsigned volume, l4_uint64_t vext) const;
+  bool is_reserved(l4_uint64_t pext) const;
+  l4_uint64_t find_free_extent();
+
+  int inout_data(unsigned volume, l4_uint64_t sector,
+                 Block_device::Inout_block const &blocks,
+                 Block_device::Inout_callback const &cb,
+                 L4Re::Dma_space::Direction dir);
+  int discard(unsigned volume, l4_uint64_t offset,
+              Block_device::Inout_block const &blocks,
+              Block_device::Inout_callback const &cb);
+  int start_piece(std::shared_ptr<Request> const &req, l4_uint64_t vext,
+                  l4_uint64_t offset, l4_uint64_t count,
+                  Block_device::Inout_block const &blocks, l4_uint64_t skip,
+                  L4Re::Dma_space::Direction dir);
+  int allocate(std::shared_ptr<Request> const &req, l4_uint64_t vext,
+               l4_uint64_t offset, l4_uint64_t count,
+               Block_device::Inout_block const &blocks, l4_uint64_t skip);
+  void write_alloc_data(std::shared_ptr<Alloc_op> const &op);
+  void commit_alloc(std::shared_ptr<Alloc_op> const &op, l4_size_t bytes);
+  void finish_alloc(std::shared_ptr<Alloc_op> const &op, int error,
+                    l4_size_t bytes);
+  void finish_free(Freeing const &f, int error);
+
+  cxx::Ref_ptr<Device> _dev;
+  bool _create;
+  l4_size_t _sector_size = 0;
+  l4_uint64_t _extent_sectors = 0;
+  l4_uint64_t _num_extents = 0;
+  l4_uint64_t _map_sector = 0;
+  l4_uint64_t _data_sector = 0;
+  l4_uint64_t _used = 0;
+  l4_uint64_t _next_free = 0;
+
+  cxx::unique_ptr<Block_device::Mem_region> _meta;
+  L4Re::Dma_space::Dma_addr _meta_phys = 0;
+  char *_meta_virt = nullptr;
+  cxx::unique_ptr<Block_device::Mem_region> _zero;
+  L4Re::Dma_space::Dma_addr _zero_phys = 0;
+
+  struct Requested_volume
+  {
+    std::string name;
+    l4_uint64_t size;
+  };
+
+  std::vector<Requested_volume> _requested;
+  std::vector<Volume_state> _state;
+  std::vector<cxx::Ref_ptr<Thin_volume>> _volumes;
+  std::vector<Allocating> _allocating;
+  std::vector<Freeing> _freeing;
+  Block_device::Errand::Callback _load_cb;
+
+  l4_uint64_t _zero_reads = 0;
+  l4_uint64_t _allocations = 0;
+  l4_uint64_t _frees = 0;
+};
+
+/**
+ * Thin-provisioned volume in a Thin_pool.
+ */
+class Thin_volume
+: public Device,
+  public Block_device::Device_discard_feature
+{
+public:
+  Thin_volume(Thin_pool *pool, unsigned index, std::string const &name,
+              l4_uint64_t sectors)
+  : _pool(pool), _index(index), _name(name), _sectors(sectors)
+  {}
+
+  Block_device::Notification_domain const *notification_domain() const override
+  { return _pool->_dev->notification_domain(); }
+
+  bool is_read_only() const override
+  { return _pool->_dev->is_read_only(); }
+
+  bool match_hid(cxx::String const &hid) const override
+  { return hid == cxx::String(_name.c_str(), _name.length()); }
+
+  l4_uint64_t capacity() const override
+  { return _sectors * _pool->_sector_size; }
+
+  l4_size_t sector_size() const override
+  { return _pool->_sector_size; }
+
+  l4_size_t max_size() const override
+  { return _pool->_dev->max_size(); }
+
+  unsigned max_segments() const override
+  { return _pool->_dev->max_segments(); }
+
+  unsigned max_in_flight() const override
+  { return _pool->_dev->max_in_flight(); }
+
+  std::string const &hid() const override
+  { return _name; }
+
+  void reset() override
+  {}
+
+  int dma_map(Block_device::Mem_region *region, l4_addr_t offset,
+              l4_size_t num_sectors, L4Re::Dma_space::Direction dir,
+              L4Re::Dma_space::Dma_addr *phys) override
+  { return _pool->_dev->dma_map(region, offset, num_sectors, dir, phys); }
+
+  int dma_unmap(L4Re::Dma_space::Dma_addr phys, l4_size_t num_sectors,
+                L4Re::Dma_space::Direction dir) override
+  { return _pool->_dev->dma_unmap(phys, num_sectors, dir); }
+
+  int inout_data(l4_uint64_t sector, Block_device::Inout_block const &blocks,
+                 Block_device::Inout_callback const &cb,
+                 L4Re::Dma_space::Direction dir) override
+  { return _pool->inout_data(_index, sector, blocks, cb, dir); }
+
+  int flush(Block_device::Inout_callback const &cb) override
+  { return _pool->_dev->flush(cb); }
+
+  void start_device_scan(Block_device::Errand::Callback const &callback) override
+  { callback(); }
+
+  Discard_info discard_info() const override
+  {
+    Discard_info di;
+    di.max_discard_sectors = -1U;
+    di.max_discard_seg = 1;
+    di.discard_sector_alignment = _pool->_extent_sectors;
+    return di;
+  }
+
+  int discard(l4_uint64_t offset, Block_device::Inout_block const &blocks,
+              Block_device::Inout_callback const &cb, bool discard) override
+  {
+    // Write zeroes is not advertised.
+    if (!discard)
+      return -L4_ENOSYS;
+
+    return _pool->discard(_index, offset, blocks, cb);
+  }
+
+private:
+  Thin_pool *_pool;
+  unsigned _index;
+  std::string _name;
+  l4_uint64_t _sectors;
+};
+
+} // namespace Ahci